@@ -0,0 +1,716 @@
+#include "mkmock.hpp"
+
+MKMOCK_DEFINE_HOOK(open_response_error, int64_t);
+MKMOCK_DEFINE_HOOK(open_response_status_code, int64_t);
+MKMOCK_DEFINE_HOOK(open_response_body, std::string);
+MKMOCK_DEFINE_HOOK(update_response_error, int64_t);
+MKMOCK_DEFINE_HOOK(update_response_status_code, int64_t);
+
+#define MKCURL_INLINE_IMPL
+#include "mkcurl.hpp"
+
+#define MKBOUNCER_INLINE_IMPL
+#include "mkbouncer.hpp"
+
+MKMOCK_DEFINE_HOOK(bouncer_response_good, bool);
+MKMOCK_DEFINE_HOOK(
+    bouncer_response_collectors, std::vector<mk::bouncer::Record>);
+MKMOCK_DEFINE_HOOK(reporter_close_response_good, bool);
+MKMOCK_DEFINE_HOOK(reporter_open_response_good, bool);
+MKMOCK_DEFINE_HOOK(reporter_open_response_report_id, std::string);
+MKMOCK_DEFINE_HOOK(reporter_parked_report_expired, bool);
+MKMOCK_DEFINE_HOOK(reporter_update_response_good, bool);
+
+#define MKCOLLECTOR_MOCK
+#define MKCOLLECTOR_INLINE_IMPL
+#include "mkcollector.hpp"
+
+#include "loopback-collector.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <utility>
+
+#include <stdlib.h>
+
+// allocations counts the calls to operator new, such that we can measure
+// how many heap allocations the submission path performs.
+static std::atomic<uint64_t> allocations{0};
+
+// large_allocations counts the calls to operator new for at least
+// large_allocation_size bytes. When such size is the size of a measurement,
+// this is the number of times we copied the measurement.
+static std::atomic<uint64_t> large_allocations{0};
+
+// large_allocation_size is the minimum size of a large allocation.
+static std::atomic<size_t> large_allocation_size{SIZE_MAX};
+
+void *operator new(size_t size) {
+  allocations += 1;
+  if (size >= large_allocation_size) {
+    large_allocations += 1;
+  }
+  void *p = malloc((size > 0) ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+// Note: recent GCC warns that free is called on memory returned by operator
+// new, which is what we want here, since we are replacing operator new.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept { free(p); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+// synthetic_measurement returns a measurement whose size is about @p size
+// bytes, most of which live inside test_keys, like it happens for real
+// web_connectivity measurements.
+static std::string synthetic_measurement(size_t size) {
+  nlohmann::json doc;
+  doc["annotations"] = nlohmann::json::object();
+  doc["data_format_version"] = "0.2.0";
+  doc["input"] = "https://www.example.com/";
+  doc["probe_asn"] = "AS0";
+  doc["probe_cc"] = "ZZ";
+  doc["report_id"] = "";
+  doc["software_name"] = "mkcollector";
+  doc["software_version"] = "0.0.1";
+  doc["test_keys"] = nlohmann::json::object();
+  doc["test_keys"]["requests"] = nlohmann::json::array();
+  doc["test_name"] = "web_connectivity";
+  doc["test_runtime"] = 5.0565230846405;
+  doc["test_start_time"] = "2018-11-01 15:33:17";
+  doc["test_version"] = "0.0.1";
+  size_t current = doc.dump().size();
+  while (current < size) {
+    nlohmann::json entry;
+    entry["request"]["url"] = "https://www.example.com/";
+    entry["request"]["headers"]["User-Agent"] = "Mozilla/5.0";
+    entry["response"]["code"] = 200;
+    entry["response"]["body"] = std::string(
+        std::min<size_t>(size - current, 512), 'x');
+    current += entry.dump().size() + 1;
+    doc["test_keys"]["requests"].push_back(std::move(entry));
+  }
+  return doc.dump();
+}
+
+// legacy_update_body is how the update body was computed when we used
+// to parse the measurement three times and serialize it twice.
+static std::string legacy_update_body(
+    const std::string &measurement, const std::string &report_id) {
+  auto doc = nlohmann::json::parse(measurement);
+  doc["report_id"] = report_id;
+  auto content = doc.dump();
+  nlohmann::json envelope;
+  envelope["format"] = "json";
+  envelope["content"] = nlohmann::json::parse(content);
+  return envelope.dump();
+}
+
+// current_update_body is how the Reporter currently computes the body.
+static std::string current_update_body(
+    const std::string &measurement, const std::string &report_id) {
+  auto doc = nlohmann::json::parse(measurement);
+  doc["report_id"] = report_id;
+  mk::collector::validate_update_content_(doc, report_id);
+  return mk::collector::make_update_body_(doc.dump());
+}
+
+// spliced_update_body is like current_update_body when the Reporter
+// is configured to splice the report ID into the original measurement.
+static std::string spliced_update_body(
+    const std::string &measurement, const std::string &report_id) {
+  auto doc = nlohmann::json::parse(measurement);
+  doc["report_id"] = report_id;
+  mk::collector::validate_update_content_(doc, report_id);
+  std::string content = measurement;
+  mk::collector::splice_report_id_(content, report_id);
+  return mk::collector::make_update_body_(content);
+}
+
+// envelope_update_body is how update_with_client_ computes the body of a
+// measurement whose report ID has already been set by the caller.
+static std::string envelope_update_body(
+    const std::string &content, const std::string &report_id) {
+  mk::collector::validate_update_content_(
+      nlohmann::json::parse(content), report_id);
+  return mk::collector::make_update_body_(content);
+}
+
+template <typename Func>
+static double nanoseconds_per_byte(
+    const std::string &measurement, size_t iterations, Func &&func) {
+  const std::string report_id = "20180208T095233Z_AS0_benchmark";
+  size_t total = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    total += func(measurement, report_id).size();
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (total == 0) {
+    throw std::runtime_error("the compiler optimized away the benchmark");
+  }
+  std::chrono::duration<double, std::nano> elapsed = end - begin;
+  return elapsed.count() / double(iterations * measurement.size());
+}
+
+// dom_open_request loads an OpenRequest by building a DOM.
+static std::string dom_open_request(
+    const std::string &measurement, const std::string &) {
+  nlohmann::json doc;
+  auto re = mk::collector::open_request_from_measurement_with_json_(
+      measurement, "mkcollector", "0.0.1", doc);
+  return re.value.test_name;
+}
+
+// scanner_open_request loads an OpenRequest using the scanner.
+static std::string scanner_open_request(
+    const std::string &measurement, const std::string &) {
+  auto re = mk::collector::open_request_from_measurement(
+      measurement, "mkcollector", "0.0.1");
+  return re.value.test_name;
+}
+
+// mocked_base_url is a base URL where nobody should be listening. We use
+// the mocking hooks to pretend that the collector accepted our requests
+// after the connection has been refused, such that we measure the cost
+// of the Reporter itself rather than the cost of the network.
+static const char *mocked_base_url = "http://127.0.0.1:9";
+
+// with_mocked_transport runs @p func while the mocked transport is enabled.
+template <typename Func> static void with_mocked_transport(Func &&func) {
+  MKMOCK_WITH_ENABLED_HOOK(open_response_error, 0, {
+    MKMOCK_WITH_ENABLED_HOOK(open_response_status_code, 200, {
+      MKMOCK_WITH_ENABLED_HOOK(open_response_body,
+                               R"({"report_id": "20180208T095233Z_AS0_x"})", {
+        MKMOCK_WITH_ENABLED_HOOK(update_response_error, 0, {
+          MKMOCK_WITH_ENABLED_HOOK(update_response_status_code, 200, {
+            func();
+          });
+        });
+      });
+    });
+  });
+}
+
+// interleaved_measurements returns @p count measurements of about @p size
+// bytes alternating between two test names, as done by our scheduler.
+static std::vector<std::string> interleaved_measurements(
+    size_t count, size_t size) {
+  std::vector<std::string> measurements;
+  auto base = nlohmann::json::parse(synthetic_measurement(size));
+  for (size_t i = 0; i < count; ++i) {
+    base["test_name"] = (i % 2 == 0) ? "web_connectivity" : "ndt";
+    measurements.push_back(base.dump());
+  }
+  return measurements;
+}
+
+// measurements_per_second returns the throughput of @p func, which is
+// expected to submit @p count measurements.
+template <typename Func>
+static double measurements_per_second(size_t count, Func &&func) {
+  auto begin = std::chrono::steady_clock::now();
+  with_mocked_transport(func);
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = end - begin;
+  return double(count) / elapsed.count();
+}
+
+// benchmark_open_body measures how long open_with_client_ takes to
+// serialize the body of the request that opens a report.
+static void benchmark_open_body() {
+  auto re = mk::collector::open_request_from_measurement(
+      synthetic_measurement(1 << 10), "mkcollector", "0.0.1");
+  const size_t iterations = 100000;
+  size_t total = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    total += mk::collector::make_open_body_(re.value).size();
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (total == 0) {
+    throw std::runtime_error("the compiler optimized away the benchmark");
+  }
+  std::chrono::duration<double, std::nano> elapsed = end - begin;
+  nlohmann::json result;
+  result["benchmark"] = "open_body";
+  result["bytes"] = total / iterations;
+  result["iterations"] = iterations;
+  result["ns_per_call"] = elapsed.count() / double(iterations);
+  std::cout << result.dump() << std::endl;
+}
+
+// benchmark_reporter_submit measures the full Reporter path for a single
+// @p measurement using the mocked transport. Since all the measurements
+// share the same report, we measure opening the report just once.
+static void benchmark_reporter_submit(
+    const std::string &measurement, size_t iterations) {
+  mk::collector::Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+  reporter.set_base_url(mocked_base_url);
+  mk::collector::Reporter::Stats stats;
+  std::chrono::duration<double, std::nano> elapsed{};
+  with_mocked_transport([&]() {
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+      std::string copy = measurement;
+      std::vector<std::string> logs;
+      std::string reason;
+      if (!reporter.maybe_discover_and_submit_with_stats_and_reason(
+              copy, logs, 0, stats, reason)) {
+        throw std::runtime_error(reason);
+      }
+    }
+    elapsed = std::chrono::steady_clock::now() - begin;
+  });
+  nlohmann::json result;
+  result["benchmark"] = "reporter_submit";
+  result["bytes"] = measurement.size();
+  result["iterations"] = iterations;
+  result["ns_per_byte"] =
+      elapsed.count() / double(iterations * measurement.size());
+  // Break down where the time goes using the per-phase histograms.
+  auto latency = nlohmann::json::parse(stats.to_json()).at("latency");
+  for (auto it = latency.begin(); it != latency.end(); ++it) {
+    if (it.value().at("count") == 0) {
+      continue;
+    }
+    auto &phase = result["phases_usec"][it.key()];
+    phase["mean"] = it.value().at("mean");
+    phase["p50"] = it.value().at("p50");
+    phase["p99"] = it.value().at("p99");
+  }
+  std::cout << result.dump() << std::endl;
+}
+
+// benchmark_submit_allocations measures the heap allocations performed
+// when submitting @p measurement, with and without the JSON arena.
+static void benchmark_submit_allocations(const std::string &measurement) {
+  const size_t iterations = 64;
+  nlohmann::json result;
+  result["benchmark"] = "submit_allocations";
+  result["bytes"] = measurement.size();
+  result["iterations"] = iterations;
+  for (size_t arena_size : {(size_t)0, (size_t)4 << 20}) {
+    mk::collector::Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+    reporter.set_base_url(mocked_base_url);
+    reporter.set_log_level(mk::collector::LogLevel::quiet);
+    reporter.set_json_arena_max_size(arena_size);
+    mk::collector::Reporter::Stats stats;
+    uint64_t count = 0;
+    with_mocked_transport([&]() {
+      for (size_t i = 0; i < iterations + 1; ++i) {
+        std::string copy = measurement;
+        std::vector<std::string> logs;
+        std::string reason;
+        // Note: the first submission opens the report and warms up the
+        // arena, so we don't count it.
+        uint64_t before = allocations;
+        if (!reporter.maybe_discover_and_submit_with_stats_and_reason(
+                copy, logs, 0, stats, reason)) {
+          throw std::runtime_error(reason);
+        }
+        if (i > 0) {
+          count += allocations - before;
+        }
+      }
+    });
+    result[(arena_size > 0) ? "arena_allocations_per_submission"
+                            : "heap_allocations_per_submission"] =
+        double(count) / double(iterations);
+  }
+  std::cout << result.dump() << std::endl;
+}
+
+// benchmark_submit_copies measures how many times we copy @p measurement
+// when submitting it, depending on how we submit it.
+static void benchmark_submit_copies(const std::string &measurement) {
+  const size_t iterations = 16;
+  nlohmann::json result;
+  result["benchmark"] = "submit_copies";
+  result["bytes"] = measurement.size();
+  result["iterations"] = iterations;
+  for (int mode = 0; mode < 3; ++mode) {
+    mk::collector::Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+    reporter.set_base_url(mocked_base_url);
+    reporter.set_log_level(mk::collector::LogLevel::quiet);
+    reporter.set_report_id_splicing(mode > 0);
+    mk::collector::Reporter::Stats stats;
+    uint64_t count = 0;
+    with_mocked_transport([&]() {
+      for (size_t i = 0; i < iterations; ++i) {
+        std::string copy = measurement;
+        std::vector<std::string> logs;
+        std::string reason;
+        uint64_t before = large_allocations;
+        large_allocation_size = measurement.size();
+        bool good = (mode < 2)
+            ? reporter.maybe_discover_and_submit_with_stats_and_reason(
+                  copy, logs, 0, stats, reason)
+            : reporter.maybe_discover_and_submit_with_stats_and_reason(
+                  std::move(copy), logs, 0, stats, reason);
+        large_allocation_size = SIZE_MAX;
+        if (!good) {
+          throw std::runtime_error(reason);
+        }
+        count += large_allocations - before;
+      }
+    });
+    static const char *names[] = {"reserialized_copies_per_submission",
+                                  "spliced_copies_per_submission",
+                                  "consumed_copies_per_submission"};
+    result[names[mode]] = double(count) / double(iterations);
+  }
+  std::cout << result.dump() << std::endl;
+}
+
+static void benchmark_batch_submission() {
+  const size_t count = 1000;
+  for (size_t size = 1 << 10; size <= (size_t)64 << 10; size <<= 3) {
+    nlohmann::json result;
+    result["benchmark"] = "reporter_throughput";
+    result["bytes"] = size;
+    result["measurements"] = count;
+    {
+      auto measurements = interleaved_measurements(count, size);
+      mk::collector::Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+      reporter.set_base_url(mocked_base_url);
+      mk::collector::Reporter::Stats stats;
+      result["sequential_measurements_per_second"] = measurements_per_second(
+          count, [&]() {
+            for (auto &measurement : measurements) {
+              std::vector<std::string> logs;
+              std::string reason;
+              (void)reporter.maybe_discover_and_submit_with_stats_and_reason(
+                  measurement, logs, 0, stats, reason);
+            }
+          });
+      result["sequential_update_report_okay"] = stats.update_report_okay;
+      result["sequential_open_report_okay"] = stats.open_report_okay;
+    }
+    {
+      auto measurements = interleaved_measurements(count, size);
+      mk::collector::Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+      reporter.set_base_url(mocked_base_url);
+      mk::collector::Reporter::Stats stats;
+      result["batch_measurements_per_second"] = measurements_per_second(
+          count, [&]() {
+            std::vector<std::string> logs;
+            (void)reporter.submit_batch(measurements, logs, 0, stats);
+          });
+      result["batch_update_report_okay"] = stats.update_report_okay;
+      result["batch_open_report_okay"] = stats.open_report_okay;
+    }
+    std::cout << result.dump() << std::endl;
+  }
+}
+
+#ifndef _WIN32
+// compression_name returns the name of @p compression.
+static const char *compression_name(mk::collector::Compression compression) {
+  switch (compression) {
+    case mk::collector::Compression::gzip:
+      return "gzip";
+    case mk::collector::Compression::deflate:
+      return "deflate";
+    default:
+      break;
+  }
+  return "none";
+}
+
+static void benchmark_compressed_uploads() {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  if (!collector.good()) {
+    throw std::runtime_error("cannot start the loopback collector");
+  }
+  for (size_t size = 1 << 10; size <= (size_t)4 << 20; size <<= 4) {
+    auto measurement = synthetic_measurement(size);
+    size_t count = std::max<size_t>(4, ((size_t)64 << 20) / size / 8);
+    for (auto compression : {Compression::none, Compression::gzip,
+                             Compression::deflate}) {
+      for (int level : {1, 6, 9}) {
+        if (compression == Compression::none && level != 1) {
+          continue;
+        }
+        Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+        reporter.set_base_url(collector.base_url());
+        reporter.set_compression(compression);
+        reporter.set_compression_level(level);
+        reporter.set_log_level(LogLevel::quiet);
+        std::vector<std::string> measurements(count, measurement);
+        Reporter::Stats stats;
+        std::vector<std::string> logs;
+        auto begin = std::chrono::steady_clock::now();
+        (void)reporter.submit_batch(measurements, logs, 0, stats);
+        auto end = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = end - begin;
+        nlohmann::json result;
+        result["benchmark"] = "compressed_uploads";
+        result["bytes"] = measurement.size();
+        result["measurements"] = count;
+        result["compression"] = compression_name(compression);
+        result["level"] = level;
+        result["update_report_okay"] = stats.update_report_okay;
+        result["measurements_per_second"] = double(count) / elapsed.count();
+        result["upload_ratio"] = double(stats.update_upload_bytes) /
+                                 double(stats.update_body_bytes);
+        std::cout << result.dump() << std::endl;
+      }
+    }
+  }
+}
+
+// benchmark_tail_latency measures the Reporter throughput and the update
+// tail latency against a loopback collector with latency and errors.
+static void benchmark_tail_latency() {
+  using namespace mk::collector;
+  LoopbackCollector::Config config;
+  config.latency = 1;
+  config.latency_jitter = 4;
+  config.error_rate = 0.01;
+  LoopbackCollector collector{config};
+  if (!collector.good()) {
+    throw std::runtime_error("cannot start the loopback collector");
+  }
+  const size_t count = 1000;
+  auto measurement = synthetic_measurement(4 << 10);
+  for (size_t in_flight : {1, 4, 16}) {
+    Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.set_log_level(LogLevel::quiet);
+    reporter.set_max_updates_in_flight(in_flight);
+    RetryPolicy policy;
+    policy.max_attempts = 4;
+    policy.initial_backoff = 10;
+    reporter.set_retry_policy(policy);
+    std::vector<std::string> measurements(count, measurement);
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    auto begin = std::chrono::steady_clock::now();
+    (void)reporter.submit_batch(measurements, logs, 0, stats);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = end - begin;
+    nlohmann::json result;
+    result["benchmark"] = "tail_latency";
+    result["bytes"] = measurement.size();
+    result["measurements"] = count;
+    result["in_flight"] = in_flight;
+    result["latency_msec"] = config.latency;
+    result["latency_jitter_msec"] = config.latency_jitter;
+    result["error_rate"] = config.error_rate;
+    result["update_report_okay"] = stats.update_report_okay;
+    result["retry_attempt"] = stats.retry_attempt;
+    result["measurements_per_second"] = double(count) / elapsed.count();
+    result["update_usec"]["p50"] = stats.update_latency.percentile(50.0);
+    result["update_usec"]["p99"] = stats.update_latency.percentile(99.0);
+    result["update_usec"]["p999"] = stats.update_latency.percentile(99.9);
+    result["update_usec"]["max"] = stats.update_latency.max();
+    std::cout << result.dump() << std::endl;
+  }
+}
+
+// benchmark_http2_transport compares serial HTTP/1.1 updates, concurrent
+// HTTP/1.1 updates, and HTTP/2 updates multiplexed over a single connection
+// against a loopback collector with latency.
+static void benchmark_http2_transport() {
+  using namespace mk::collector;
+  const size_t count = 1000;
+  auto measurement = synthetic_measurement(4 << 10);
+  for (auto in_flight_http2 : {std::make_pair((size_t)1, false),
+                               std::make_pair((size_t)16, false),
+                               std::make_pair((size_t)16, true)}) {
+    LoopbackCollector::Config config;
+    config.latency = 5;
+    LoopbackCollector collector{config};
+    if (!collector.good()) {
+      throw std::runtime_error("cannot start the loopback collector");
+    }
+    Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.set_log_level(LogLevel::quiet);
+    reporter.set_max_updates_in_flight(in_flight_http2.first);
+    reporter.set_http2(in_flight_http2.second);
+    std::vector<std::string> measurements(count, measurement);
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    auto begin = std::chrono::steady_clock::now();
+    (void)reporter.submit_batch(measurements, logs, 0, stats);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = end - begin;
+    auto collector_stats = collector.stats();
+    nlohmann::json result;
+    result["benchmark"] = "http2_transport";
+    result["bytes"] = measurement.size();
+    result["measurements"] = count;
+    result["in_flight"] = in_flight_http2.first;
+    result["http2"] = in_flight_http2.second;
+    result["latency_msec"] = config.latency;
+    result["update_report_okay"] = stats.update_report_okay;
+    result["measurements_per_second"] = double(count) / elapsed.count();
+    result["connections"] = collector_stats.connections;
+    result["http2_streams"] = collector_stats.http2_streams;
+    result["update_usec"]["p50"] = stats.update_latency.percentile(50.0);
+    result["update_usec"]["p99"] = stats.update_latency.percentile(99.0);
+    std::cout << result.dump() << std::endl;
+  }
+}
+
+static void benchmark_spool_drain() {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  if (!collector.good()) {
+    throw std::runtime_error("cannot start the loopback collector");
+  }
+  char directory[] = "/tmp/mkcollector-benchmarks-XXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    throw std::runtime_error("cannot create the spool directory");
+  }
+  const size_t count = 100000;
+  nlohmann::json result;
+  result["benchmark"] = "spool_drain";
+  result["measurements"] = count;
+  {
+    auto spool = std::make_shared<Spool>(directory);
+    std::string reason;
+    if (!spool->open(reason)) {
+      throw std::runtime_error(reason);
+    }
+    auto measurement = synthetic_measurement(1 << 10);
+    result["bytes"] = measurement.size();
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      if (!spool->append(measurement, reason)) {
+        throw std::runtime_error(reason);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = end - begin;
+    result["append_measurements_per_second"] = double(count) / elapsed.count();
+    Reporter reporter{"mkcollector-benchmarks", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.set_log_level(LogLevel::quiet);
+    reporter.set_max_updates_in_flight(8);
+    reporter.set_spool(spool);
+    Reporter::Stats stats;
+    begin = std::chrono::steady_clock::now();
+    while (spool->size() > 0) {
+      std::vector<std::string> logs;
+      if (reporter.drain_spool(1000, logs, 0, stats) <= 0) {
+        throw std::runtime_error("cannot drain the spool");
+      }
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = end - begin;
+    result["drain_measurements_per_second"] = double(count) / elapsed.count();
+    result["update_report_okay"] = stats.update_report_okay;
+  }
+  if (DIR *dir = opendir(directory)) {
+    std::vector<std::string> names;
+    while (struct dirent *de = readdir(dir)) {
+      names.push_back(std::string{directory} + "/" + de->d_name);
+    }
+    closedir(dir);
+    for (auto &name : names) {
+      (void)unlink(name.c_str());
+    }
+  }
+  (void)rmdir(directory);
+  std::cout << result.dump() << std::endl;
+}
+#endif
+
+// measurement_sizes returns the sizes of the measurements we use, growing
+// by a factor of four from 1 KiB, and ending with @p max_size.
+static std::vector<size_t> measurement_sizes(size_t max_size) {
+  std::vector<size_t> sizes;
+  for (size_t size = 1 << 10; size < max_size; size <<= 2) {
+    sizes.push_back(size);
+  }
+  sizes.push_back(max_size);
+  return sizes;
+}
+
+// parse_max_size parses @p s as the maximum measurement size into @p value,
+// which must be an integer not smaller than 1 KiB.
+static bool parse_max_size(const char *s, size_t &value) {
+  char *end = nullptr;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || v < 1024 || v > SIZE_MAX) {
+    return false;
+  }
+  value = (size_t)v;
+  return true;
+}
+
+// Usage: benchmarks [max_size]
+//
+// Writes one JSON object per line describing each result. The optional
+// max_size argument is the size in bytes of the largest measurement we
+// generate, which is 50 MB by default and at least 1 KiB. Use a smaller
+// value for quick runs.
+int main(int argc, char **argv) {
+  size_t max_size = 50 * 1000 * 1000;
+  if (argc > 2 || (argc == 2 && !parse_max_size(argv[1], max_size))) {
+    std::clog << "Usage: benchmarks [max_size]\n"
+              << "\n"
+              << "max_size is the size in bytes of the largest measurement,"
+              << " which must be\nat least 1024 (default: 50000000).\n";
+    exit(EXIT_FAILURE);
+  }
+  benchmark_open_body();
+  for (size_t size : measurement_sizes(max_size)) {
+    auto measurement = synthetic_measurement(size);
+    size_t iterations = std::max<size_t>(1, ((size_t)64 << 20) / size);
+    nlohmann::json result;
+    result["benchmark"] = "update_body";
+    result["bytes"] = measurement.size();
+    result["iterations"] = iterations;
+    result["legacy_ns_per_byte"] = nanoseconds_per_byte(
+        measurement, iterations, legacy_update_body);
+    result["current_ns_per_byte"] = nanoseconds_per_byte(
+        measurement, iterations, current_update_body);
+    result["spliced_ns_per_byte"] = nanoseconds_per_byte(
+        measurement, iterations, spliced_update_body);
+    {
+      const std::string report_id = "20180208T095233Z_AS0_benchmark";
+      auto doc = nlohmann::json::parse(measurement);
+      doc["report_id"] = report_id;
+      result["envelope_ns_per_byte"] = nanoseconds_per_byte(
+          doc.dump(), iterations, envelope_update_body);
+    }
+    std::cout << result.dump() << std::endl;
+    result = nlohmann::json::object();
+    result["benchmark"] = "open_request_from_measurement";
+    result["bytes"] = measurement.size();
+    result["iterations"] = iterations;
+    result["dom_ns_per_byte"] = nanoseconds_per_byte(
+        measurement, iterations, dom_open_request);
+    result["scanner_ns_per_byte"] = nanoseconds_per_byte(
+        measurement, iterations, scanner_open_request);
+    std::cout << result.dump() << std::endl;
+    benchmark_reporter_submit(
+        measurement, std::min<size_t>(iterations, 1024));
+    if (size <= (size_t)4 << 20) {
+      benchmark_submit_allocations(measurement);
+    }
+    benchmark_submit_copies(measurement);
+  }
+  benchmark_batch_submission();
+#ifndef _WIN32
+  benchmark_compressed_uploads();
+  benchmark_tail_latency();
+  benchmark_http2_transport();
+  benchmark_spool_drain();
+#endif
+}
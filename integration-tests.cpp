@@ -35,7 +35,7 @@ static std::string open_report() {
     REQUIRE(re.logs.size() > 0);
     std::clog << "=== BEGIN OPEN LOGS ===" << std::endl;
     for (auto &line : re.logs) {
-      std::clog << line << std::endl;
+      std::clog << line.message << std::endl;
     }
     std::clog << "=== END OPEN LOGS ===" << std::endl;
   }
@@ -100,7 +100,7 @@ static void update_report(std::string report_id) {
     REQUIRE(re.logs.size() > 0);
     std::clog << "=== BEGIN UPDATE LOGS ===" << std::endl;
     for (auto &line : re.logs) {
-      std::clog << line << std::endl;
+      std::clog << line.message << std::endl;
     }
     std::clog << "=== END UPDATE LOGS ===" << std::endl;
   }
@@ -121,7 +121,7 @@ TEST_CASE("We can open, update, and close a report") {
     REQUIRE(re.logs.size() > 0);
     std::clog << "=== BEGIN CLOSE LOGS ===" << std::endl;
     for (auto &line : re.logs) {
-      std::clog << line << std::endl;
+      std::clog << line.message << std::endl;
     }
     std::clog << "=== END CLOSE LOGS ===" << std::endl;
   }
@@ -159,7 +159,7 @@ TEST_CASE("We work around the ooniprobe-android 2.0.0 upload bug") {
     auto response = mk::collector::open(request.value, settings);
     REQUIRE(!response.good);
     for (auto &log : response.logs) {
-      std::clog << log << std::endl;
+      std::clog << log.message << std::endl;
     }
   }
 }
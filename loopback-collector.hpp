@@ -0,0 +1,1405 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_LOOPBACK_COLLECTOR_HPP
+#define MEASUREMENT_KIT_LOOPBACK_COLLECTOR_HPP
+
+// LoopbackCollector is a minimal OONI collector listening on the loopback
+// interface, used to test and benchmark mkcollector without the network.
+// It implements just enough HTTP/1.1 to talk with libcurl (persistent
+// connections, `Expect: 100-continue`, and compressed request bodies), and
+// just enough cleartext HTTP/2 with prior knowledge to serve many concurrent
+// streams on the same connection. It optionally speaks HTTPS, using a self
+// signed certificate, to test TLS session resumption. It can inject latency,
+// errors, throttling, and body size limits, so that we can reproducibly
+// measure how the Reporter behaves under such conditions. It uses POSIX
+// sockets, hence it is not available on Windows.
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <zlib.h>
+
+#include "json.hpp"
+
+namespace mk {
+namespace collector {
+
+/// LoopbackCollector is a collector listening on 127.0.0.1.
+class LoopbackCollector {
+ public:
+  /// Config contains the faults to inject. The default injects none.
+  struct Config {
+    /// latency is the number of milliseconds we wait before responding.
+    int64_t latency = 0;
+
+    /// latency_jitter is the maximum number of milliseconds that we
+    /// randomly add to latency, using a uniform distribution.
+    int64_t latency_jitter = 0;
+
+    /// error_rate is the probability of failing a request with 500.
+    double error_rate = 0.0;
+
+    /// max_requests_per_second is the maximum request rate, above which we
+    /// respond with 429 and Retry-After. Zero means no limit. We allow for
+    /// bursts of up to max_requests_per_second requests.
+    double max_requests_per_second = 0.0;
+
+    /// max_body_size is the maximum request body size, above which we
+    /// respond with 413. Zero means no limit.
+    size_t max_body_size = 0;
+
+    /// seed is the seed of the random generator used for the latency
+    /// jitter and the errors, for reproducibility.
+    uint32_t seed = 1;
+
+    /// tls indicates that we speak HTTPS, using a self signed certificate
+    /// for 127.0.0.1, which clients can verify using ca_bundle_path.
+    bool tls = false;
+  };
+
+  /// Stats contains statistics about what the collector received.
+  struct Stats {
+    /// reports_opened is the number of reports opened.
+    uint64_t reports_opened = 0;
+
+    /// updates is the number of valid updates received.
+    uint64_t updates = 0;
+
+    /// compressed_updates is the number of valid compressed updates.
+    uint64_t compressed_updates = 0;
+
+    /// reports_closed is the number of reports closed.
+    uint64_t reports_closed = 0;
+
+    /// probes is the number of GET requests for the root path.
+    uint64_t probes = 0;
+
+    /// bad_requests is the number of requests we rejected.
+    uint64_t bad_requests = 0;
+
+    /// injected_errors is the number of requests we failed with 500.
+    uint64_t injected_errors = 0;
+
+    /// throttled is the number of requests we failed with 429.
+    uint64_t throttled = 0;
+
+    /// too_large is the number of requests we failed with 413.
+    uint64_t too_large = 0;
+
+    /// update_upload_bytes is the number of update body bytes received.
+    uint64_t update_upload_bytes = 0;
+
+    /// update_body_bytes is the number of update body bytes received,
+    /// after decompressing them.
+    uint64_t update_body_bytes = 0;
+
+    /// connections is the number of connections we accepted.
+    uint64_t connections = 0;
+
+    /// http2_connections is the number of connections using HTTP/2.
+    uint64_t http2_connections = 0;
+
+    /// http2_streams is the number of HTTP/2 requests we received.
+    uint64_t http2_streams = 0;
+
+    /// tls_handshakes is the number of successful TLS handshakes.
+    uint64_t tls_handshakes = 0;
+
+    /// tls_resumed_handshakes is the number of TLS handshakes resuming a
+    /// previous session.
+    uint64_t tls_resumed_handshakes = 0;
+  };
+
+  /// LoopbackCollector starts the collector on a random port.
+  LoopbackCollector() noexcept;
+
+  /// LoopbackCollector starts the collector on a random port using
+  /// @p config to decide what faults to inject.
+  explicit LoopbackCollector(Config config) noexcept;
+
+  /// LoopbackCollector is the deleted copy constructor.
+  LoopbackCollector(const LoopbackCollector &) noexcept = delete;
+
+  /// LoopbackCollector is the deleted copy assignment.
+  LoopbackCollector &operator=(const LoopbackCollector &) noexcept = delete;
+
+  /// LoopbackCollector is the deleted move constructor.
+  LoopbackCollector(LoopbackCollector &&) noexcept = delete;
+
+  /// LoopbackCollector is the deleted move assignment.
+  LoopbackCollector &operator=(LoopbackCollector &&) noexcept = delete;
+
+  /// good returns whether the collector is listening.
+  bool good() const noexcept;
+
+  /// base_url returns the collector base URL.
+  std::string base_url() const noexcept;
+
+  /// ca_bundle_path returns the path of the file containing our certificate
+  /// when we speak HTTPS, and an empty string otherwise.
+  std::string ca_bundle_path() const noexcept;
+
+  /// stats returns a copy of the current stats.
+  Stats stats() const noexcept;
+
+  /// ~LoopbackCollector stops the collector and waits for its threads.
+  ~LoopbackCollector() noexcept;
+
+ private:
+  // Request is an HTTP request.
+  struct Request {
+    std::string method;
+    std::string path;
+    std::string content_encoding;
+    std::string body;
+  };
+
+  // accept_loop_ accepts connections until we are stopped.
+  void accept_loop_() noexcept;
+
+  // serve_ serves the requests received on @p fd.
+  void serve_(int fd) noexcept;
+
+  // setup_tls_ creates the certificate and the TLS context.
+  bool setup_tls_() noexcept;
+
+  // serve_tls_ performs the TLS handshake on @p fd and forwards the
+  // plaintext to and from serve_, running in another thread.
+  void serve_tls_(int fd) noexcept;
+
+  // tls_write_all_ writes all of @p data to @p ssl, whose socket @p fd
+  // is not blocking.
+  static bool tls_write_all_(SSL *ssl, int fd, const char *data,
+                             size_t size) noexcept;
+
+  // process_ injects faults and handles @p request, returning the status
+  // code and filling @p body with the response body.
+  int process_(const Request &request, std::string &body) noexcept;
+
+  // http2_preface_ returns the preface sent by HTTP/2 clients.
+  static const std::string &http2_preface_() noexcept;
+
+  // is_http2_ reads from @p fd into @p buffer until we know whether the
+  // client is speaking HTTP/2 with prior knowledge.
+  static bool is_http2_(int fd, std::string &buffer) noexcept;
+
+  // serve_http2_ serves the HTTP/2 streams received on @p fd. The @p buffer
+  // contains the bytes we have already read, starting with the preface.
+  void serve_http2_(int fd, std::string &buffer) noexcept;
+
+  // HpackDecoder decodes HTTP/2 header blocks (see RFC 7541).
+  class HpackDecoder {
+   public:
+    // decode decodes @p block into @p request, returning false on error.
+    bool decode(const std::string &block, Request &request) noexcept;
+
+   private:
+    // entry_ returns the name and value at @p index, if any.
+    bool entry_(uint64_t index, std::string &name,
+                std::string &value) const noexcept;
+
+    // insert_ adds @p name and @p value to the dynamic table.
+    void insert_(std::string name, std::string value) noexcept;
+
+    // evict_ evicts entries until the table is at most @p size bytes.
+    void evict_(size_t size) noexcept;
+
+    // table_ is the dynamic table, starting from the newest entry.
+    std::deque<std::pair<std::string, std::string>> table_;
+
+    // size_ is the size of the dynamic table as defined by RFC 7541.
+    size_t size_ = 0;
+
+    // max_size_ is the maximum size of the dynamic table.
+    size_t max_size_ = 4096;
+  };
+
+  // decode_integer_ decodes the integer with an @p prefix bits prefix at
+  // @p pos in @p data, advancing @p pos (see RFC 7541, Section 5.1).
+  static bool decode_integer_(const std::string &data, size_t &pos,
+                              unsigned prefix, uint64_t &value) noexcept;
+
+  // decode_string_ decodes the string at @p pos in @p data, advancing
+  // @p pos (see RFC 7541, Section 5.2).
+  static bool decode_string_(const std::string &data, size_t &pos,
+                             std::string &value) noexcept;
+
+  // decode_huffman_ decodes the Huffman encoded @p data into @p value.
+  static bool decode_huffman_(const std::string &data,
+                              std::string &value) noexcept;
+
+  // encode_integer_ appends to @p out the integer @p value with an
+  // @p prefix bits prefix and the other bits of the first byte in @p flags.
+  static void encode_integer_(std::string &out, uint8_t flags,
+                              unsigned prefix, uint64_t value) noexcept;
+
+  // encode_header_ appends to @p out the literal header without indexing
+  // whose name is at @p index in the static table and whose value is
+  // @p value, without using Huffman coding.
+  static void encode_header_(std::string &out, uint64_t index,
+                             const std::string &value) noexcept;
+
+  // frame_ returns an HTTP/2 frame.
+  static std::string frame_(uint8_t type, uint8_t flags, uint32_t stream,
+                            const std::string &payload) noexcept;
+
+  // read_request_ reads a request from @p fd using @p buffer to store
+  // the bytes that we read but that belong to the next request.
+  static bool read_request_(int fd, std::string &buffer,
+                            Request &request) noexcept;
+
+  // inject_ decides whether to fail @p request according to the config
+  // and returns the status code, or zero if we should not fail it. It also
+  // returns into @p delay how long to wait before responding.
+  int inject_(const Request &request,
+              std::chrono::milliseconds &delay) noexcept;
+
+  // handle_ processes @p request and returns the response body, or an
+  // empty string if the request is not valid.
+  std::string handle_(const Request &request) noexcept;
+
+  // inflate_ decompresses @p body according to @p encoding.
+  static bool inflate_(const std::string &encoding, const std::string &body,
+                       std::string &out) noexcept;
+
+  // write_all_ writes all of @p data to @p fd.
+  static bool write_all_(int fd, const std::string &data) noexcept;
+
+  // mutex_ protects the fields below.
+  mutable std::mutex mutex_;
+
+  // listener_ is the listening socket.
+  int listener_ = -1;
+
+  // port_ is the port we're listening on.
+  uint16_t port_ = 0;
+
+  // stopped_ indicates that we're stopping.
+  bool stopped_ = false;
+
+  // connections_ contains the open connections.
+  std::vector<int> connections_;
+
+  // threads_ contains the threads serving connections.
+  std::vector<std::thread> threads_;
+
+  // acceptor_ is the thread accepting connections.
+  std::thread acceptor_;
+
+  // stats_ contains the stats.
+  Stats stats_;
+
+  // next_report_ is used to generate report IDs.
+  uint64_t next_report_ = 0;
+
+  // config_ is the configuration.
+  Config config_;
+
+  // rng_ generates the random latency jitter and errors.
+  std::minstd_rand rng_;
+
+  // tokens_ is the number of requests we can serve without throttling.
+  double tokens_ = 0.0;
+
+  // refilled_ is when we last refilled tokens_.
+  std::chrono::steady_clock::time_point refilled_;
+
+  // tls_ctx_ is the TLS context, when we speak HTTPS.
+  SSL_CTX *tls_ctx_ = nullptr;
+
+  // ca_bundle_path_ is the path of the file containing our certificate.
+  std::string ca_bundle_path_;
+};
+
+inline LoopbackCollector::LoopbackCollector() noexcept
+    : LoopbackCollector{Config{}} {}
+
+inline LoopbackCollector::LoopbackCollector(Config config) noexcept
+    : config_{config}, rng_{config.seed},
+      tokens_{config.max_requests_per_second},
+      refilled_{std::chrono::steady_clock::now()} {
+  listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (listener_ == -1) {
+    return;
+  }
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (::bind(listener_, (sockaddr *)&sin, len) != 0 ||
+      ::listen(listener_, 128) != 0 ||
+      ::getsockname(listener_, (sockaddr *)&sin, &len) != 0) {
+    ::close(listener_);
+    listener_ = -1;
+    return;
+  }
+  port_ = ntohs(sin.sin_port);
+  if (config_.tls && !setup_tls_()) {
+    ::close(listener_);
+    listener_ = -1;
+    return;
+  }
+  acceptor_ = std::thread{[this]() { accept_loop_(); }};
+}
+
+inline bool LoopbackCollector::good() const noexcept {
+  return listener_ != -1;
+}
+
+inline std::string LoopbackCollector::base_url() const noexcept {
+  return (config_.tls ? "https://127.0.0.1:" : "http://127.0.0.1:") +
+         std::to_string((unsigned)port_);
+}
+
+inline std::string LoopbackCollector::ca_bundle_path() const noexcept {
+  return ca_bundle_path_;
+}
+
+inline LoopbackCollector::Stats LoopbackCollector::stats() const noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  return stats_;
+}
+
+inline LoopbackCollector::~LoopbackCollector() noexcept {
+  if (listener_ == -1) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stopped_ = true;
+    // Shutting down the sockets wakes up the threads blocked on them.
+    (void)::shutdown(listener_, SHUT_RDWR);
+    for (int fd : connections_) {
+      (void)::shutdown(fd, SHUT_RDWR);
+    }
+  }
+  acceptor_.join();
+  for (auto &thread : threads_) {  // no more threads after acceptor exits
+    thread.join();
+  }
+  ::close(listener_);
+  SSL_CTX_free(tls_ctx_);
+  if (ca_bundle_path_ != "") {
+    (void)::unlink(ca_bundle_path_.c_str());
+  }
+}
+
+inline void LoopbackCollector::accept_loop_() noexcept {
+  for (;;) {
+    int fd = ::accept(listener_, nullptr, nullptr);
+    std::unique_lock<std::mutex> _{mutex_};
+    if (stopped_) {
+      if (fd != -1) {
+        ::close(fd);
+      }
+      return;
+    }
+    if (fd == -1) {
+      continue;
+    }
+    connections_.push_back(fd);
+    stats_.connections += 1;
+    threads_.emplace_back([this, fd]() {
+      if (config_.tls) {
+        serve_tls_(fd);
+      } else {
+        serve_(fd);
+      }
+    });
+  }
+}
+
+inline void LoopbackCollector::serve_(int fd) noexcept {
+  std::string buffer;
+  if (is_http2_(fd, buffer)) {
+    serve_http2_(fd, buffer);
+    return;
+  }
+  Request request;
+  while (read_request_(fd, buffer, request)) {
+    std::string body;
+    std::string response;
+    switch (process_(request, body)) {
+      case 413:
+        response = "HTTP/1.1 413 Payload Too Large\r\n";
+        break;
+      case 429:
+        response = "HTTP/1.1 429 Too Many Requests\r\n";
+        response += "Retry-After: 1\r\n";
+        break;
+      case 500:
+        response = "HTTP/1.1 500 Internal Server Error\r\n";
+        break;
+      case 400:
+        response = "HTTP/1.1 400 Bad Request\r\n";
+        break;
+      default:
+        response = "HTTP/1.1 200 OK\r\n";
+    }
+    response += "Content-Type: application/json\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "\r\n";
+    response += body;
+    if (!write_all_(fd, response)) {
+      break;
+    }
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  connections_.erase(
+      std::remove(connections_.begin(), connections_.end(), fd),
+      connections_.end());
+  ::close(fd);
+}
+
+inline bool LoopbackCollector::setup_tls_() noexcept {
+  EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY *key = nullptr;
+  X509 *cert = X509_new();
+  // add_extension adds the extension @p nid with @p value to cert.
+  auto add_extension = [&](int nid, std::string value) {
+    X509_EXTENSION *ext =
+        X509V3_EXT_conf_nid(nullptr, nullptr, nid, &value[0]);
+    bool good = ext != nullptr && X509_add_ext(cert, ext, -1) == 1;
+    X509_EXTENSION_free(ext);
+    return good;
+  };
+  bool good =
+      key_ctx != nullptr && cert != nullptr &&
+      EVP_PKEY_keygen_init(key_ctx) == 1 &&
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+          key_ctx, NID_X9_62_prime256v1) == 1 &&
+      EVP_PKEY_keygen(key_ctx, &key) == 1 &&
+      X509_set_version(cert, 2) == 1 &&
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) == 1 &&
+      X509_gmtime_adj(X509_getm_notBefore(cert), -3600) != nullptr &&
+      X509_gmtime_adj(X509_getm_notAfter(cert), 86400) != nullptr &&
+      X509_set_pubkey(cert, key) == 1 &&
+      X509_NAME_add_entry_by_txt(
+          X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+          (const unsigned char *)"127.0.0.1", -1, -1, 0) == 1 &&
+      X509_set_issuer_name(cert, X509_get_subject_name(cert)) == 1 &&
+      add_extension(NID_basic_constraints, "critical,CA:TRUE") &&
+      add_extension(NID_subject_alt_name, "IP:127.0.0.1") &&
+      X509_sign(cert, key, EVP_sha256()) > 0;
+  if (good) {
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = (tmpdir != nullptr && *tmpdir != '\0') ? tmpdir : "/tmp";
+    path += "/loopback-collector-XXXXXX";
+    int fd = ::mkstemp(&path[0]);
+    FILE *file = (fd != -1) ? ::fdopen(fd, "w") : nullptr;
+    if (fd != -1) {
+      ca_bundle_path_ = path;
+    }
+    good = file != nullptr && PEM_write_X509(file, cert) == 1;
+    if (file != nullptr) {
+      good = ::fclose(file) == 0 && good;
+    } else if (fd != -1) {
+      ::close(fd);
+    }
+  }
+  if (good) {
+    tls_ctx_ = SSL_CTX_new(TLS_server_method());
+    good = tls_ctx_ != nullptr &&
+           SSL_CTX_use_certificate(tls_ctx_, cert) == 1 &&
+           SSL_CTX_use_PrivateKey(tls_ctx_, key) == 1;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  EVP_PKEY_CTX_free(key_ctx);
+  if (!good) {
+    SSL_CTX_free(tls_ctx_);
+    tls_ctx_ = nullptr;
+    if (ca_bundle_path_ != "") {
+      (void)::unlink(ca_bundle_path_.c_str());
+      ca_bundle_path_ = "";
+    }
+  }
+  return good;
+}
+
+inline void LoopbackCollector::serve_tls_(int fd) noexcept {
+  {
+    int on = 1;
+    (void)::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  int pair[2] = {-1, -1};
+  SSL *ssl = SSL_new(tls_ctx_);
+  bool good = ssl != nullptr && SSL_set_fd(ssl, fd) == 1 &&
+              SSL_accept(ssl) == 1 &&
+              ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0;
+  std::thread plaintext;
+  if (good) {
+    std::unique_lock<std::mutex> _{mutex_};
+    stats_.tls_handshakes += 1;
+    if (SSL_session_reused(ssl) == 1) {
+      stats_.tls_resumed_handshakes += 1;
+    }
+    // Like accept_loop_, make sure the destructor shuts down the socket.
+    good = !stopped_;
+    if (good) {
+      connections_.push_back(pair[1]);
+      int inner = pair[1];
+      plaintext = std::thread{[this, inner]() { serve_(inner); }};
+    }
+  }
+  if (good) {
+    int flags = ::fcntl(fd, F_GETFL);
+    good = flags != -1 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+  }
+  char chunk[65536];
+  while (good) {
+    pollfd fds[2] = {};
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = pair[0];
+    fds[1].events = POLLIN;
+    // Note: OpenSSL may have already read the bytes we're waiting for.
+    if (SSL_pending(ssl) <= 0 && ::poll(fds, 2, -1) <= 0) {
+      break;
+    }
+    if (SSL_pending(ssl) > 0 || fds[0].revents != 0) {
+      int n = SSL_read(ssl, chunk, (int)sizeof(chunk));
+      if (n > 0) {
+        good = write_all_(pair[0], std::string(chunk, (size_t)n));
+      } else {
+        good = SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ;
+      }
+    }
+    if (good && fds[1].revents != 0) {
+      ssize_t n = ::recv(pair[0], chunk, sizeof(chunk), 0);
+      good = n > 0 && tls_write_all_(ssl, fd, chunk, (size_t)n);
+    }
+  }
+  if (plaintext.joinable()) {
+    (void)::shutdown(pair[0], SHUT_RDWR);
+    plaintext.join();  // serve_ closes pair[1]
+  } else if (pair[1] != -1) {
+    ::close(pair[1]);
+  }
+  if (pair[0] != -1) {
+    ::close(pair[0]);
+  }
+  SSL_free(ssl);
+  std::unique_lock<std::mutex> _{mutex_};
+  connections_.erase(
+      std::remove(connections_.begin(), connections_.end(), fd),
+      connections_.end());
+  ::close(fd);
+}
+
+inline bool LoopbackCollector::tls_write_all_(SSL *ssl, int fd,
+                                              const char *data,
+                                              size_t size) noexcept {
+  while (size > 0) {
+    int n = SSL_write(ssl, data, (int)size);
+    if (n > 0) {
+      data += n;
+      size -= (size_t)n;
+      continue;
+    }
+    int error = SSL_get_error(ssl, n);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+      return false;
+    }
+    pollfd pfd{};
+    pfd.fd = fd;
+    pfd.events = (error == SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT;
+    if (::poll(&pfd, 1, -1) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline int LoopbackCollector::process_(const Request &request,
+                                       std::string &body) noexcept {
+  std::chrono::milliseconds delay{};
+  int status = inject_(request, delay);
+  if (delay.count() > 0) {
+    std::this_thread::sleep_for(delay);
+  }
+  switch (status) {
+    case 413:
+      body = R"({"error": "request entity too large"})";
+      return status;
+    case 429:
+      body = R"({"error": "too many requests"})";
+      return status;
+    case 500:
+      body = R"({"error": "internal server error"})";
+      return status;
+    default:
+      break;
+  }
+  body = handle_(request);
+  if (body.empty()) {
+    body = R"({"error": "bad request"})";
+    return 400;
+  }
+  return 200;
+}
+
+inline const std::string &LoopbackCollector::http2_preface_() noexcept {
+  static const std::string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  return preface;
+}
+
+inline bool LoopbackCollector::is_http2_(int fd,
+                                         std::string &buffer) noexcept {
+  char chunk[65536];
+  while (buffer.size() < http2_preface_().size()) {
+    if (buffer.compare(0, buffer.size(), http2_preface_(), 0,
+                       buffer.size()) != 0) {
+      return false;
+    }
+    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, (size_t)n);
+  }
+  return buffer.compare(0, http2_preface_().size(), http2_preface_()) == 0;
+}
+
+inline void LoopbackCollector::serve_http2_(int fd,
+                                            std::string &buffer) noexcept {
+  // Frame types and flags (see RFC 7540, Section 6).
+  enum : uint8_t {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9,
+  };
+  enum : uint8_t {
+    ACK = 0x1,
+    END_STREAM = 0x1,
+    END_HEADERS = 0x4,
+    PADDED = 0x8,
+    PRIORITY = 0x20,
+  };
+  static const uint32_t max_frame_size = 16384;
+  static const uint32_t window_size = 1 << 30;
+  static const size_t max_streams = 256;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stats_.http2_connections += 1;
+  }
+  buffer.erase(0, http2_preface_().size());
+  // Many frames we send (e.g., WINDOW_UPDATE) are small, so disable Nagle
+  // lest they be delayed until the client acknowledges previous writes.
+  {
+    int on = 1;
+    (void)::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  // The streams are processed concurrently by a pool of workers, since we
+  // may need to sleep before responding, to inject latency, and the writes
+  // are serialized by the write mutex.
+  std::mutex write_mutex;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cond;
+  std::deque<std::pair<uint32_t, Request>> queue;
+  size_t idle = 0;
+  bool done = false;
+  std::vector<std::thread> workers;
+  auto work = [&]() {
+    std::unique_lock<std::mutex> lock{queue_mutex};
+    for (;;) {
+      idle += 1;
+      queue_cond.wait(lock, [&]() { return done || !queue.empty(); });
+      idle -= 1;
+      if (queue.empty()) {
+        return;
+      }
+      auto item = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+      std::string body;
+      int status = process_(item.second, body);
+      std::string block;
+      encode_header_(block, 8, std::to_string(status));  // :status
+      encode_header_(block, 31, "application/json");     // content-type
+      encode_header_(block, 28, std::to_string(body.size()));
+      if (status == 429) {
+        encode_header_(block, 53, "1");  // retry-after
+      }
+      std::string out = frame_(HEADERS, END_HEADERS, item.first, block);
+      for (size_t off = 0; off < body.size(); off += max_frame_size) {
+        std::string chunk = body.substr(off, max_frame_size);
+        bool last = off + chunk.size() >= body.size();
+        out += frame_(DATA, last ? END_STREAM : 0, item.first, chunk);
+      }
+      {
+        std::unique_lock<std::mutex> _{write_mutex};
+        (void)write_all_(fd, out);
+      }
+      lock.lock();
+    }
+  };
+  // Stream is a stream whose request we are receiving.
+  struct Stream {
+    Request request;
+    std::string block;
+    bool ended = false;
+  };
+  std::map<uint32_t, Stream> streams;
+  HpackDecoder decoder;
+  // dispatch queues the request of @p id for processing.
+  auto dispatch = [&](uint32_t id) {
+    {
+      std::unique_lock<std::mutex> _{mutex_};
+      stats_.http2_streams += 1;
+    }
+    std::unique_lock<std::mutex> lock{queue_mutex};
+    queue.emplace_back(id, std::move(streams[id].request));
+    streams.erase(id);
+    if (idle == 0 && workers.size() < max_streams) {
+      workers.emplace_back(work);
+    }
+    queue_cond.notify_one();
+  };
+  // write writes a control frame.
+  auto write = [&](uint8_t type, uint8_t flags, uint32_t id,
+                   const std::string &payload) {
+    std::unique_lock<std::mutex> _{write_mutex};
+    return write_all_(fd, frame_(type, flags, id, payload));
+  };
+  // uint32 encodes @p value in network byte order.
+  auto uint32 = [](uint32_t value) {
+    std::string out;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out += (char)(uint8_t)(value >> shift);
+    }
+    return out;
+  };
+  std::string settings;
+  settings += '\0';
+  settings += '\3';  // SETTINGS_MAX_CONCURRENT_STREAMS
+  settings += uint32((uint32_t)max_streams);
+  settings += '\0';
+  settings += '\4';  // SETTINGS_INITIAL_WINDOW_SIZE
+  settings += uint32(window_size);
+  bool good = write(SETTINGS, 0, 0, settings) &&
+              write(WINDOW_UPDATE, 0, 0, uint32(window_size - 65535));
+  char chunk[65536];
+  while (good) {
+    while (buffer.size() < 9 ||
+           buffer.size() < 9 + ((size_t)(uint8_t)buffer[0] << 16 |
+                                (size_t)(uint8_t)buffer[1] << 8 |
+                                (size_t)(uint8_t)buffer[2])) {
+      ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        good = false;
+        break;
+      }
+      buffer.append(chunk, (size_t)n);
+    }
+    if (!good) {
+      break;
+    }
+    size_t length = (size_t)(uint8_t)buffer[0] << 16 |
+                    (size_t)(uint8_t)buffer[1] << 8 | (uint8_t)buffer[2];
+    uint8_t type = (uint8_t)buffer[3];
+    uint8_t flags = (uint8_t)buffer[4];
+    uint32_t id = ((uint32_t)(uint8_t)buffer[5] << 24 |
+                   (uint32_t)(uint8_t)buffer[6] << 16 |
+                   (uint32_t)(uint8_t)buffer[7] << 8 |
+                   (uint32_t)(uint8_t)buffer[8]) & 0x7fffffff;
+    std::string payload = buffer.substr(9, length);
+    buffer.erase(0, 9 + length);
+    if ((type == DATA || type == HEADERS) && (flags & PADDED) != 0) {
+      size_t padding = payload.empty() ? 0 : (uint8_t)payload[0];
+      if (padding + 1 > payload.size()) {
+        break;
+      }
+      payload = payload.substr(1, payload.size() - 1 - padding);
+    }
+    switch (type) {
+      case DATA:
+        if (streams.count(id) == 0) {
+          break;  // e.g., the stream has been reset
+        }
+        streams[id].request.body += payload;
+        if (!payload.empty()) {
+          good = write(WINDOW_UPDATE, 0, 0, uint32((uint32_t)length));
+        }
+        if ((flags & END_STREAM) != 0) {
+          dispatch(id);
+        }
+        break;
+      case HEADERS:
+      case CONTINUATION: {
+        Stream &stream = streams[id];
+        if (type == HEADERS) {
+          if ((flags & PRIORITY) != 0) {
+            payload.erase(0, 5);
+          }
+          stream.ended = (flags & END_STREAM) != 0;
+        }
+        stream.block += payload;
+        if ((flags & END_HEADERS) != 0) {
+          good = decoder.decode(stream.block, stream.request);
+          stream.block.clear();
+          if (good && stream.ended) {
+            dispatch(id);
+          }
+        }
+        break;
+      }
+      case RST_STREAM:
+        streams.erase(id);
+        break;
+      case SETTINGS:
+        if ((flags & ACK) == 0) {
+          good = write(SETTINGS, ACK, 0, "");
+        }
+        break;
+      case PING:
+        if ((flags & ACK) == 0) {
+          good = write(PING, ACK, 0, payload);
+        }
+        break;
+      case GOAWAY:
+        good = false;
+        break;
+      default:
+        break;  // PRIORITY, WINDOW_UPDATE, and unknown frames
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock{queue_mutex};
+    done = true;
+    queue_cond.notify_all();
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  connections_.erase(
+      std::remove(connections_.begin(), connections_.end(), fd),
+      connections_.end());
+  ::close(fd);
+}
+
+inline bool LoopbackCollector::HpackDecoder::decode(
+    const std::string &block, Request &request) noexcept {
+  for (size_t pos = 0; pos < block.size();) {
+    uint8_t first = (uint8_t)block[pos];
+    std::string name;
+    std::string value;
+    uint64_t index = 0;
+    if ((first & 0x80) != 0) {  // indexed header field
+      if (!decode_integer_(block, pos, 7, index) ||
+          !entry_(index, name, value)) {
+        return false;
+      }
+    } else if ((first & 0xe0) == 0x20) {  // dynamic table size update
+      uint64_t size = 0;
+      if (!decode_integer_(block, pos, 5, size) || size > 4096) {
+        return false;
+      }
+      max_size_ = (size_t)size;
+      evict_(max_size_);
+      continue;
+    } else {  // literal header field with or without indexing
+      bool indexing = (first & 0xc0) == 0x40;
+      if (!decode_integer_(block, pos, indexing ? 6 : 4, index) ||
+          (index > 0 && !entry_(index, name, value)) ||
+          (index == 0 && !decode_string_(block, pos, name)) ||
+          !decode_string_(block, pos, value)) {
+        return false;
+      }
+      if (indexing) {
+        insert_(name, value);
+      }
+    }
+    if (name == ":method") {
+      request.method = value;
+    } else if (name == ":path") {
+      request.path = value;
+    } else if (name == "content-encoding") {
+      request.content_encoding = value;
+    }
+  }
+  return true;
+}
+
+inline bool LoopbackCollector::HpackDecoder::entry_(
+    uint64_t index, std::string &name, std::string &value) const noexcept {
+  // static_table is the HPACK static table (see RFC 7541, Appendix A).
+  static const char *const static_table[][2] = {
+      {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+      {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+      {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+      {":status", "206"}, {":status", "304"}, {":status", "400"},
+      {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+      {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+      {"accept-ranges", ""}, {"accept", ""},
+      {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+      {"authorization", ""}, {"cache-control", ""},
+      {"content-disposition", ""}, {"content-encoding", ""},
+      {"content-language", ""}, {"content-length", ""},
+      {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+      {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+      {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+      {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+      {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+      {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+      {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+      {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+      {"set-cookie", ""}, {"strict-transport-security", ""},
+      {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+      {"via", ""}, {"www-authenticate", ""},
+  };
+  const uint64_t count = sizeof(static_table) / sizeof(static_table[0]);
+  if (index == 0) {
+    return false;
+  }
+  if (index <= count) {
+    name = static_table[index - 1][0];
+    value = static_table[index - 1][1];
+    return true;
+  }
+  if (index - count > table_.size()) {
+    return false;
+  }
+  name = table_[(size_t)(index - count - 1)].first;
+  value = table_[(size_t)(index - count - 1)].second;
+  return true;
+}
+
+inline void LoopbackCollector::HpackDecoder::insert_(
+    std::string name, std::string value) noexcept {
+  size_t size = name.size() + value.size() + 32;
+  if (size > max_size_) {
+    evict_(0);  // an entry larger than the table empties it
+    return;
+  }
+  evict_(max_size_ - size);
+  size_ += size;
+  table_.emplace_front(std::move(name), std::move(value));
+}
+
+inline void LoopbackCollector::HpackDecoder::evict_(size_t size) noexcept {
+  while (size_ > size && !table_.empty()) {
+    size_ -= table_.back().first.size() + table_.back().second.size() + 32;
+    table_.pop_back();
+  }
+}
+
+inline bool LoopbackCollector::decode_integer_(const std::string &data,
+                                               size_t &pos, unsigned prefix,
+                                               uint64_t &value) noexcept {
+  if (pos >= data.size()) {
+    return false;
+  }
+  uint64_t max = (1u << prefix) - 1;
+  value = (uint8_t)data[pos++] & max;
+  if (value < max) {
+    return true;
+  }
+  for (unsigned shift = 0; shift < 56 && pos < data.size(); shift += 7) {
+    uint8_t byte = (uint8_t)data[pos++];
+    value += (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool LoopbackCollector::decode_string_(const std::string &data,
+                                              size_t &pos,
+                                              std::string &value) noexcept {
+  if (pos >= data.size()) {
+    return false;
+  }
+  bool huffman = ((uint8_t)data[pos] & 0x80) != 0;
+  uint64_t length = 0;
+  if (!decode_integer_(data, pos, 7, length) ||
+      length > data.size() - pos) {
+    return false;
+  }
+  std::string raw = data.substr(pos, (size_t)length);
+  pos += (size_t)length;
+  if (!huffman) {
+    std::swap(value, raw);
+    return true;
+  }
+  return decode_huffman_(raw, value);
+}
+
+inline bool LoopbackCollector::decode_huffman_(const std::string &data,
+                                               std::string &value) noexcept {
+  // codes contains the HPACK Huffman codes, including the EOS
+  // symbol (see RFC 7541, Appendix B).
+  static const uint32_t codes[257] = {
+      0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6,
+      0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea,
+      0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee, 0xfffffef,
+      0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4,
+      0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa,
+      0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa,
+      0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1, 0x2, 0x19, 0x1a,
+      0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+      0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66,
+      0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+      0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22, 0x7ffd, 0x3,
+      0x23, 0x4, 0x24, 0x5, 0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a,
+      0x7, 0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b,
+      0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7,
+      0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+      0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec,
+      0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+      0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7,
+      0xffffef, 0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8,
+      0x7fffe9, 0x1fffde, 0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf,
+      0x3fffdf, 0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+      0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3,
+      0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1,
+      0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec, 0x3ffffe2,
+      0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1,
+      0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7,
+      0x7ffffe2, 0xfffff2, 0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd,
+      0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+      0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb, 0x1ffffee,
+      0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4, 0x3ffffeb, 0x7ffffe6,
+      0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+      0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef,
+      0x7fffff0, 0x3ffffee, 0x3fffffff,
+  };
+
+  // lengths contains the length of each code in bits.
+  static const uint8_t lengths[257] = {
+      13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28,
+      28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13,
+      6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8,
+      15, 6, 12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+      7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5,
+      7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20,
+      22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22,
+      23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22,
+      23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23,
+      23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26,
+      26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26,
+      26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24,
+      24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27,
+      26, 30,
+  };
+  // HuffmanNode is a node of the decoding tree.
+  struct HuffmanNode {
+    int child[2] = {-1, -1};
+    int symbol = -1;
+  };
+  static const std::vector<HuffmanNode> tree = []() {
+    std::vector<HuffmanNode> nodes(1);
+    for (int symbol = 0; symbol < 257; ++symbol) {
+      size_t node = 0;
+      for (int bit = lengths[symbol] - 1; bit >= 0; --bit) {
+        int branch = (codes[symbol] >> bit) & 1;
+        if (nodes[node].child[branch] == -1) {
+          nodes[node].child[branch] = (int)nodes.size();
+          nodes.emplace_back();
+        }
+        node = (size_t)nodes[node].child[branch];
+      }
+      nodes[node].symbol = symbol;
+    }
+    return nodes;
+  }();
+  value.clear();
+  size_t node = 0;
+  for (char byte : data) {
+    for (int bit = 7; bit >= 0; --bit) {
+      int next = tree[node].child[((uint8_t)byte >> bit) & 1];
+      if (next == -1) {
+        return false;
+      }
+      node = (size_t)next;
+      if (tree[node].symbol == 256) {
+        return false;  // EOS must not appear in the data
+      }
+      if (tree[node].symbol != -1) {
+        value += (char)tree[node].symbol;
+        node = 0;
+      }
+    }
+  }
+  return true;  // the padding is the prefix of EOS, which we don't check
+}
+
+inline void LoopbackCollector::encode_integer_(std::string &out,
+                                               uint8_t flags,
+                                               unsigned prefix,
+                                               uint64_t value) noexcept {
+  uint64_t max = (1u << prefix) - 1;
+  if (value < max) {
+    out += (char)(uint8_t)(flags | value);
+    return;
+  }
+  out += (char)(uint8_t)(flags | max);
+  for (value -= max; value >= 0x80; value >>= 7) {
+    out += (char)(uint8_t)(0x80 | (value & 0x7f));
+  }
+  out += (char)(uint8_t)value;
+}
+
+inline void LoopbackCollector::encode_header_(
+    std::string &out, uint64_t index, const std::string &value) noexcept {
+  encode_integer_(out, 0x00, 4, index);
+  encode_integer_(out, 0x00, 7, value.size());
+  out += value;
+}
+
+inline std::string LoopbackCollector::frame_(
+    uint8_t type, uint8_t flags, uint32_t stream,
+    const std::string &payload) noexcept {
+  std::string out;
+  out += (char)(uint8_t)(payload.size() >> 16);
+  out += (char)(uint8_t)(payload.size() >> 8);
+  out += (char)(uint8_t)payload.size();
+  out += (char)type;
+  out += (char)flags;
+  out += (char)(uint8_t)(stream >> 24);
+  out += (char)(uint8_t)(stream >> 16);
+  out += (char)(uint8_t)(stream >> 8);
+  out += (char)(uint8_t)stream;
+  out += payload;
+  return out;
+}
+
+inline bool LoopbackCollector::read_request_(int fd, std::string &buffer,
+                                             Request &request) noexcept {
+  char chunk[65536];
+  size_t end = std::string::npos;
+  while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, (size_t)n);
+  }
+  std::string head = buffer.substr(0, end + 2);
+  buffer.erase(0, end + 4);
+  request = Request{};
+  size_t content_length = 0;
+  bool expect_continue = false;
+  {
+    size_t eol = head.find("\r\n");
+    std::string line = head.substr(0, eol);
+    size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+    if (sp1 == std::string::npos || sp2 == sp1) {
+      return false;
+    }
+    request.method = line.substr(0, sp1);
+    request.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    for (size_t pos = eol + 2; pos < head.size(); pos = eol + 2) {
+      eol = head.find("\r\n", pos);
+      line = head.substr(pos, eol - pos);
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      std::string value = line.substr(colon + 1);
+      value.erase(0, value.find_first_not_of(' '));
+      if (name == "content-length") {
+        content_length = (size_t)strtoull(value.c_str(), nullptr, 10);
+      } else if (name == "content-encoding") {
+        request.content_encoding = value;
+      } else if (name == "expect") {
+        expect_continue = true;
+      }
+    }
+  }
+  if (expect_continue && buffer.size() < content_length &&
+      !write_all_(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+    return false;
+  }
+  while (buffer.size() < content_length) {
+    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, (size_t)n);
+  }
+  request.body = buffer.substr(0, content_length);
+  buffer.erase(0, content_length);
+  return true;
+}
+
+inline int LoopbackCollector::inject_(
+    const Request &request, std::chrono::milliseconds &delay) noexcept {
+  std::unique_lock<std::mutex> _{mutex_};
+  int64_t jitter = 0;
+  if (config_.latency_jitter > 0) {
+    jitter = std::uniform_int_distribution<int64_t>{
+        0, config_.latency_jitter}(rng_);
+  }
+  delay = std::chrono::milliseconds{config_.latency + jitter};
+  if (config_.max_requests_per_second > 0.0) {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - refilled_;
+    refilled_ = now;
+    tokens_ = std::min(
+        config_.max_requests_per_second,
+        tokens_ + elapsed.count() * config_.max_requests_per_second);
+    if (tokens_ < 1.0) {
+      stats_.throttled += 1;
+      return 429;
+    }
+    tokens_ -= 1.0;
+  }
+  if (config_.max_body_size > 0 &&
+      request.body.size() > config_.max_body_size) {
+    stats_.too_large += 1;
+    return 413;
+  }
+  if (config_.error_rate > 0.0 &&
+      std::uniform_real_distribution<double>{}(rng_) < config_.error_rate) {
+    stats_.injected_errors += 1;
+    return 500;
+  }
+  return 0;
+}
+
+inline std::string LoopbackCollector::handle_(
+    const Request &request) noexcept {
+  static const std::string prefix = "/report/";
+  static const std::string suffix = "/close";
+  std::unique_lock<std::mutex> _{mutex_};
+  if (request.method == "GET" && request.path == "/") {
+    stats_.probes += 1;
+    return "{}";
+  }
+  if (request.method != "POST") {
+    stats_.bad_requests += 1;
+    return "";
+  }
+  if (request.path == "/report") {
+    stats_.reports_opened += 1;
+    nlohmann::json doc;
+    doc["backend_version"] = "loopback";
+    doc["report_id"] = "20190101T000000Z_AS0_" +
+                       std::to_string(++next_report_);
+    doc["supported_formats"] = {"json"};
+    return doc.dump();
+  }
+  if (request.path.compare(0, prefix.size(), prefix) != 0) {
+    stats_.bad_requests += 1;
+    return "";
+  }
+  if (request.path.size() > suffix.size() &&
+      request.path.compare(request.path.size() - suffix.size(),
+                           suffix.size(), suffix) == 0) {
+    stats_.reports_closed += 1;
+    return "{}";
+  }
+  // Decompressing and parsing may be expensive, so we don't hold the lock
+  // while doing that, in case there are many concurrent uploads.
+  _.unlock();
+  std::string body;
+  bool good = inflate_(request.content_encoding, request.body, body);
+  if (good) {
+    try {
+      auto doc = nlohmann::json::parse(body);
+      good = doc.at("format") == "json" && doc.at("content").is_object();
+    } catch (const std::exception &) {
+      good = false;
+    }
+  }
+  _.lock();
+  if (!good) {
+    stats_.bad_requests += 1;
+    return "";
+  }
+  stats_.updates += 1;
+  if (request.content_encoding != "") {
+    stats_.compressed_updates += 1;
+  }
+  stats_.update_upload_bytes += request.body.size();
+  stats_.update_body_bytes += body.size();
+  return R"({"status": "success"})";
+}
+
+inline bool LoopbackCollector::inflate_(const std::string &encoding,
+                                        const std::string &body,
+                                        std::string &out) noexcept {
+  if (encoding == "") {
+    out = body;
+    return true;
+  }
+  int window_bits = MAX_WBITS;
+  if (encoding == "gzip") {
+    window_bits += 16;
+  } else if (encoding != "deflate") {
+    return false;
+  }
+  z_stream stream{};
+  if (inflateInit2(&stream, window_bits) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef *)body.data();
+  stream.avail_in = (uInt)body.size();
+  char chunk[65536];
+  int ret = Z_OK;
+  out.clear();
+  while (ret == Z_OK) {
+    stream.next_out = (Bytef *)chunk;
+    stream.avail_out = sizeof(chunk);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(chunk, sizeof(chunk) - stream.avail_out);
+  }
+  (void)inflateEnd(&stream);
+  return ret == Z_STREAM_END && stream.avail_in == 0;
+}
+
+inline bool LoopbackCollector::write_all_(int fd,
+                                          const std::string &data) noexcept {
+  for (size_t off = 0; off < data.size();) {
+    ssize_t n = ::send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    off += (size_t)n;
+  }
+  return true;
+}
+
+}  // namespace collector
+}  // namespace mk
+#endif  // !_WIN32
+#endif  // MEASUREMENT_KIT_LOOPBACK_COLLECTOR_HPP
@@ -0,0 +1,392 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// mkcollector-loadgen replays a JSONL corpus of measurements through many
+// Reporters, each running in its own thread, and prints a JSON object with
+// the achieved throughput, the submission latency, the CPU time used per
+// measurement by the threads running the Reporters, and the peak RSS before
+// and after the run. Typically, you run it against the loopback collector,
+// to size a fleet or to check whether a change in the library actually
+// improves the end-to-end throughput. Since the loopback collector runs in
+// this process, the RSS then includes its memory as well.
+
+#define MKCURL_INLINE_IMPL
+#include "mkcurl.hpp"
+
+#define MKBOUNCER_INLINE_IMPL
+#include "mkbouncer.hpp"
+
+#include "mkcollector.hpp"
+
+#include "loopback-collector.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#include "json.hpp"
+
+using namespace mk::collector;
+
+// Options contains the command line options.
+struct Options {
+  // base_url is the collector base URL.
+  std::string base_url;
+
+  // ca_bundle_path is the optional CA bundle path.
+  std::string ca_bundle_path;
+
+  // corpus is the path of the JSONL corpus.
+  std::string corpus;
+
+  // threads is the number of Reporters and threads.
+  size_t threads = 1;
+
+  // repeat is the number of times each thread replays its measurements.
+  size_t repeat = 1;
+
+  // batch is the number of measurements submitted at once. When it is one
+  // we use maybe_discover_and_submit_with_stats_and_reason.
+  size_t batch = 1;
+
+  // in_flight is the maximum number of updates in flight per Reporter.
+  size_t in_flight = 1;
+
+  // compression is the compression to use.
+  Compression compression = Compression::none;
+
+  // http2 indicates that we should use HTTP/2.
+  bool http2 = false;
+
+  // loopback indicates that we should start a loopback collector.
+  bool loopback = false;
+
+  // latency is the loopback collector latency in milliseconds.
+  int64_t latency = 0;
+
+  // latency_jitter is the loopback collector latency jitter.
+  int64_t latency_jitter = 0;
+
+  // error_rate is the loopback collector error rate.
+  double error_rate = 0.0;
+};
+
+static void usage() {
+  std::clog << "Usage: mkcollector-loadgen [options] <corpus.jsonl>\n"
+            << "\n"
+            << "Options:\n"
+            << "  --base-url URL        collector base URL\n"
+            << "  --ca-bundle-path FILE CA bundle path\n"
+            << "  --threads N           number of Reporters/threads (1)\n"
+            << "  --repeat N            replay the corpus N times (1)\n"
+            << "  --batch N             submit N measurements at once (1)\n"
+            << "  --in-flight N         updates in flight per Reporter (1)\n"
+            << "  --compression NAME    none, gzip, or deflate (none)\n"
+            << "  --http2               use HTTP/2\n"
+            << "  --loopback            start and use a loopback collector\n"
+            << "  --latency MS          loopback collector latency (0)\n"
+            << "  --latency-jitter MS   loopback collector jitter (0)\n"
+            << "  --error-rate P        loopback collector error rate (0)\n"
+            << "\n"
+            << "Each thread replays every N-th measurement of the corpus, so"
+            << " the corpus is\nreplayed exactly --repeat times overall.\n";
+}
+
+// parse_size parses @p s as a positive integer into @p value.
+static bool parse_size(const char *s, size_t &value) {
+  char *end = nullptr;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || v == 0) {
+    return false;
+  }
+  value = (size_t)v;
+  return true;
+}
+
+// parse_options parses the command line into @p options.
+static bool parse_options(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    // value returns the value of the current option, if any.
+    auto value = [&]() -> const char * {
+      return (i + 1 < argc) ? argv[++i] : nullptr;
+    };
+    const char *v = nullptr;
+    if (arg == "--loopback") {
+      options.loopback = true;
+    } else if (arg == "--http2") {
+      options.http2 = true;
+    } else if (arg.compare(0, 2, "--") != 0) {
+      if (options.corpus != "") {
+        return false;
+      }
+      options.corpus = arg;
+    } else if ((v = value()) == nullptr) {
+      return false;
+    } else if (arg == "--base-url") {
+      options.base_url = v;
+    } else if (arg == "--ca-bundle-path") {
+      options.ca_bundle_path = v;
+    } else if (arg == "--threads") {
+      if (!parse_size(v, options.threads)) {
+        return false;
+      }
+    } else if (arg == "--repeat") {
+      if (!parse_size(v, options.repeat)) {
+        return false;
+      }
+    } else if (arg == "--batch") {
+      if (!parse_size(v, options.batch)) {
+        return false;
+      }
+    } else if (arg == "--in-flight") {
+      if (!parse_size(v, options.in_flight)) {
+        return false;
+      }
+    } else if (arg == "--compression") {
+      if (strcmp(v, "none") == 0) {
+        options.compression = Compression::none;
+      } else if (strcmp(v, "gzip") == 0) {
+        options.compression = Compression::gzip;
+      } else if (strcmp(v, "deflate") == 0) {
+        options.compression = Compression::deflate;
+      } else {
+        return false;
+      }
+    } else if (arg == "--latency") {
+      options.latency = (int64_t)strtoll(v, nullptr, 10);
+    } else if (arg == "--latency-jitter") {
+      options.latency_jitter = (int64_t)strtoll(v, nullptr, 10);
+    } else if (arg == "--error-rate") {
+      options.error_rate = strtod(v, nullptr);
+    } else {
+      return false;
+    }
+  }
+  return options.corpus != "" &&
+         (options.loopback || options.base_url != "");
+}
+
+// load_corpus loads the non empty lines of @p path into @p corpus.
+static bool load_corpus(const std::string &path,
+                        std::vector<std::string> &corpus) {
+  std::ifstream file{path};
+  if (!file.good()) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      corpus.push_back(std::move(line));
+    }
+  }
+  return !corpus.empty();
+}
+
+// Worker contains the state of a thread.
+struct Worker {
+  // stats contains the Reporter stats.
+  Reporter::Stats stats;
+
+  // submit_latency contains the latency of each submission.
+  LatencyHistogram submit_latency;
+
+  // okay is the number of measurements successfully submitted.
+  uint64_t okay = 0;
+
+  // failed is the number of measurements we could not submit.
+  uint64_t failed = 0;
+
+  // cpu_seconds is the CPU time used by the thread.
+  double cpu_seconds = 0.0;
+};
+
+// thread_cpu_seconds returns the CPU time used by the calling thread, or
+// zero if we cannot measure it.
+static double thread_cpu_seconds() {
+#ifndef _WIN32
+  struct timespec ts {};
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return double(ts.tv_sec) + double(ts.tv_nsec) / 1e09;
+  }
+#endif
+  return 0.0;
+}
+
+// peak_rss_bytes returns the peak RSS of the process so far, or zero if we
+// cannot measure it.
+static uint64_t peak_rss_bytes() {
+#ifndef _WIN32
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+  }
+#endif
+  return 0;
+}
+
+// run_worker replays the measurements of @p corpus assigned to the thread
+// with index @p index, updating @p worker.
+static void run_worker(const Options &options,
+                       const std::vector<std::string> &corpus, size_t index,
+                       Worker &worker) {
+  // The UpdateEngine runs in this thread, hence the CPU time of this thread
+  // is the CPU time of the Reporter, except for the short lived threads it
+  // may start to open and close reports.
+  double cpu_begin = thread_cpu_seconds();
+  Reporter reporter{"mkcollector-loadgen", "0.0.1"};
+  reporter.set_base_url(options.base_url);
+  reporter.set_ca_bundle_path(options.ca_bundle_path);
+  reporter.set_compression(options.compression);
+  reporter.set_http2(options.http2);
+  reporter.set_max_updates_in_flight(options.in_flight);
+  reporter.set_log_level(LogLevel::quiet);
+  std::vector<const std::string *> assigned;
+  for (size_t round = 0; round < options.repeat; ++round) {
+    for (size_t i = index; i < corpus.size(); i += options.threads) {
+      assigned.push_back(&corpus[i]);
+    }
+  }
+  for (size_t off = 0; off < assigned.size(); off += options.batch) {
+    // Note: we copy because submitting modifies the measurements.
+    std::vector<std::string> measurements;
+    for (size_t i = off; i < assigned.size() && i < off + options.batch;
+         ++i) {
+      measurements.push_back(*assigned[i]);
+    }
+    std::vector<std::string> logs;
+    auto start = std::chrono::steady_clock::now();
+    if (options.batch == 1) {
+      std::string reason;
+      bool good = reporter.maybe_discover_and_submit_with_stats_and_reason(
+          std::move(measurements[0]), logs, 0, worker.stats, reason);
+      (good ? worker.okay : worker.failed) += 1;
+    } else {
+      for (auto &result :
+           reporter.submit_batch(measurements, logs, 0, worker.stats)) {
+        (result.good ? worker.okay : worker.failed) += 1;
+      }
+    }
+    worker.submit_latency.record_since(start);
+  }
+  worker.cpu_seconds = thread_cpu_seconds() - cpu_begin;
+}
+
+// latency_summary returns the summary of @p histogram.
+static nlohmann::json latency_summary(const LatencyHistogram &histogram) {
+  nlohmann::json doc;
+  doc["count"] = histogram.count();
+  doc["mean"] = histogram.mean();
+  doc["p50"] = histogram.percentile(50.0);
+  doc["p99"] = histogram.percentile(99.0);
+  doc["p999"] = histogram.percentile(99.9);
+  doc["max"] = histogram.max();
+  return doc;
+}
+
+int main(int argc, char **argv) {
+  // Initialize cURL before starting threads, since this is not thread safe.
+  (void)curl_global_init(CURL_GLOBAL_DEFAULT);
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> corpus;
+  if (!load_corpus(options.corpus, corpus)) {
+    std::clog << "mkcollector-loadgen: cannot load corpus: " << options.corpus
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+#ifndef _WIN32
+  std::unique_ptr<LoopbackCollector> collector;
+  if (options.loopback) {
+    LoopbackCollector::Config config;
+    config.latency = options.latency;
+    config.latency_jitter = options.latency_jitter;
+    config.error_rate = options.error_rate;
+    collector.reset(new LoopbackCollector{config});
+    if (!collector->good()) {
+      std::clog << "mkcollector-loadgen: cannot start loopback collector"
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    options.base_url = collector->base_url();
+  }
+#else
+  if (options.loopback) {
+    std::clog << "mkcollector-loadgen: --loopback is not supported"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+#endif
+  std::vector<Worker> workers(options.threads);
+  std::vector<std::thread> threads;
+  // Note: this includes the corpus and, with --loopback, the collector.
+  uint64_t peak_rss_before = peak_rss_bytes();
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < options.threads; ++i) {
+    threads.emplace_back([&, i]() {
+      run_worker(options, corpus, i, workers[i]);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  Worker total;
+  for (auto &worker : workers) {
+    total.stats += worker.stats;
+    total.submit_latency.merge(worker.submit_latency);
+    total.okay += worker.okay;
+    total.failed += worker.failed;
+    total.cpu_seconds += worker.cpu_seconds;
+  }
+  uint64_t count = total.okay + total.failed;
+  nlohmann::json result;
+  result["base_url"] = options.base_url;
+  result["threads"] = options.threads;
+  result["batch"] = options.batch;
+  result["in_flight"] = options.in_flight;
+  result["http2"] = options.http2;
+  result["measurements"] = count;
+  result["measurements_okay"] = total.okay;
+  result["measurements_failed"] = total.failed;
+  result["elapsed_seconds"] = elapsed.count();
+  result["measurements_per_second"] = double(total.okay) / elapsed.count();
+  result["submit_usec"] = latency_summary(total.submit_latency);
+  result["update_usec"] = latency_summary(total.stats.update_latency);
+  // Note: the CPU time does not include the loopback collector's threads.
+  result["cpu_usec_per_measurement"] =
+      (count > 0) ? total.cpu_seconds * 1e06 / double(count) : 0.0;
+  result["bytes_sent"] = total.stats.bytes_sent;
+  result["bytes_received"] = total.stats.bytes_received;
+  result["peak_rss_bytes_before_run"] = peak_rss_before;
+  result["peak_rss_bytes"] = peak_rss_bytes();
+  result["rss_includes_collector"] = options.loopback;
+  result["stats"] = nlohmann::json::parse(total.stats.to_json());
+  std::cout << result.dump() << std::endl;
+  exit((total.failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
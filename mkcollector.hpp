@@ -6,7 +6,10 @@
 
 #include <stdint.h>
 
+#include <chrono>
+#include <functional>
 #include <initializer_list>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -16,12 +19,114 @@
 /// public symbols exported by this library are enclosed.
 ///
 /// See <https://github.com/measurement-kit/measurement-kit/issues/1867#issuecomment-514562622>.
-#define MKCOLLECTOR_INLINE_NAMESPACE v0_7_0_or_greater
+#define MKCOLLECTOR_INLINE_NAMESPACE v0_8_0_or_greater
 
 namespace mk {
 namespace collector {
 inline namespace MKCOLLECTOR_INLINE_NAMESPACE {
 
+/// LogLevel is the level of a log message. Levels are ordered, such that
+/// enabling a level also enables all the less verbose levels.
+enum class LogLevel : int {
+  /// quiet disables logging.
+  quiet = 0,
+
+  /// warning is the level of errors.
+  warning = 1,
+
+  /// info is the level of messages describing what we are doing.
+  info = 2,
+
+  /// debug is the level of transport logs and of bodies.
+  debug = 3,
+};
+
+/// LogSink is a function receiving log messages.
+using LogSink = std::function<void(LogLevel level, std::string message)>;
+
+/// LogLine is a log message emitted by open, update, and close.
+struct LogLine {
+  /// level is the level of the message.
+  LogLevel level = LogLevel::debug;
+
+  /// message is the message.
+  std::string message;
+};
+
+/// Compression is the compression applied to update bodies.
+enum class Compression : int {
+  /// none means that we upload update bodies as they are.
+  none = 0,
+
+  /// gzip means that we upload gzip compressed update bodies.
+  gzip = 1,
+
+  /// deflate means that we upload zlib compressed update bodies, which is
+  /// what the deflate Content-Encoding means (see RFC 7230).
+  deflate = 2,
+};
+
+/// RetryPolicy controls how we retry the API calls that fail because of
+/// transient errors (see is_retryable_failure). Between attempts we wait for
+/// an exponentially growing delay, part of which is random, such that many
+/// clients retrying at the same time do not hit the collector in lockstep.
+class RetryPolicy {
+ public:
+  /// max_attempts is the maximum number of attempts, including the first
+  /// one. One, the default, means that we do not retry.
+  unsigned max_attempts = 1;
+
+  /// initial_backoff is the delay before the first retry in milliseconds.
+  int64_t initial_backoff = 500;
+
+  /// max_backoff is the maximum delay between attempts in milliseconds.
+  int64_t max_backoff = 30000;
+
+  /// backoff_multiplier is the factor by which the delay grows after
+  /// each attempt.
+  double backoff_multiplier = 2.0;
+
+  /// jitter is the random fraction of each delay, between zero (the delay
+  /// is not random) and one (the delay is uniformly distributed between zero
+  /// and the exponential backoff).
+  double jitter = 0.5;
+
+  /// breaker_threshold is the number of consecutive calls failing because
+  /// of transient errors after which a Reporter considers the collector to
+  /// be unhealthy and fails fast, without contacting it, for the next
+  /// breaker_cooldown seconds. After that, it tries again with a single
+  /// call, which either closes or opens again the circuit breaker. Zero,
+  /// the default, disables the circuit breaker.
+  unsigned breaker_threshold = 0;
+
+  /// breaker_cooldown is the number of seconds for which the circuit
+  /// breaker stays open.
+  int64_t breaker_cooldown = 30;
+};
+
+/// ReportRotationPolicy controls when a Reporter replaces the current report
+/// with a new one, even though the measurements still belong to the current
+/// report, so that a long running Reporter does not produce huge reports,
+/// which the collector processes slowly and late. Zero means no limit. All
+/// the limits are zero by default, hence we do not rotate reports.
+class ReportRotationPolicy {
+ public:
+  /// max_measurements is the maximum number of measurements in a report.
+  uint64_t max_measurements = 0;
+
+  /// max_bytes is the maximum number of bytes of the update bodies of a
+  /// report, before compression.
+  uint64_t max_bytes = 0;
+
+  /// max_age is the maximum number of seconds since we opened a report.
+  int64_t max_age = 0;
+};
+
+/// is_retryable_failure returns whether an API call that failed with the
+/// cURL @p error and the HTTP @p status_code may succeed if retried. That
+/// is the case for network errors, timeouts, 429, and 5xx responses.
+bool is_retryable_failure(int64_t error, int64_t status_code) noexcept;
+
 /// Settings contains common network related settings.
 class Settings {
  public:
@@ -34,6 +139,49 @@ class Settings {
   /// timeout is the whole operation timeout (in seconds). Zero indicatest
   /// that there actually is no timeout.
   int64_t timeout = 0;
+
+  /// log_level is the most verbose level that we log. Messages with a more
+  /// verbose level are not even formatted. The default is to log everything.
+  LogLevel log_level = LogLevel::debug;
+
+  /// max_body_log_size is the maximum number of bytes of each request or
+  /// response body that we log. Longer bodies are truncated.
+  size_t max_body_log_size = SIZE_MAX;
+
+  /// compression is the compression applied to update bodies. The collector
+  /// must support the corresponding Content-Encoding. The default is to not
+  /// compress update bodies.
+  Compression compression = Compression::none;
+
+  /// compression_level is the zlib compression level, between zero (no
+  /// compression) and nine (best compression). Minus one, the default,
+  /// selects the zlib default level.
+  int compression_level = -1;
+
+  /// compression_threshold is the size in bytes below which we upload an
+  /// update body as is, even if compression is enabled.
+  size_t compression_threshold = 1024;
+
+  /// retry_policy controls how we retry failed API calls.
+  RetryPolicy retry_policy;
+
+  /// http2 indicates whether to use HTTP/2. With https URLs, we negotiate
+  /// HTTP/2 using ALPN, falling back to HTTP/1.1 if the collector does not
+  /// support it. With http URLs, the UpdateEngine assumes that the collector
+  /// speaks cleartext HTTP/2 (i.e., with prior knowledge). The updates kept
+  /// in flight by an UpdateEngine are multiplexed as concurrent streams over
+  /// a single connection, rather than using a connection each. With libcurl
+  /// 7.88, whose cleartext HTTP/2 support is broken, we ignore this setting
+  /// for http URLs. The default is to use HTTP/1.1.
+  bool http2 = false;
+
+  /// tls_session_cache_path is the file where the UpdateEngine saves the
+  /// TLS sessions negotiated with collectors, keyed by collector host, and
+  /// from which it loads them, such that a new connection, also in a later
+  /// run, only needs an abbreviated handshake. An empty path, the default,
+  /// disables the cache, and we ignore it if we cannot use the cache. See
+  /// Reporter::set_tls_session_cache_path.
+  std::string tls_session_cache_path;
 };
 
 /// LoadResult is the result of loading a structure from JSON.
@@ -56,6 +204,12 @@ class OpenRequest {
   /// operator!= returns true if this object differs from @p other
   bool operator!=(const OpenRequest &other) const noexcept;
 
+  /// operator== returns true if this object equals @p other
+  bool operator==(const OpenRequest &other) const noexcept;
+
+  /// hash computes the hash of this object.
+  size_t hash() const noexcept;
+
 #define MKCOLLECTOR_OPEN_REQUEST_ENUM(XX) \
   XX(probe_asn)                           \
   XX(probe_cc)                            \
@@ -70,11 +224,76 @@ class OpenRequest {
 #undef XX
 };
 
+/// OpenRequestKey is an immutable OpenRequest with a precomputed hash. The
+/// fields are stored in a shared object, such that copying a key only copies
+/// a pointer. Comparing keys first compares the shared objects, then the
+/// hashes, and finally, only if the hashes are equal, the fields.
+class OpenRequestKey {
+ public:
+  /// OpenRequestKey creates a key for an empty OpenRequest.
+  OpenRequestKey() noexcept;
+
+  /// OpenRequestKey creates a key for @p request.
+  explicit OpenRequestKey(OpenRequest request) noexcept;
+
+  /// operator!= returns true if this key differs from @p other.
+  bool operator!=(const OpenRequestKey &other) const noexcept;
+
+  /// operator== returns true if this key equals @p other.
+  bool operator==(const OpenRequestKey &other) const noexcept;
+
+  /// request returns the OpenRequest corresponding to this key.
+  const OpenRequest &request() const noexcept;
+
+  /// hash returns the precomputed hash.
+  size_t hash() const noexcept;
+
+ private:
+  // Shared contains the fields shared among copies of the same key.
+  struct Shared {
+    // request is the request.
+    OpenRequest request;
+
+    // hash is the hash of the request.
+    size_t hash = 0;
+  };
+
+  // shared_ is the shared state.
+  std::shared_ptr<const Shared> shared_;
+};
+
+/// MeasurementView is a non-owning view of a serialized measurement, e.g.,
+/// a line of a memory mapped JSONL file. The viewed bytes must outlive the
+/// view and all the calls to which the view is passed.
+struct MeasurementView {
+  /// data points to the first byte of the measurement.
+  const char *data = nullptr;
+
+  /// size is the size of the measurement in bytes.
+  size_t size = 0;
+
+  /// MeasurementView creates an empty view.
+  MeasurementView() noexcept = default;
+
+  /// MeasurementView creates a view of the @p size bytes at @p data.
+  MeasurementView(const char *data, size_t size) noexcept
+      : data{data}, size{size} {}
+
+  /// MeasurementView creates a view of @p measurement.
+  MeasurementView(const std::string &measurement) noexcept
+      : data{measurement.data()}, size{measurement.size()} {}
+};
+
 /// open_request_from_measurement initializes an OpenRequest structure
 /// from an existing @p measurement. This factory also requires you
 /// to pass @p software_name and @p software_version to inform the OONI
 /// collector about who is submitting this measurement. This is the function
 /// that you want to call when you want to resubmit a measurement.
+///
+/// This function does not load the whole @p measurement in memory. It only
+/// scans it until it has found the top-level fields it needs, without
+/// allocating nested objects. Hence, it does not validate the part of the
+/// @p measurement that follows such fields.
 LoadResult<OpenRequest> open_request_from_measurement(
     const std::string &measurement, const std::string &software_name,
     const std::string &software_version) noexcept;
@@ -90,11 +309,22 @@ struct OpenResponse {
   /// report_id is the report ID (only meaningful on success).
   std::string report_id;
 
+  /// retryable indicates whether the failure is transient.
+  bool retryable = false;
+
+  /// bytes_sent is the number of bytes we sent, including the headers and
+  /// the bytes sent by previous attempts, if any.
+  uint64_t bytes_sent = 0;
+
+  /// bytes_received is the number of bytes we received, likewise.
+  uint64_t bytes_received = 0;
+
   /// logs contains the logs.
-  std::vector<std::string> logs;
+  std::vector<LogLine> logs;
 };
 
-/// open opens a report with a collector.
+/// open opens a report with a collector. Transient failures are retried
+/// according to the retry policy in @p settings.
 OpenResponse open(const OpenRequest &request,
                   const Settings &settings) noexcept;
 
@@ -115,14 +345,46 @@ struct UpdateResponse {
   /// reason is the reason of failure.
   std::string reason;
 
+  /// body_bytes is the size of the update body before compression.
+  uint64_t body_bytes = 0;
+
+  /// upload_bytes is the size of the update body we uploaded, which is
+  /// smaller than body_bytes if we compressed the body.
+  uint64_t upload_bytes = 0;
+
+  /// retryable indicates whether the failure is transient.
+  bool retryable = false;
+
+  /// bytes_sent is the number of bytes we sent, including the headers and
+  /// the bytes sent by previous attempts, if any.
+  uint64_t bytes_sent = 0;
+
+  /// bytes_received is the number of bytes we received, likewise.
+  uint64_t bytes_received = 0;
+
+  /// tls_handshake indicates that we performed a TLS handshake to send the
+  /// update, rather than reusing a connection. We only know it when using
+  /// a TLS session cache (see Settings::tls_session_cache_path).
+  bool tls_handshake = false;
+
+  /// tls_resumed indicates that such handshake resumed a TLS session.
+  bool tls_resumed = false;
+
   /// logs contains the logs.
-  std::vector<std::string> logs;
+  std::vector<LogLine> logs;
 };
 
-/// update updates a report by adding a new measurement.
+/// update updates a report by adding a new measurement. Transient failures
+/// are retried according to the retry policy in @p settings.
 UpdateResponse update(const UpdateRequest &request,
                       const Settings &settings) noexcept;
 
+/// update is like the above overload except that it takes ownership of
+/// the measurement in @p request and reuses its memory for the body that
+/// we upload, so that the measurement is not copied.
+UpdateResponse update(UpdateRequest &&request,
+                      const Settings &settings) noexcept;
+
 /// CloseRequest is a request to close a report.
 struct CloseRequest {
   /// report_id is the report ID
@@ -137,14 +399,311 @@ struct CloseResponse {
   /// reason is the reason of failure.
   std::string reason;
 
+  /// retryable indicates whether the failure is transient.
+  bool retryable = false;
+
+  /// bytes_sent is the number of bytes we sent, including the headers and
+  /// the bytes sent by previous attempts, if any.
+  uint64_t bytes_sent = 0;
+
+  /// bytes_received is the number of bytes we received, likewise.
+  uint64_t bytes_received = 0;
+
   /// logs contains the logs.
-  std::vector<std::string> logs;
+  std::vector<LogLine> logs;
 };
 
-/// close closes a report.
+/// close closes a report. Transient failures are retried according to the
+/// retry policy in @p settings.
 CloseResponse close(const CloseRequest &request,
                     const Settings &settings) noexcept;
 
+/// CollectorProbe is the result of probing a collector.
+struct CollectorProbe {
+  /// base_url is the collector base URL.
+  std::string base_url;
+
+  /// good indicates whether the collector responded.
+  bool good = false;
+
+  /// reason is the reason of failure.
+  std::string reason;
+
+  /// connect_time is the time to connect, in seconds.
+  double connect_time = 0.0;
+
+  /// ttfb is the time to the first response byte, in seconds.
+  double ttfb = 0.0;
+};
+
+/// probe_collectors concurrently sends a GET request to each collector in
+/// @p base_urls, using the timeout and the CA bundle in @p settings. Any
+/// response but a 5xx means that the collector is good. The result is
+/// ranked: good collectors first, from the fastest to the slowest to
+/// respond, then the others in their original order.
+std::vector<CollectorProbe> probe_collectors(
+    const std::vector<std::string> &base_urls,
+    const Settings &settings) noexcept;
+
+/// UpdateCallback is the callback called when an asynchronous update
+/// completes, receiving the corresponding UpdateResponse.
+using UpdateCallback = std::function<void(UpdateResponse)>;
+
+/// UpdateEngine performs many updates concurrently, using a cURL multi
+/// handle, keeping at most a configurable number of them in flight. When
+/// possible, the updates reuse the same connections.
+///
+/// This class is not thread safe. The callbacks are called by the thread
+/// that calls run_once, wait, or update.
+class UpdateEngine {
+ public:
+  /// UpdateEngine creates an engine keeping at most @p max_in_flight
+  /// updates in flight at any given time. Zero is treated like one.
+  explicit UpdateEngine(size_t max_in_flight) noexcept;
+
+  /// UpdateEngine is the deleted copy constructor.
+  UpdateEngine(const UpdateEngine &) noexcept = delete;
+
+  /// UpdateEngine is the deleted copy assignment.
+  UpdateEngine &operator=(const UpdateEngine &) noexcept = delete;
+
+  /// UpdateEngine is the deleted move constructor.
+  UpdateEngine(UpdateEngine &&) noexcept = delete;
+
+  /// UpdateEngine is the deleted move assignment.
+  UpdateEngine &operator=(UpdateEngine &&) noexcept = delete;
+
+  /// update schedules the update described by @p request, using the
+  /// specified @p settings. If there are already max_in_flight updates
+  /// in flight, this function runs the engine until one completes. The
+  /// @p callback will be called when the update completes, including when
+  /// we fail to prepare the update, in which case it is called immediately.
+  void update(const UpdateRequest &request, const Settings &settings,
+              UpdateCallback callback) noexcept;
+
+  /// update is like the above overload except that it takes ownership of
+  /// the measurement in @p request and reuses its memory for the body.
+  void update(UpdateRequest &&request, const Settings &settings,
+              UpdateCallback callback) noexcept;
+
+  /// in_flight returns the number of updates in flight.
+  size_t in_flight() const noexcept;
+
+  /// run_once waits at most @p timeout_msec milliseconds for I/O, then it
+  /// makes progress and calls the callbacks of the completed updates.
+  void run_once(int timeout_msec) noexcept;
+
+  /// wait runs the engine until all the updates are complete.
+  void wait() noexcept;
+
+  /// ~UpdateEngine waits for all the updates to complete.
+  ~UpdateEngine() noexcept;
+
+ private:
+  friend class Reporter;
+  friend class ReporterClient;
+
+  // update_with_body_ is like update but @p body is already prepared, and
+  // we use @p timeout rather than the timeout of @p settings.
+  void update_with_body_(const std::string &report_id, std::string body,
+                         const Settings &settings, int64_t timeout,
+                         UpdateCallback callback) noexcept;
+
+  // PerformCallback is called when perform_ completes, receiving the
+  // response and whether we performed a TLS handshake to send the request
+  // and whether such handshake resumed a session (see UpdateResponse).
+  using PerformCallback =
+      std::function<void(curl::Response, bool, bool)>;
+
+  // perform_ schedules @p request like update does, using the TLS session
+  // cache of @p settings, if any, and the logging settings of @p settings.
+  // We call @p callback when done, including when we fail to initialize
+  // the request, in which case we call it immediately.
+  void perform_(curl::Request request, const Settings &settings,
+                PerformCallback callback) noexcept;
+
+  // Impl is the opaque implementation.
+  class Impl;
+
+  // impl_ is the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// SpoolEntry is a measurement read from a Spool.
+struct SpoolEntry {
+  /// segment is the sequence number of the segment containing the entry.
+  uint64_t segment = 0;
+
+  /// offset is the offset of the entry within its segment.
+  uint64_t offset = 0;
+
+  /// measurement is the serialized measurement.
+  std::string measurement;
+};
+
+/// Spool is a crash-safe on-disk queue of measurements waiting to be
+/// submitted. It lives in a directory containing append-only segment files.
+/// Each record in a segment has a checksum, so that a record that was only
+/// partially written when the process was killed is detected and discarded
+/// when the spool is opened again. Removing an entry just marks it as
+/// removed in place, and a segment is deleted once all its entries have
+/// been removed. Writes are flushed to stable storage in batches, hence
+/// the spool provides at-least-once semantics: after a crash, a removed
+/// entry may show up again.
+///
+/// This class is not thread safe. The spool is not available on Windows,
+/// where open always fails.
+class Spool {
+ public:
+  /// Spool creates a spool using @p directory, which is created by open
+  /// if it does not exist. You must call open before using the spool.
+  explicit Spool(std::string directory) noexcept;
+
+  /// Spool is the deleted copy constructor.
+  Spool(const Spool &) noexcept = delete;
+
+  /// Spool is the deleted copy assignment.
+  Spool &operator=(const Spool &) noexcept = delete;
+
+  /// Spool is the deleted move constructor.
+  Spool(Spool &&) noexcept = delete;
+
+  /// Spool is the deleted move assignment.
+  Spool &operator=(Spool &&) noexcept = delete;
+
+  /// set_max_segment_size sets the size in bytes after which we start
+  /// writing a new segment. The default is 64 MiB.
+  void set_max_segment_size(uint64_t size) noexcept;
+
+  /// set_sync_interval sets the number of writes (i.e., appends and
+  /// removals) after which we flush the spool to stable storage. The
+  /// default is 64. One means that we flush after every write.
+  void set_sync_interval(size_t count) noexcept;
+
+  /// open opens the spool, loading the entries written by previous runs
+  /// and discarding the records that were not completely written. On
+  /// failure, @p reason contains the reason of failure.
+  bool open(std::string &reason) noexcept;
+
+  /// append adds @p measurement at the end of the spool.
+  bool append(const std::string &measurement, std::string &reason) noexcept;
+
+  /// read reads at most @p max_count entries, oldest first, into @p entries.
+  bool read(size_t max_count, std::vector<SpoolEntry> &entries,
+            std::string &reason) noexcept;
+
+  /// remove removes @p entry, which must have been returned by read.
+  bool remove(const SpoolEntry &entry, std::string &reason) noexcept;
+
+  /// sync flushes the pending writes to stable storage.
+  bool sync(std::string &reason) noexcept;
+
+  /// size returns the number of entries in the spool.
+  size_t size() const noexcept;
+
+  /// ~Spool flushes the pending writes and closes the spool.
+  ~Spool() noexcept;
+
+ private:
+  // Impl is the opaque implementation.
+  class Impl;
+
+  // impl_ is the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// LatencyHistogram is a histogram of latencies in the spirit of
+/// HdrHistogram. Latencies below 16 microseconds have their own bucket,
+/// then each power of two is split into 16 buckets, so the values we return
+/// exceed the recorded ones by at most 1/16. Buckets are allocated lazily
+/// and recording a latency is cheap. Histograms can be merged.
+class LatencyHistogram {
+ public:
+  /// record records a latency of @p usec microseconds.
+  void record(int64_t usec) noexcept;
+
+  /// record_since records the time elapsed since @p start.
+  void record_since(std::chrono::steady_clock::time_point start) noexcept;
+
+  /// merge adds the samples in @p other to this histogram.
+  void merge(const LatencyHistogram &other) noexcept;
+
+  /// count returns the number of samples.
+  uint64_t count() const noexcept;
+
+  /// min returns the minimum latency in microseconds, or zero.
+  int64_t min() const noexcept;
+
+  /// max returns the maximum latency in microseconds, or zero.
+  int64_t max() const noexcept;
+
+  /// mean returns the mean latency in microseconds, or zero.
+  double mean() const noexcept;
+
+  /// percentile returns the latency in microseconds below which falls the
+  /// @p p percent of the samples, or zero if there are no samples.
+  int64_t percentile(double p) const noexcept;
+
+  /// to_json returns a JSON object containing the count, the min, the max,
+  /// the mean, some percentiles, and the nonempty buckets as a list of
+  /// [upper bound, count] pairs, where the upper bound is inclusive.
+  std::string to_json() const noexcept;
+
+ private:
+  // bucket_index_ returns the index of the bucket containing @p usec.
+  static size_t bucket_index_(uint64_t usec) noexcept;
+
+  // bucket_upper_bound_ returns the largest value in bucket @p index.
+  static uint64_t bucket_upper_bound_(size_t index) noexcept;
+
+  // buckets_ contains the buckets, up to the last nonempty one.
+  std::vector<uint64_t> buckets_;
+
+  // count_ is the number of samples.
+  uint64_t count_ = 0;
+
+  // sum_ is the sum of the samples.
+  double sum_ = 0.0;
+
+  // min_ is the smallest sample.
+  int64_t min_ = 0;
+
+  // max_ is the largest sample.
+  int64_t max_ = 0;
+};
+
+// CollectorCache is the opaque cache of discovered collectors.
+class CollectorCache;
+
+// TlsSessionCache is the opaque cache of TLS sessions.
+class TlsSessionCache;
+
+// JsonArena is the opaque arena for JSON documents.
+class JsonArena;
+
+// ReportPreopener is the opaque opener of the next report.
+class ReportPreopener;
+
+// ReportPreparer is the opaque preparer of a report.
+class ReportPreparer;
+
+/// CollectorStats contains statistics about a discovered collector.
+struct CollectorStats {
+  /// probe is the result of probing the collector. When we do not probe
+  /// the collector, probe.good is true and the timings are zero.
+  CollectorProbe probe;
+
+  /// successes is the number of calls that succeeded.
+  uint64_t successes = 0;
+
+  /// failures is the number of calls that failed because of transient
+  /// errors, which are the errors counting towards failing over.
+  uint64_t failures = 0;
+
+  /// consecutive_failures is the number of consecutive failures.
+  unsigned consecutive_failures = 0;
+};
+
 /// Reporter submits measurements as part of the same report.
 ///
 /// This class must not be shared among threads. That's why we enforce
@@ -181,43 +740,323 @@ class Reporter {
   /// base_url returns the currently set collector base URL.
   const std::string &base_url() const noexcept;
 
+  /// set_report_id_splicing controls how we update the report ID of
+  /// a measurement. By default we serialize again the measurement after
+  /// changing its report ID. When @p enabled is true, instead, we replace
+  /// the value of the top-level report_id field in the original bytes (or
+  /// we insert such field if missing), leaving everything else untouched.
+  void set_report_id_splicing(bool enabled) noexcept;
+
+  /// report_id_splicing returns whether report ID splicing is enabled.
+  bool report_id_splicing() const noexcept;
+
+  /// set_json_arena_max_size sets the maximum number of bytes that the
+  /// arena in which we allocate the JSON documents used when submitting a
+  /// measurement keeps allocated between submissions. The arena is reset
+  /// after each submission, so most submissions do not allocate memory for
+  /// such documents. A larger document temporarily grows the arena beyond
+  /// this size. Zero disables the arena. The default is 4 MiB.
+  void set_json_arena_max_size(size_t size) noexcept;
+
+  /// json_arena_max_size returns the JSON arena maximum size.
+  size_t json_arena_max_size() const noexcept;
+
+  /// set_max_updates_in_flight sets the maximum number of updates that
+  /// submit_batch keeps in flight concurrently for the same report. The
+  /// default is one, meaning that updates are sent one after the other.
+  void set_max_updates_in_flight(size_t count) noexcept;
+
+  /// max_updates_in_flight returns the maximum number of updates in flight.
+  size_t max_updates_in_flight() const noexcept;
+
+  /// set_max_open_reports sets the maximum number of reports that we keep
+  /// open at the same time. The default is one, meaning that we close the
+  /// current report as soon as we see a measurement that belongs to another
+  /// report. With a larger value, we keep the least recently used reports
+  /// open, such that interleaving measurements belonging to different
+  /// reports does not cause extra close and open round trips.
+  void set_max_open_reports(size_t count) noexcept;
+
+  /// max_open_reports returns the maximum number of open reports.
+  size_t max_open_reports() const noexcept;
+
+  /// set_report_idle_timeout sets the number of seconds after which we
+  /// close an open report that is not the current one, if unused. Zero,
+  /// the default, means that we only close them when we have too many open
+  /// reports, and when the Reporter is destroyed.
+  void set_report_idle_timeout(int64_t timeout) noexcept;
+
+  /// report_idle_timeout returns the report idle timeout.
+  int64_t report_idle_timeout() const noexcept;
+
+  /// set_report_rotation_policy sets the policy used to rotate the current
+  /// report. See ReportRotationPolicy. When the current report reaches a
+  /// limit, we open the next report in a background thread, and we keep
+  /// submitting into the current report until the next one is open, hence
+  /// the limits are approximate. Then we submit into the next report, and
+  /// we hand the current one to the background closer, regardless of
+  /// set_background_close, so rotating does not slow down submissions. Use
+  /// flush to wait for the rotated reports to be closed.
+  void set_report_rotation_policy(ReportRotationPolicy policy) noexcept;
+
+  /// report_rotation_policy returns the report rotation policy.
+  const ReportRotationPolicy &report_rotation_policy() const noexcept;
+
+  /// open_reports returns the number of currently open reports.
+  size_t open_reports() const noexcept;
+
+  /// set_compression sets the compression applied to update bodies. The
+  /// default is to not compress them. See Settings::compression.
+  void set_compression(Compression compression) noexcept;
+
+  /// compression returns the compression applied to update bodies.
+  Compression compression() const noexcept;
+
+  /// set_compression_level sets the zlib compression level. See
+  /// Settings::compression_level for more information.
+  void set_compression_level(int level) noexcept;
+
+  /// compression_level returns the zlib compression level.
+  int compression_level() const noexcept;
+
+  /// set_compression_threshold sets the size in bytes below which we do
+  /// not compress update bodies.
+  void set_compression_threshold(size_t size) noexcept;
+
+  /// compression_threshold returns the compression threshold.
+  size_t compression_threshold() const noexcept;
+
+  /// set_http2 controls whether we use HTTP/2. See Settings::http2. The
+  /// updates that submit_batch keeps in flight (see set_max_updates_in_flight)
+  /// are multiplexed over a single connection.
+  void set_http2(bool enabled) noexcept;
+
+  /// http2 returns whether we use HTTP/2.
+  bool http2() const noexcept;
+
+  /// set_tls_session_cache_path enables saving the TLS sessions negotiated
+  /// with collectors into the file at @p path, such that the connections
+  /// opened later, including by other processes, resume them with an
+  /// abbreviated handshake. All the Reporters using the same @p path share
+  /// the same cache. The tls_handshake_full and tls_handshake_resumed stats
+  /// count the handshakes, except those of the reports closed in background
+  /// after the Reporter is gone. The cache requires libcurl to use the
+  /// OpenSSL we link with and it is not available on Windows. With the cache,
+  /// we open, update, and close the reports using an UpdateEngine, also when
+  /// we keep a single update in flight, since mkcurl does not expose the TLS
+  /// context, such that they share the same connection. An empty @p path,
+  /// the default, disables the cache. Returns false, disabling the cache,
+  /// if we cannot use it.
+  bool set_tls_session_cache_path(std::string path) noexcept;
+
+  /// tls_session_cache_path returns the TLS session cache path.
+  const std::string &tls_session_cache_path() const noexcept;
+
+  /// set_collector_cache_path enables caching the collectors discovered
+  /// using the bouncer into the file at @p path, such that we don't need to
+  /// query the bouncer again until the cache expires. All the Reporters
+  /// using the same @p path share the same cache, hence a Reporter can use
+  /// the collectors discovered by another Reporter without touching the
+  /// disk or the network. An empty @p path, the default, disables caching.
+  void set_collector_cache_path(std::string path) noexcept;
+
+  /// collector_cache_path returns the collector cache path.
+  const std::string &collector_cache_path() const noexcept;
+
+  /// set_collector_cache_ttl sets for how many seconds the discovered
+  /// collectors are valid. The default is one day.
+  void set_collector_cache_ttl(int64_t ttl) noexcept;
+
+  /// collector_cache_ttl returns the collector cache TTL.
+  int64_t collector_cache_ttl() const noexcept;
+
+  /// set_collector_max_failures sets the number of consecutive calls
+  /// failing because of transient errors after which we fail over to the
+  /// next discovered collector, removing the failing one from the cache.
+  /// When there are no more collectors, we discover them again. The
+  /// default is three.
+  void set_collector_max_failures(unsigned count) noexcept;
+
+  /// collector_max_failures returns the maximum number of failures.
+  unsigned collector_max_failures() const noexcept;
+
+  /// set_collector_probing controls whether, when the bouncer returns more
+  /// than one collector, we probe them concurrently and use the one that
+  /// responds first, failing over to the next ones in order of latency.
+  /// When @p enabled is false, we use the bouncer order. Enabled by default.
+  void set_collector_probing(bool enabled) noexcept;
+
+  /// collector_probing returns whether collector probing is enabled.
+  bool collector_probing() const noexcept;
+
+  /// collectors returns the statistics of the discovered collectors, in the
+  /// order in which we use them. The list is empty when we did not discover
+  /// any collector, including when the base URL has been explicitly set.
+  const std::vector<CollectorStats> &collectors() const noexcept;
+
+  /// set_retry_policy sets the policy used to retry API calls that fail
+  /// because of transient errors, and to stop contacting an unhealthy
+  /// collector for a while. See RetryPolicy. Updates kept in flight by
+  /// submit_batch are retried one after the other, after all the updates
+  /// of the same report have completed. The default is to not retry.
+  void set_retry_policy(RetryPolicy policy) noexcept;
+
+  /// retry_policy returns the retry policy.
+  const RetryPolicy &retry_policy() const noexcept;
+
+  /// set_spool sets the @p spool where we save the measurements that we
+  /// fail to submit, such that they are not lost, unless they are not valid
+  /// measurements. The spool must be already open. Use drain_spool to submit
+  /// the spooled measurements later. Pass nullptr to disable spooling, which
+  /// is the default.
+  void set_spool(std::shared_ptr<Spool> spool) noexcept;
+
+  /// spool returns the spool, or nullptr if spooling is disabled.
+  const std::shared_ptr<Spool> &spool() const noexcept;
+
+  /// set_log_level sets the most verbose level that we log. Messages with
+  /// a more verbose level are not even formatted. The default is to log
+  /// everything, including the request and response bodies.
+  void set_log_level(LogLevel level) noexcept;
+
+  /// log_level returns the currently configured log level.
+  LogLevel log_level() const noexcept;
+
+  /// set_max_body_log_size sets the maximum number of bytes of each body
+  /// that we log. Longer bodies are truncated. By default we do not
+  /// truncate bodies.
+  void set_max_body_log_size(size_t size) noexcept;
+
+  /// max_body_log_size returns the maximum size of a logged body.
+  size_t max_body_log_size() const noexcept;
+
+  /// set_max_logs sets the maximum number of lines that we keep in the
+  /// logs vector passed to the submit methods. When there are more lines,
+  /// we drop the oldest ones, as in a ring buffer. Zero, the default,
+  /// means that the logs vector is not bounded.
+  void set_max_logs(size_t count) noexcept;
+
+  /// max_logs returns the maximum number of lines kept in the logs.
+  size_t max_logs() const noexcept;
+
+  /// set_log_sink sets the function receiving log messages. When a sink
+  /// is set, we pass log messages to it rather than appending them to the
+  /// logs vector passed to the submit methods. Transport logs, i.e., the
+  /// ones emitted by open, update, and close, are passed to the sink with
+  /// their own level, while the bouncer logs are LogLevel::debug messages.
+  /// Pass an empty function to unset the sink.
+  void set_log_sink(LogSink sink) noexcept;
+
   /*
-   * Testing helpers. Allow you to know about what code paths were
-   * takens. They can change at any time.
+   * Statistics. The counters allow you to know about what code paths
+   * were taken and they can change at any time. The latency histograms
+   * and the byte counters, instead, are meant to instrument production
+   * code and they are a stable part of the API.
    */
 
 #define MKCOLLECTOR_REPORTER_STATS_ENUM(XX) \
+  XX(bouncer_cache_hit)                     \
+  XX(bouncer_cache_invalidated)             \
   XX(bouncer_error)                         \
   XX(bouncer_okay)                          \
   XX(bouncer_no_collectors)                 \
+  XX(circuit_breaker_fail_fast)             \
+  XX(circuit_breaker_trip)                  \
+  XX(collector_failover)                    \
+  XX(collector_probe_error)                 \
+  XX(collector_probe_okay)                  \
   XX(load_request_error)                    \
   XX(load_request_okay)                     \
   XX(close_report_error)                    \
   XX(close_report_okay)                     \
+  XX(open_report_avoided)                   \
   XX(open_report_error)                     \
   XX(report_id_empty)                       \
+  XX(report_prepared)                       \
+  XX(report_rotated)                        \
   XX(open_report_okay)                      \
+  XX(retry_attempt)                         \
   XX(serialize_measurement_error)           \
+  XX(spool_append_error)                    \
+  XX(spool_append_okay)                     \
+  XX(spool_remove_error)                    \
+  XX(spool_remove_okay)                     \
+  XX(tls_handshake_full)                    \
+  XX(tls_handshake_resumed)                 \
   XX(update_report_error)                   \
   XX(update_report_okay)
 
-  // Stats contains stats about a submission.
+  /// Stats contains stats about one or more submissions.
   struct Stats {
-    // operator== compares this with @p other for equality.
+    /// operator== compares the counters of this with @p other for equality.
     bool operator==(const Stats &other) const;
 
-    // Stats is the default constructor.
+    /// operator+= merges @p other into this, e.g., to aggregate the stats
+    /// of many submissions or of many reporters.
+    Stats &operator+=(const Stats &other) noexcept;
+
+    /// to_json returns a JSON object containing all the stats.
+    std::string to_json() const noexcept;
+
+    /// Stats is the default constructor.
     Stats() noexcept;
 
-    // Stats initializes this class from a list of strings indicating what
-    // fields must be set to nonzero.
+    /// Stats initializes this class from a list of strings indicating what
+    /// counters must be set to nonzero.
     explicit Stats(std::initializer_list<std::string> list) noexcept;
 
 #define XX(name_) unsigned name_ = 0;
     MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
 #undef XX
+
+    /// update_body_bytes is the number of bytes of the update bodies we
+    /// submitted, before compression.
+    uint64_t update_body_bytes = 0;
+
+    /// update_upload_bytes is the number of bytes of the update bodies we
+    /// uploaded, after compression.
+    uint64_t update_upload_bytes = 0;
+
+    /// bytes_sent is the number of bytes we sent to collectors.
+    uint64_t bytes_sent = 0;
+
+    /// bytes_received is the number of bytes we received from collectors.
+    uint64_t bytes_received = 0;
+
+    /// bouncer_latency is the latency of querying the bouncer.
+    LatencyHistogram bouncer_latency;
+
+    /// open_latency is the latency of opening reports, including retries.
+    LatencyHistogram open_latency;
+
+    /// update_latency is the latency of updating reports, including
+    /// retries. With many updates in flight, each update is measured from
+    /// when it's started to when it's complete.
+    LatencyHistogram update_latency;
+
+    /// close_latency is the latency of closing reports, including retries.
+    LatencyHistogram close_latency;
+
+    /// load_latency is the latency of loading measurements from JSON.
+    LatencyHistogram load_latency;
+
+    /// serialize_latency is the latency of serializing measurements.
+    LatencyHistogram serialize_latency;
   };
 
+  /// prepare discovers the collector, if needed, connects to it, and opens
+  /// the report for @p open_request in a background thread, such that the
+  /// first submission of a measurement belonging to such report only costs
+  /// the update round trip. Call it as soon as you know the OpenRequest,
+  /// e.g., when a test starts. The software name and version are the ones
+  /// of this Reporter, like when submitting. The next submission waits for
+  /// the preparation to complete, uses the prepared collector, connection,
+  /// and report, and includes the stats and logs of the preparation. A
+  /// failed preparation is not fatal, since the submission tries again. We
+  /// use the settings configured when prepare is called. We do nothing if
+  /// the report is already open or we are already preparing a report.
+  void prepare(const OpenRequest &open_request) noexcept;
+
   /// maybe_discover_and_submit_with_stats_and_reason is like
   /// maybe_discover_and_submit_with_timeout but stores stats in @p stats
   /// and the reason in @p reason.
@@ -226,6 +1065,17 @@ class Reporter {
       int64_t upload_timeout, Stats &stats,
       std::string &reason) noexcept;
 
+  /// maybe_discover_and_submit_with_stats_and_reason is like the above
+  /// overload except that it consumes @p measurement, hence it does not
+  /// return the updated measurement. When report ID splicing is enabled,
+  /// we update the report ID and build the update body reusing the memory
+  /// of @p measurement, so that the measurement is not copied, unless we
+  /// need to keep it around to spool it in case of failure.
+  bool maybe_discover_and_submit_with_stats_and_reason(
+      std::string &&measurement, std::vector<std::string> &logs,
+      int64_t upload_timeout, Stats &stats,
+      std::string &reason) noexcept;
+
   /// maybe_discover_and_submit_with_timeout is like submit but enforces @p
   /// upload_timeout as the / number of seconds after which the HTTP
   /// upload is aborted.
@@ -239,8 +1089,9 @@ class Reporter {
   /// point to the correct report / ID as part of the submission. This
   /// function implements the following algorithm:
   ///
-  /// 0. if no base_url_ is configured, the bouncer is used
-  /// to discover the base URL that should be used;
+  /// 0. if no base_url_ is configured, the bouncer (or the collector
+  /// cache) is used to discover the collectors, and we use the one that
+  /// responds first, failing over to the others when it fails;
   ///
   /// 1. the same HTTP client is used throughout the lifecycle of this
   /// class, hence existing HTTP connections are reused if possible;
@@ -249,13 +1100,16 @@ class Reporter {
   ///
   /// 3. if we already openned a report and the current measurement is
   /// different (as defined below) from the previous measurement, then we
-  /// close the current report;
+  /// close the current report (or we keep it open for later reuse, when
+  /// more than one open report is allowed; see set_max_open_reports);
   ///
-  /// 4. if no report is open, then we open a report;
+  /// 4. if no report is open, then we open a report, unless we have kept
+  /// open a report for this measurement, in which case we reuse it;
   ///
   /// 5. we submit the measurement as part of the current report;
   ///
-  /// 6. we modify the measurement to update the report ID.
+  /// 6. we modify the measurement to update the report ID (see also
+  /// the set_report_id_splicing method).
   ///
   /// A measurement is different from the previous measurement if the
   /// OpenRequest structure obtained from successfully loading the measurement
@@ -267,55 +1121,521 @@ class Reporter {
   bool maybe_discover_and_submit(
       std::string &measurement, std::vector<std::string> &logs) noexcept;
 
+  /// BatchResult is the result of submitting a measurement in a batch.
+  struct BatchResult {
+    /// good indicates whether we succeeded.
+    bool good = false;
+
+    /// reason is the reason of failure.
+    std::string reason;
+
+    /// retryable indicates whether we failed because of a transient error,
+    /// such that submitting the measurement again may succeed. It is false
+    /// when the measurement is not valid or the collector rejected it.
+    bool retryable = false;
+  };
+
+  /// submit_batch submits all the @p measurements, modifying each of them
+  /// in place to point to the correct report ID, like
+  /// maybe_discover_and_submit does. Measurements are grouped by the
+  /// OpenRequest obtained by loading them, such that each report is opened
+  /// just once and all the updates belonging to it are sent back to back
+  /// using the same connection, or concurrently, when max_updates_in_flight
+  /// is greater than one. The group corresponding to the currently
+  /// open report, if any, is submitted first. Logs are appended to @p logs
+  /// and @p stats accumulates the stats of the whole batch. Each upload
+  /// is aborted after @p upload_timeout seconds (zero means no timeout).
+  ///
+  /// @return a vector containing, for each measurement, the result of its
+  /// submission, in the same order of @p measurements.
+  std::vector<BatchResult> submit_batch(
+      std::vector<std::string> &measurements, std::vector<std::string> &logs,
+      int64_t upload_timeout, Stats &stats) noexcept;
+
+  /// drain_spool submits at most @p max_count measurements from the spool,
+  /// oldest first, using submit_batch, and removes from the spool the ones
+  /// that we have submitted, as well as the ones that we cannot submit
+  /// (see BatchResult::retryable). A measurement that failed because of a
+  /// transient error stays in the spool, to be retried by a later call.
+  /// Call this function periodically, with a @p max_count that bounds the
+  /// time spent draining, until the spool is empty. Logs are appended to
+  /// @p logs and @p stats accumulates the stats.
+  ///
+  /// @return the number of measurements removed from the spool.
+  size_t drain_spool(size_t max_count, std::vector<std::string> &logs,
+                     int64_t upload_timeout, Stats &stats) noexcept;
+
+  /// ResubmitResult is the result of resubmit_file.
+  struct ResubmitResult {
+    /// good indicates whether we reached the end of the file.
+    bool good = false;
+
+    /// reason is the reason of failure, if we stopped because we could
+    /// not submit a measurement, and is empty otherwise.
+    std::string reason;
+
+    /// offset is the offset of the first line that we have not processed
+    /// yet. Save it and pass it to resubmit_file to resume.
+    uint64_t offset = 0;
+
+    /// okay is the number of measurements we submitted.
+    uint64_t okay = 0;
+
+    /// skipped is the number of lines that we cannot submit, because they
+    /// are not valid measurements or the collector rejected them.
+    uint64_t skipped = 0;
+  };
+
+  /// resubmit_file submits the measurements in the JSONL file at @p path,
+  /// one per line, starting from the line at byte @p offset, which must be
+  /// zero or a checkpoint previously returned in ResubmitResult::offset. The
+  /// file is memory mapped and each line is loaded directly from the
+  /// mapping, while the update body is built from a copy of the line into
+  /// which we set the report ID, like maybe_discover_and_submit does, hence
+  /// the file is not modified. We process at most @p max_count measurements
+  /// (zero means no limit), not counting empty lines. Lines that we cannot
+  /// submit are skipped (see BatchResult::retryable). We stop at the first
+  /// measurement that failed because of a transient error, such that
+  /// resuming from the returned offset retries it, and we do not spool it,
+  /// since it is still in the file. Logs are appended to @p logs and
+  /// @p stats accumulates the stats. Each upload is aborted after
+  /// @p upload_timeout seconds (zero means no timeout).
+  ///
+  /// This function is not available on Windows, where it always fails.
+  ResubmitResult resubmit_file(const std::string &path, uint64_t offset,
+                               size_t max_count,
+                               std::vector<std::string> &logs,
+                               int64_t upload_timeout, Stats &stats) noexcept;
+
   /// report_id contains the currently used report ID.
   const std::string &report_id() const noexcept;
 
+  /// set_background_close controls how the destructor closes the reports
+  /// that are still open. By default, it closes them before returning,
+  /// which may block for up to 30 seconds per report when the collector is
+  /// slow. When @p enabled is true, instead, it hands them to a closer that
+  /// is shared by all Reporters and closes them in a background thread. The
+  /// closer queues at most 1024 reports, and gives up on a report that it
+  /// could not close within 30 seconds since it was queued. Reports that we
+  /// do not close are eventually closed by the collector.
+  void set_background_close(bool enabled) noexcept;
+
+  /// background_close returns whether background close is enabled.
+  bool background_close() const noexcept;
+
+  /// flush waits until the background closer has processed all the reports
+  /// queued so far, or until @p deadline, whichever comes first. Call it,
+  /// e.g., before exiting, when you need to wait for the reports to be
+  /// closed. Do not destroy a Reporter with background close enabled after
+  /// main has returned, because the closer may have been destroyed.
+  ///
+  /// @return true if there are no more reports to close.
+  static bool flush(std::chrono::steady_clock::time_point deadline) noexcept;
+
   /// ~Reporter will close the report if necessary.
   ~Reporter() noexcept;
 
  private:
-  // make_settings creates a setting structure with the specified @p timeout.
-  Settings make_settings(int64_t timeout) const noexcept;
+  // log_ logs @p message with the specified @p level, if enabled.
+  void log_(LogLevel level, std::vector<std::string> &logs,
+            const char *message) noexcept;
 
-  // base_url_ contains the collector base URL.
-  std::string base_url_;
+  // log_ logs @p message with the specified @p level, if enabled.
+  void log_(LogLevel level, std::vector<std::string> &logs,
+            std::string message) noexcept;
 
-  // ca_bundle_path_ is the CA bundle path to use.
-  std::string ca_bundle_path_;
+  // emit_ passes @p message to the sink or appends it to @p logs.
+  void emit_(LogLevel level, std::vector<std::string> &logs,
+             std::string &&message) noexcept;
 
-  // client_ is the mkcurl client to use.
-  curl::Client client_;
+  // append_logs_ moves the transport logs in @p lines into @p logs,
+  // dropping the lines whose level is not enabled.
+  void append_logs_(std::vector<std::string> &logs,
+                    std::vector<LogLine> &lines) noexcept;
 
-  // cached_open_request_ is the latest cached open request used to
-  // decide whether a measurement belongs to the current report or
-  // whether we need to close this report and open a new one.
-  OpenRequest cached_open_request_;
+  // append_logs_ is like the above overload but for the bouncer logs,
+  // which have no level, hence we treat them as LogLevel::debug lines.
+  void append_logs_(std::vector<std::string> &logs,
+                    std::vector<std::string> &lines) noexcept;
 
-  // report_id_ is the report ID to use.
-  std::string report_id_;
+  // trim_logs_ drops the oldest lines in @p logs if they are too many.
+  void trim_logs_(std::vector<std::string> &logs) noexcept;
 
-  // short_timeout is the API calls timeout in seconds.
-  int64_t short_timeout_ = 30;
+  // maybe_discover_ implements step 0 of maybe_discover_and_submit.
+  bool maybe_discover_(std::vector<std::string> &logs, Stats &stats,
+                       std::string &reason) noexcept;
 
-  // software_name_ is the name of the tool that is submitting.
-  std::string software_name_;
+  // select_collector_ ranks the collectors in @p base_urls, probing them if
+  // needed, and uses the first one. It updates collectors_ and the base URL.
+  void select_collector_(std::vector<std::string> base_urls,
+                         std::vector<std::string> &logs,
+                         Stats &stats) noexcept;
 
-  // software_version_ is the version of the tool that is submitting.
-  std::string software_version_;
-};
+  // close_report_ closes the report with ID @p report_id.
+  void close_report_(std::string report_id, std::vector<std::string> &logs,
+                     Stats &stats, std::string &reason) noexcept;
 
-}  // inline namespace MKCOLLECTOR_INLINE_NAMESPACE
-}  // namespace collector
-}  // namespace mk
+  // close_idle_reports_ closes the parked reports that expired.
+  void close_idle_reports_(std::vector<std::string> &logs, Stats &stats,
+                           std::string &reason) noexcept;
+
+  // rotation_due_ returns whether the current report reached a limit of
+  // the rotation policy.
+  bool rotation_due_() const noexcept;
+
+  // maybe_preopen_ starts opening the next report, if the current report
+  // reached a limit of the rotation policy and we are not opening it yet.
+  void maybe_preopen_(std::vector<std::string> &logs) noexcept;
+
+  // collect_preopened_ waits for the next report to be open, updating
+  // @p stats, and returns its ID in @p report_id on success.
+  bool collect_preopened_(std::string &report_id,
+                          std::vector<std::string> &logs, Stats &stats,
+                          std::string &reason) noexcept;
+
+  // discard_preopened_ closes the next report, if we are opening it.
+  void discard_preopened_(std::vector<std::string> &logs, Stats &stats,
+                          std::string &reason) noexcept;
+
+  // maybe_rotate_ replaces the current report with the next report, if
+  // we rotate the report to which @p open_request belongs and the next
+  // report is open, and closes the current report in background.
+  void maybe_rotate_(const OpenRequestKey &open_request,
+                     std::vector<std::string> &logs, Stats &stats,
+                     std::string &reason) noexcept;
+
+  // leave_current_report_ parks or closes the current report, unless it
+  // belongs to @p open_request, and reuses the parked report belonging to
+  // @p open_request, if any.
+  void leave_current_report_(const OpenRequestKey &open_request,
+                             std::vector<std::string> &logs, Stats &stats,
+                             std::string &reason) noexcept;
+
+  // collect_prepared_ waits for the report being prepared, if any, and
+  // makes it the current report, updating @p logs and @p stats.
+  void collect_prepared_(std::vector<std::string> &logs, Stats &stats,
+                         std::string &reason) noexcept;
+
+  // maybe_reopen_ implements steps 3 and 4 of maybe_discover_and_submit.
+  bool maybe_reopen_(OpenRequestKey open_request,
+                     std::vector<std::string> &logs, Stats &stats,
+                     std::string &reason) noexcept;
+
+  // prepare_discovered_ implements steps 1-5 of maybe_discover_and_submit
+  // except for the actual update. On success, @p serialized contains the
+  // measurement to be submitted, already pointing to the right report ID.
+  // When @p measurement views @p serialized, we modify it in place.
+  bool prepare_discovered_(MeasurementView measurement,
+                           std::vector<std::string> &logs, Stats &stats,
+                           std::string &reason,
+                           std::string &serialized) noexcept;
+
+  // update_prepared_ implements step 5 (continued) of
+  // maybe_discover_and_submit, uploading the @p serialized measurement.
+  // When @p consume is true, we reuse the memory of @p serialized for the
+  // body, leaving @p serialized in an unspecified state.
+  UpdateResponse update_prepared_(std::string &serialized, bool consume,
+                                  std::vector<std::string> &logs,
+                                  int64_t upload_timeout,
+                                  Stats &stats) noexcept;
+
+  // update_once_ sends the update @p body of the current report, without
+  // retrying, aborting it after @p timeout seconds, counting the TLS
+  // handshakes into @p stats (see ReporterClient).
+  UpdateResponse update_once_(std::string body, int64_t timeout,
+                              Stats &stats) noexcept;
+
+  // count_tls_handshake_ counts into @p stats the TLS handshake, if any,
+  // performed to send the update that received @p response.
+  static void count_tls_handshake_(const UpdateResponse &response,
+                                   Stats &stats) noexcept;
+
+  // submit_discovered_ implements steps 1-6 of maybe_discover_and_submit.
+  // On success, it stores the submitted @p measurement into @p updated,
+  // which may be the string viewed by @p measurement.
+  bool submit_discovered_(MeasurementView measurement, std::string &updated,
+                          std::vector<std::string> &logs,
+                          int64_t upload_timeout, Stats &stats,
+                          std::string &reason) noexcept;
+
+  // submit_async_ schedules the update of the current report with the
+  // @p serialized measurement and, when done, stores the result into
+  // @p result and finishes processing @p measurement, like
+  // submit_discovered_ does. The referenced objects must outlive the
+  // update, i.e., they must live until engine_ is idle.
+  // When the update fails because of a transient error and the retry policy
+  // allows that, we append to @p deferred a function that retries the
+  // update synchronously. The @p deferred functions must be called once
+  // engine_ is idle, and before changing report.
+  void submit_async_(std::string serialized, std::string &measurement,
+                     BatchResult &result, std::vector<std::string> &logs,
+                     int64_t upload_timeout, Stats &stats,
+                     std::vector<std::function<void()>> &deferred) noexcept;
+
+  // submit_batch_ is like submit_batch but does not spool.
+  std::vector<BatchResult> submit_batch_(
+      std::vector<std::string> &measurements, std::vector<std::string> &logs,
+      int64_t upload_timeout, Stats &stats) noexcept;
+
+  // spool_measurement_ saves @p measurement into the spool, if any, unless
+  // its submission failed because of a non @p retryable error, since trying
+  // again would be pointless.
+  void spool_measurement_(const std::string &measurement, bool retryable,
+                          std::vector<std::string> &logs,
+                          Stats &stats) noexcept;
+
+  // call_ performs the API call @p func using @p settings, honouring the
+  // retry policy and the circuit breaker, and updating @p stats.
+  template <typename Response, typename Func>
+  Response call_(const Settings &settings, Func &&func, Stats &stats) noexcept;
+
+  // breaker_allows_ returns whether the circuit breaker allows us to
+  // contact the collector, and updates @p stats when it does not.
+  bool breaker_allows_(Stats &stats) noexcept;
+
+  // record_health_ updates the circuit breaker state, and the collector
+  // cache, after an API call that either @p failed because of a transient
+  // error or not.
+  void record_health_(bool failed, Stats &stats) noexcept;
+
+  // complete_update_ processes the @p update_response to the update of
+  // the current report with the @p serialized measurement. On success, the
+  // serialized measurement is moved into @p measurement.
+  bool complete_update_(UpdateResponse update_response,
+                        std::string &serialized, std::string &measurement,
+                        std::vector<std::string> &logs, Stats &stats,
+                        std::string &reason) noexcept;
+
+  // ReportPreparer uses a Reporter to prepare reports.
+  friend class ReportPreparer;
+
+  // settings_ contains the collector base URL, the CA bundle path, the
+  // logging, compression, and retry settings that we pass by reference to
+  // API calls, so that we don't copy them for each call. We pass the timeout
+  // of each call separately, since the UpdateEngine may run callbacks that
+  // make other calls while a reference to settings_ is still in use.
+  Settings settings_;
+
+  // client_ is the mkcurl client to use.
+  curl::Client client_;
+
+  // cached_open_request_ is the latest cached open request used to
+  // decide whether a measurement belongs to the current report or
+  // whether we need to close this report and open a new one.
+  OpenRequestKey cached_open_request_;
+
+  // report_id_ is the report ID to use.
+  std::string report_id_;
+
+  // short_timeout is the API calls timeout in seconds.
+  int64_t short_timeout_ = 30;
+
+  // background_close_ indicates whether to close reports in background.
+  bool background_close_ = false;
+
+  // software_name_ is the name of the tool that is submitting.
+  std::string software_name_;
+
+  // software_version_ is the version of the tool that is submitting.
+  std::string software_version_;
+
+  // report_id_splicing_ indicates whether to splice the report ID.
+  bool report_id_splicing_ = false;
+
+  // json_arena_max_size_ is the JSON arena maximum size.
+  size_t json_arena_max_size_ = 4 * 1024 * 1024;
+
+  // json_arena_ is the JSON arena, if enabled.
+  std::shared_ptr<JsonArena> json_arena_;
+
+  // max_updates_in_flight_ is the maximum number of updates in flight.
+  size_t max_updates_in_flight_ = 1;
+
+  // engine_ is the engine used to keep many updates in flight. We create
+  // it lazily, when we need more than one update in flight, or when we use
+  // a TLS session cache, which only the engine's connections can use, in
+  // which case we also use it to open and close the reports.
+  std::unique_ptr<UpdateEngine> engine_;
+
+  // ReportUsage tracks the usage of a report for rotating it.
+  struct ReportUsage {
+    // measurements is the number of measurements we submitted.
+    uint64_t measurements = 0;
+
+    // bytes is the number of update body bytes we submitted.
+    uint64_t bytes = 0;
+
+    // opened is when we opened the report.
+    std::chrono::steady_clock::time_point opened =
+        std::chrono::steady_clock::now();
+  };
+
+  // ParkedReport is a report that is open but is not the current one.
+  struct ParkedReport {
+    // open_request is the corresponding open request.
+    OpenRequestKey open_request;
+
+    // report_id is the report ID.
+    std::string report_id;
+
+    // usage is the usage of the report.
+    ReportUsage usage;
+
+    // last_used is when we stopped using this report.
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  // parked_reports_ contains the open reports other than the current
+  // report, sorted from the most recently used to the least recently used.
+  std::vector<ParkedReport> parked_reports_;
+
+  // max_open_reports_ is the maximum number of open reports.
+  size_t max_open_reports_ = 1;
+
+  // report_idle_timeout_ is the idle timeout of parked reports.
+  int64_t report_idle_timeout_ = 0;
+
+  // rotation_policy_ is the report rotation policy.
+  ReportRotationPolicy rotation_policy_;
+
+  // report_usage_ is the usage of the current report.
+  ReportUsage report_usage_;
+
+  // preopener_ is opening the next report, if we are about to rotate.
+  std::shared_ptr<ReportPreopener> preopener_;
+
+  // preparer_ is preparing a report, if we are doing that.
+  std::shared_ptr<ReportPreparer> preparer_;
+
+  // defer_rotation_ prevents rotating the current report while submit_batch
+  // has updates in flight, or retries pending, for such report.
+  bool defer_rotation_ = false;
+
+  // spool_ is the optional spool.
+  std::shared_ptr<Spool> spool_;
+
+  // failure_retryable_ is set when we fail to submit a measurement and
+  // tells whether the failure is transient, such that we should submit the
+  // measurement again, or whether doing that would fail again because the
+  // measurement is not valid or the collector rejected it.
+  bool failure_retryable_ = false;
+
+  // collector_cache_path_ is the collector cache path.
+  std::string collector_cache_path_;
+
+  // collector_cache_ttl_ is the collector cache TTL in seconds.
+  int64_t collector_cache_ttl_ = 86400;
+
+  // collector_max_failures_ is the maximum number of failures.
+  unsigned collector_max_failures_ = 3;
+
+  // collector_cache_ is the collector cache, if any.
+  std::shared_ptr<CollectorCache> collector_cache_;
+
+  // tls_session_cache_ keeps the TLS session cache of settings_, if any,
+  // alive between the requests.
+  std::shared_ptr<TlsSessionCache> tls_session_cache_;
+
+  // collector_probing_ indicates whether collector probing is enabled.
+  bool collector_probing_ = true;
+
+  // collectors_ contains the discovered collectors, in order of use.
+  std::vector<CollectorStats> collectors_;
+
+  // discovered_ indicates whether we discovered the base URL.
+  bool discovered_ = false;
+
+  // rediscover_ indicates that we should discover a collector again.
+  bool rediscover_ = false;
+
+  // breaker_open_ indicates whether the circuit breaker is open.
+  bool breaker_open_ = false;
+
+  // breaker_failures_ counts the consecutive transient failures.
+  unsigned breaker_failures_ = 0;
+
+  // breaker_open_until_ is when the circuit breaker lets a call through.
+  std::chrono::steady_clock::time_point breaker_open_until_;
+
+  // breaker_probing_ indicates that the circuit breaker is half open, i.e.,
+  // it let a call through after the cooldown and waits for its result.
+  bool breaker_probing_ = false;
+
+  // max_logs_ is the maximum number of lines kept in the logs.
+  size_t max_logs_ = 0;
+
+  // log_sink_ is the optional log sink.
+  LogSink log_sink_;
+};
+
+}  // inline namespace MKCOLLECTOR_INLINE_NAMESPACE
+}  // namespace collector
+}  // namespace mk
+
+namespace std {
+
+/// hash<mk::collector::OpenRequest> allows using OpenRequest as the key
+/// of unordered containers.
+template <> struct hash<mk::collector::OpenRequest> {
+  size_t operator()(const mk::collector::OpenRequest &r) const noexcept {
+    return r.hash();
+  }
+};
+
+/// hash<mk::collector::OpenRequestKey> allows using OpenRequestKey as the
+/// key of unordered containers, which is cheaper than using OpenRequest.
+template <> struct hash<mk::collector::OpenRequestKey> {
+  size_t operator()(const mk::collector::OpenRequestKey &k) const noexcept {
+    return k.hash();
+  }
+};
+
+}  // namespace std
 
 // The implementation can be included inline by defining this preprocessor
 // symbol. If you only care about API, you can stop reading here.
 #ifdef MKCOLLECTOR_INLINE_IMPL
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <sstream>
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
 #include <curl/curl.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <openssl/ssl.h>
+#endif
 
 #include "json.hpp"
 #include "mkbouncer.hpp"
@@ -331,12 +1651,218 @@ namespace mk {
 namespace collector {
 inline namespace MKCOLLECTOR_INLINE_NAMESPACE {
 
-// log_body is a helper to log about a body.
-static void log_body(const std::string &prefix, const std::string &body,
-                     std::vector<std::string> &logs) noexcept {
-  std::stringstream ss;
-  ss << prefix << " body: " << body;
-  logs.push_back(ss.str());
+// JsonArena is a monotonic arena for the JSON documents that we build
+// while submitting a measurement. Allocating is a pointer bump, freeing
+// is a no-op, and reset releases everything at once. Each Reporter has its
+// own arena, hence Reporters running on different threads do not contend
+// on the allocator. This class is not thread safe.
+class JsonArena {
+ public:
+  // JsonArena creates an arena retaining at most @p max_retained bytes
+  // across resets.
+  explicit JsonArena(size_t max_retained) noexcept
+      : max_retained_{max_retained} {}
+
+  // allocate returns @p size bytes aligned like operator new does.
+  // Throws std::bad_alloc on failure.
+  void *allocate(size_t size) {
+    size = (size + alignment_ - 1) & ~(alignment_ - 1);
+    if (chunks_.empty() || size > chunks_.back().size - used_) {
+      Chunk chunk;
+      chunk.size = (std::max)(next_size_, size);
+      chunk.data.reset(new char[chunk.size]);
+      chunks_.push_back(std::move(chunk));
+      next_size_ = chunks_.back().size * 2;
+      used_ = 0;
+    }
+    void *p = chunks_.back().data.get() + used_;
+    used_ += size;
+    return p;
+  }
+
+  // owns returns whether @p p was allocated by this arena.
+  bool owns(const void *p) const noexcept {
+    // Note: we scan from the last chunk, which is the largest one.
+    for (auto it = chunks_.rbegin(); it != chunks_.rend(); ++it) {
+      if (std::less_equal<const void *>{}(it->data.get(), p) &&
+          std::less<const void *>{}(p, it->data.get() + it->size)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // reset frees all the allocations. We keep a single chunk that is large
+  // enough for all the previous allocations, if not too large, so that the
+  // next document of similar size fits into a single chunk.
+  void reset() noexcept {
+    size_t total = 0;
+    for (auto &chunk : chunks_) {
+      total += chunk.size;
+    }
+    if (chunks_.size() > 1 || total > max_retained_) {
+      chunks_.clear();
+    }
+    size_t initial = initial_size_;  // avoid ODR-using initial_size_
+    next_size_ = (std::max)(initial, (std::min)(total, max_retained_));
+    used_ = 0;
+  }
+
+  // current is the arena used by JsonArenaAllocator on this thread.
+  static JsonArena *&current() noexcept {
+    static thread_local JsonArena *arena = nullptr;
+    return arena;
+  }
+
+ private:
+  // Chunk is a chunk of memory.
+  struct Chunk {
+    // data is the chunk memory.
+    std::unique_ptr<char[]> data;
+
+    // size is the chunk size.
+    size_t size = 0;
+  };
+
+  // alignment_ is the alignment of allocations.
+  static constexpr size_t alignment_ = alignof(std::max_align_t);
+
+  // initial_size_ is the size of the first chunk.
+  static constexpr size_t initial_size_ = 64 * 1024;
+
+  // chunks_ contains the chunks, the last one being the current one.
+  std::vector<Chunk> chunks_;
+
+  // used_ is the number of bytes used in the current chunk.
+  size_t used_ = 0;
+
+  // next_size_ is the minimum size of the next chunk.
+  size_t next_size_ = initial_size_;
+
+  // max_retained_ is the maximum number of bytes retained across resets.
+  size_t max_retained_;
+};
+
+// JsonArenaScope makes @p arena the current arena of this thread until it
+// goes out of scope, when it resets the arena. The documents allocated in
+// the arena must be destroyed before the scope ends. A null @p arena means
+// that we use the heap.
+class JsonArenaScope {
+ public:
+  // JsonArenaScope installs @p arena.
+  explicit JsonArenaScope(JsonArena *arena) noexcept
+      : arena_{arena}, previous_{JsonArena::current()} {
+    JsonArena::current() = arena_;
+  }
+
+  // JsonArenaScope is the deleted copy constructor.
+  JsonArenaScope(const JsonArenaScope &) noexcept = delete;
+
+  // JsonArenaScope is the deleted copy assignment.
+  JsonArenaScope &operator=(const JsonArenaScope &) noexcept = delete;
+
+  // ~JsonArenaScope resets the arena and restores the previous one.
+  ~JsonArenaScope() noexcept {
+    JsonArena::current() = previous_;
+    if (arena_ != nullptr) {
+      arena_->reset();
+    }
+  }
+
+ private:
+  // arena_ is the installed arena.
+  JsonArena *arena_;
+
+  // previous_ is the previously installed arena.
+  JsonArena *previous_;
+};
+
+// JsonArenaAllocator is an allocator using the current JsonArena of this
+// thread, if any, and the heap otherwise.
+template <typename Type> class JsonArenaAllocator {
+ public:
+  using value_type = Type;
+
+  JsonArenaAllocator() noexcept = default;
+
+  template <typename Other>
+  JsonArenaAllocator(const JsonArenaAllocator<Other> &) noexcept {}
+
+  Type *allocate(size_t count) {
+    JsonArena *arena = JsonArena::current();
+    size_t size = count * sizeof(Type);
+    return static_cast<Type *>((arena != nullptr) ? arena->allocate(size)
+                                                  : ::operator new(size));
+  }
+
+  void deallocate(Type *p, size_t) noexcept {
+    JsonArena *arena = JsonArena::current();
+    if (arena == nullptr || !arena->owns(p)) {
+      ::operator delete(p);
+    }
+  }
+
+  template <typename Other>
+  bool operator==(const JsonArenaAllocator<Other> &) const noexcept {
+    return true;
+  }
+
+  template <typename Other>
+  bool operator!=(const JsonArenaAllocator<Other> &) const noexcept {
+    return false;
+  }
+};
+
+// JsonDocument is the JSON document type that we use when submitting. Its
+// nodes live in the current JsonArena, if any. Note that strings longer
+// than the small string optimization threshold still use the heap.
+using JsonDocument =
+    nlohmann::basic_json<std::map, std::vector, std::string, bool,
+                         std::int64_t, std::uint64_t, double,
+                         JsonArenaAllocator>;
+
+// push_log_ appends @p message with the specified @p level to @p logs.
+static void push_log_(std::vector<LogLine> &logs, LogLevel level,
+                      std::string message) noexcept {
+  LogLine line;
+  line.level = level;
+  line.message = std::move(message);
+  logs.push_back(std::move(line));
+}
+
+// log_body is a helper to log about a body, if @p settings allow that.
+static void log_body(const char *prefix, const std::string &body,
+                     const Settings &settings,
+                     std::vector<LogLine> &logs) noexcept {
+  if (settings.log_level < LogLevel::debug) {
+    return;
+  }
+  static const char separator[] = " body: ";
+  static const char ellipsis[] = " [truncated]";
+  bool truncated = body.size() > settings.max_body_log_size;
+  size_t count = truncated ? settings.max_body_log_size : body.size();
+  std::string line;
+  line.reserve(strlen(prefix) + sizeof(separator) + count + sizeof(ellipsis));
+  line += prefix;
+  line += separator;
+  line.append(body, 0, count);
+  if (truncated) {
+    line += ellipsis;
+  }
+  push_log_(logs, LogLevel::debug, std::move(line));
+}
+
+// log_curl_response is a helper to move the logs of @p curl_response
+// into @p logs, if @p settings allow that.
+static void log_curl_response(curl::Response &curl_response,
+                              const Settings &settings,
+                              std::vector<LogLine> &logs) noexcept {
+  if (settings.log_level < LogLevel::debug) {
+    return;
+  }
+  for (auto &entry : curl_response.logs) {
+    push_log_(logs, LogLevel::debug, std::move(entry.line));
+  }
 }
 
 bool OpenRequest::operator!=(const OpenRequest &other) const noexcept {
@@ -346,12 +1872,62 @@ bool OpenRequest::operator!=(const OpenRequest &other) const noexcept {
   return false;
 }
 
+bool OpenRequest::operator==(const OpenRequest &other) const noexcept {
+  return !(*this != other);
+}
+
+size_t OpenRequest::hash() const noexcept {
+  // See <https://www.boost.org/doc/libs/1_70_0/doc/html/hash/reference.html>
+  // for an explanation of the algorithm to combine hashes.
+  size_t rv = 0;
+  std::hash<std::string> hasher;
+#define XX(name_) rv ^= hasher(name_) + 0x9e3779b9 + (rv << 6) + (rv >> 2);
+  MKCOLLECTOR_OPEN_REQUEST_ENUM(XX)
+#undef XX
+  return rv;
+}
+
+OpenRequestKey::OpenRequestKey() noexcept {
+  // All the empty keys share the same state, to make them cheap to create.
+  static const std::shared_ptr<const Shared> empty = OpenRequestKey{
+      OpenRequest{}}.shared_;
+  shared_ = empty;
+}
+
+OpenRequestKey::OpenRequestKey(OpenRequest request) noexcept {
+  std::shared_ptr<Shared> shared{new Shared};
+  std::swap(shared->request, request);
+  shared->hash = shared->request.hash();
+  shared_ = std::move(shared);
+}
+
+bool OpenRequestKey::operator!=(const OpenRequestKey &other) const noexcept {
+  return !(*this == other);
+}
+
+bool OpenRequestKey::operator==(const OpenRequestKey &other) const noexcept {
+  return shared_ == other.shared_ ||
+         (shared_->hash == other.shared_->hash &&
+          shared_->request == other.shared_->request);
+}
+
+const OpenRequest &OpenRequestKey::request() const noexcept {
+  return shared_->request;
+}
+
+size_t OpenRequestKey::hash() const noexcept {
+  return shared_->hash;
+}
+
+// open_request_from_measurement_with_json_ loads the OpenRequest fields
+// of @p measurement by parsing it into @p doc, a nlohmann/json document.
+template <typename Json>
 static LoadResult<OpenRequest> open_request_from_measurement_with_json_(
-    const std::string &measurement, const std::string &software_name,
-    const std::string &software_version, nlohmann::json &doc) noexcept {
+    MeasurementView measurement, const std::string &software_name,
+    const std::string &software_version, Json &doc) noexcept {
   LoadResult<OpenRequest> result;
   try {
-    doc = nlohmann::json::parse(measurement);
+    doc = Json::parse(measurement.data, measurement.data + measurement.size);
     doc.at("probe_asn").get_to(result.value.probe_asn);
     doc.at("probe_cc").get_to(result.value.probe_cc);
     doc.at("test_name").get_to(result.value.test_name);
@@ -369,13 +1945,202 @@ static LoadResult<OpenRequest> open_request_from_measurement_with_json_(
   return result;
 }
 
+// OpenRequestScanner is a nlohmann/json SAX handler that extracts the
+// top-level fields required by an OpenRequest without building a DOM. It
+// skips nested values and stops parsing as soon as all fields are known.
+class OpenRequestScanner {
+ public:
+#define MKCOLLECTOR_OPEN_REQUEST_SCANNED_ENUM(XX) \
+  XX(probe_asn)                                   \
+  XX(probe_cc)                                    \
+  XX(test_name)                                   \
+  XX(test_start_time)                             \
+  XX(test_version)
+
+  // Field is the state of a field we're interested into.
+  struct Field {
+    // type is the JSON type name of the field, as reported by the
+    // nlohmann/json type_name() method, or null if not found.
+    const char *type = nullptr;
+
+    // good indicates that the field was found and is a string.
+    bool good = false;
+  };
+
+  // reason is the parse error, if any.
+  std::string reason;
+
+  // toplevel_type is the type of the top-level JSON value.
+  const char *toplevel_type = "null";
+
+  // toplevel_is_object indicates whether the top-level value is an object.
+  bool toplevel_is_object = false;
+
+  // done indicates that we've seen all the fields we need.
+  bool done = false;
+
+#define XX(name_) Field name_##_field;
+  MKCOLLECTOR_OPEN_REQUEST_SCANNED_ENUM(XX)
+#undef XX
+
+  // value is where we store the fields we extract.
+  OpenRequest value;
+
+  // The following methods implement the nlohmann/json SAX interface.
+
+  bool null() { return scalar("null"); }
+  bool boolean(bool) { return scalar("boolean"); }
+  bool number_integer(nlohmann::json::number_integer_t) {
+    return scalar("number");
+  }
+  bool number_unsigned(nlohmann::json::number_unsigned_t) {
+    return scalar("number");
+  }
+  bool number_float(nlohmann::json::number_float_t, const std::string &) {
+    return scalar("number");
+  }
+  template <typename Binary> bool binary(Binary &) {
+    return scalar("binary");
+  }
+
+  bool string(std::string &val) {
+    if (depth_ == 1 && current_ != nullptr) {
+      current_field_->type = "string";
+      current_field_->good = true;
+      std::swap(*current_, val);
+      current_ = nullptr;
+      return !(done = all_found());
+    }
+    return scalar("string");
+  }
+
+  bool start_object(std::size_t) {
+    if (depth_ == 0) toplevel_is_object = true;
+    return start("object");
+  }
+  bool end_object() { return end(); }
+  bool start_array(std::size_t) { return start("array"); }
+  bool end_array() { return end(); }
+
+  bool key(std::string &val) {
+    current_ = nullptr;
+    if (depth_ == 1) {
+#define XX(name_)                    \
+  if (val == #name_) {               \
+    current_ = &value.name_;         \
+    current_field_ = &name_##_field; \
+    return true;                     \
+  }
+      MKCOLLECTOR_OPEN_REQUEST_SCANNED_ENUM(XX)
+#undef XX
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const std::exception &exc) {
+    reason = exc.what();
+    return false;
+  }
+
+ private:
+  bool scalar(const char *type) {
+    if (depth_ == 0) {
+      toplevel_type = type;
+    } else if (depth_ == 1 && current_ != nullptr) {
+      // Mark as found but with the wrong type, and forget the previous value
+      // in case of duplicate keys, like a DOM parser would do.
+      current_field_->type = type;
+      current_field_->good = false;
+      current_->clear();
+      current_ = nullptr;
+    }
+    return true;
+  }
+
+  bool start(const char *type) {
+    (void)scalar(type);
+    depth_ += 1;
+    return true;
+  }
+
+  bool end() {
+    depth_ -= 1;
+    return true;
+  }
+
+  bool all_found() const noexcept {
+#define XX(name_) if (!name_##_field.good) return false;
+    MKCOLLECTOR_OPEN_REQUEST_SCANNED_ENUM(XX)
+#undef XX
+    return true;
+  }
+
+  // current_ is where to store the value of the current top-level key
+  // if we are interested into such key, otherwise it is null.
+  std::string *current_ = nullptr;
+
+  // current_field_ is the state of the field for the current key.
+  Field *current_field_ = nullptr;
+
+  // depth_ is the current nesting depth.
+  size_t depth_ = 0;
+};
+
+// open_request_from_measurement_with_scanner_ is like
+// open_request_from_measurement_with_json_ except that it does not
+// build a DOM and does not validate the measurement after the point
+// where all the fields we need have been found. The failure reasons
+// are the ones emitted by nlohmann/json when using a DOM.
+static LoadResult<OpenRequest> open_request_from_measurement_with_scanner_(
+    const std::string &measurement, const std::string &software_name,
+    const std::string &software_version) noexcept {
+  LoadResult<OpenRequest> result;
+  OpenRequestScanner scanner;
+  try {
+    (void)nlohmann::json::sax_parse(measurement, &scanner);
+  } catch (const std::exception &exc) {
+    result.reason = exc.what();
+    return result;
+  }
+  if (!scanner.done) {
+    if (scanner.reason != "") {
+      std::swap(result.reason, scanner.reason);
+      return result;
+    }
+    if (!scanner.toplevel_is_object) {
+      result.reason = "[json.exception.type_error.304] cannot use at() with ";
+      result.reason += scanner.toplevel_type;
+      return result;
+    }
+#define XX(name_)                                                      \
+  if (scanner.name_##_field.type == nullptr) {                         \
+    result.reason = "[json.exception.out_of_range.403] key '" #name_   \
+                    "' not found";                                     \
+    return result;                                                     \
+  }                                                                    \
+  if (!scanner.name_##_field.good) {                                   \
+    result.reason = "[json.exception.type_error.302] type must be "    \
+                    "string, but is ";                                 \
+    result.reason += scanner.name_##_field.type;                       \
+    return result;                                                     \
+  }
+    MKCOLLECTOR_OPEN_REQUEST_SCANNED_ENUM(XX)
+#undef XX
+  }
+  std::swap(result.value, scanner.value);
+  // See open_request_from_measurement_with_json_ for why we're doing this.
+  result.value.software_name = software_name;
+  result.value.software_version = software_version;
+  result.good = true;
+  return result;
+}
+
 LoadResult<OpenRequest> open_request_from_measurement(
     const std::string &measurement, const std::string &software_name,
     const std::string &software_version) noexcept {
-  nlohmann::json doc;
-  return open_request_from_measurement_with_json_(
-      measurement, software_name, software_version, doc
-  );
+  return open_request_from_measurement_with_scanner_(
+      measurement, software_name, software_version);
 }
 
 // curl_reason_for_failure contains the cURL reason for failure.
@@ -394,13 +2159,152 @@ static std::string curl_reason_for_failure(
   return "collector: unknown libcurl error";
 }
 
-static OpenResponse open_with_client_(
-    curl::Client &client, const OpenRequest &request,
-    const Settings &settings) noexcept {
-  OpenResponse response;
-  curl::Request curl_request;
-  curl_request.ca_path = settings.ca_bundle_path;
-  curl_request.timeout = settings.timeout;
+bool is_retryable_failure(int64_t error, int64_t status_code) noexcept {
+  switch (error) {
+    case CURLE_OK:
+      break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_HTTP2:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    default:
+      return false;
+  }
+  return status_code == 429 || (status_code >= 500 && status_code <= 599);
+}
+
+// retry_delay_ returns how long to wait before the retry following the
+// attempt number @p attempt (starting from one) according to @p policy.
+static std::chrono::milliseconds retry_delay_(const RetryPolicy &policy,
+                                              unsigned attempt) noexcept {
+  double delay = (double)policy.initial_backoff;
+  double max_backoff = (double)policy.max_backoff;
+  for (unsigned i = 1; i < attempt && delay < max_backoff; ++i) {
+    delay *= policy.backoff_multiplier;
+  }
+  delay = std::max(0.0, std::min(delay, max_backoff));
+  double jitter = std::max(0.0, std::min(policy.jitter, 1.0));
+  if (jitter > 0.0) {
+    // The generator does not need to be strong. We just don't want all the
+    // clients to be synchronized, hence we seed it with the current time.
+    static thread_local std::minstd_rand generator{
+        (std::minstd_rand::result_type)
+            std::chrono::steady_clock::now().time_since_epoch().count()};
+    std::uniform_real_distribution<double> distribution{0.0, 1.0};
+    delay *= 1.0 - jitter * distribution(generator);
+  }
+  return std::chrono::milliseconds{(int64_t)delay};
+}
+
+// retry_ calls again @p func, which performs an API call returning a
+// Response, after the attempt number @p attempt returned @p response, until
+// the call succeeds, fails because of a non transient error, or we made all
+// the attempts allowed by the retry policy in @p settings. The number of
+// retries is added to @p retries. The returned response contains the logs
+// of all the attempts.
+template <typename Response, typename Func>
+static Response retry_(const Settings &settings, Func &&func,
+                       Response response, unsigned attempt,
+                       unsigned &retries) noexcept {
+  for (; !response.good && response.retryable &&
+         attempt < settings.retry_policy.max_attempts;
+       ++attempt) {
+    auto delay = retry_delay_(settings.retry_policy, attempt);
+    if (settings.log_level >= LogLevel::info) {
+      std::stringstream ss;
+      ss << "Retrying in " << delay.count() << " ms after: "
+         << response.reason;
+      push_log_(response.logs, LogLevel::info, ss.str());
+    }
+    std::this_thread::sleep_for(delay);
+    Response next = func();
+    response.logs.insert(response.logs.end(),
+                         std::make_move_iterator(next.logs.begin()),
+                         std::make_move_iterator(next.logs.end()));
+    std::swap(next.logs, response.logs);
+    next.bytes_sent += response.bytes_sent;
+    next.bytes_received += response.bytes_received;
+    response = std::move(next);
+    retries += 1;
+  }
+  return response;
+}
+
+// with_retries_ calls @p func and retries it, if needed, using retry_.
+template <typename Response, typename Func>
+static Response with_retries_(const Settings &settings, Func &&func,
+                              unsigned &retries) noexcept {
+  return retry_<Response>(settings, func, func(), 1, retries);
+}
+
+// circuit_breaker_response_ returns the Response of an API call that we
+// did not perform because the circuit breaker is open.
+template <typename Response>
+static Response circuit_breaker_response_(const Settings &settings) noexcept {
+  Response response;
+  response.reason = "collector: circuit breaker is open";
+  response.retryable = true;
+  if (settings.log_level >= LogLevel::warning) {
+    push_log_(response.logs, LogLevel::warning, response.reason);
+  }
+  return response;
+}
+
+// make_open_body_ returns the body of the request to open a report. This
+// function throws if @p request contains invalid UTF-8.
+static std::string make_open_body_(const OpenRequest &request) {
+  JsonDocument doc;
+  doc["data_format_version"] = "0.2.0";
+  doc["format"] = "json";
+  doc["input_hashes"] = JsonDocument::array();
+  doc["probe_asn"] = request.probe_asn;
+  doc["probe_cc"] = request.probe_cc;
+  doc["software_name"] = request.software_name;
+  doc["software_version"] = request.software_version;
+  doc["test_name"] = request.test_name;
+  doc["test_start_time"] = request.test_start_time;
+  doc["test_version"] = request.test_version;
+  return doc.dump();
+}
+
+// http2_version_ returns the HTTP/2 version option for @p url.
+static long http2_version_(const std::string &url) noexcept {
+  return (url.compare(0, 7, "http://") == 0)
+             ? (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE
+             : (long)CURL_HTTP_VERSION_2TLS;
+}
+
+// http2_enabled_ returns whether we should use HTTP/2 given @p settings.
+static bool http2_enabled_(const Settings &settings) noexcept {
+  if (!settings.http2) {
+    return false;
+  }
+  if (settings.base_url.compare(0, 7, "http://") != 0) {
+    return true;
+  }
+  // libcurl 7.88 fails with CURLE_HTTP2 when it starts a new stream over an
+  // existing cleartext HTTP/2 connection, so we stick to HTTP/1.1.
+  static const unsigned int version =
+      curl_version_info(CURLVERSION_NOW)->version_num;
+  return version < 0x075800 || version >= 0x080000;
+}
+
+template <typename Client>
+static OpenResponse open_with_client_(
+    Client &client, const OpenRequest &request,
+    const Settings &settings, int64_t timeout) noexcept {
+  OpenResponse response;
+  curl::Request curl_request;
+  curl_request.ca_path = settings.ca_bundle_path;
+  curl_request.timeout = timeout;
+  curl_request.enable_http2 = http2_enabled_(settings);
   curl_request.method = "POST";
   curl_request.headers.push_back("Content-Type: application/json");
   {
@@ -410,46 +2314,41 @@ static OpenResponse open_with_client_(
   }
   {
     std::string body;
-    nlohmann::json doc;
-    doc["data_format_version"] = "0.2.0";
-    doc["format"] = "json";
-    doc["input_hashes"] = nlohmann::json::array();
-    doc["probe_asn"] = request.probe_asn;
-    doc["probe_cc"] = request.probe_cc;
-    doc["software_name"] = request.software_name;
-    doc["software_version"] = request.software_version;
-    doc["test_name"] = request.test_name;
-    doc["test_start_time"] = request.test_start_time;
-    doc["test_version"] = request.test_version;
     try {
-      body = doc.dump();
+      body = make_open_body_(request);
     } catch (const std::exception &exc) {
-      response.logs.push_back(exc.what());
+      if (settings.log_level >= LogLevel::warning) {
+        push_log_(response.logs, LogLevel::warning, exc.what());
+      }
       response.reason = exc.what();
       return response;
     }
-    log_body("Request", body, response.logs);
+    log_body("Request", body, settings, response.logs);
     std::swap(body, curl_request.body);
   }
-  curl::Response curl_response = client.perform(curl_request);
-  for (auto &entry : curl_response.logs) {
-    response.logs.push_back(std::move(entry.line));
-  }
+  curl::Response curl_response = client.perform(std::move(curl_request));
+  response.bytes_sent = (uint64_t)curl_response.bytes_sent;
+  response.bytes_received = (uint64_t)curl_response.bytes_recv;
+  log_curl_response(curl_response, settings, response.logs);
   MKCOLLECTOR_HOOK(open_response_error, curl_response.error);
   MKCOLLECTOR_HOOK(open_response_status_code, curl_response.status_code);
   if (curl_response.error != 0 || curl_response.status_code != 200) {
     response.reason = curl_reason_for_failure(curl_response);
+    response.retryable = is_retryable_failure(
+        curl_response.error, curl_response.status_code);
     return response;
   }
   MKCOLLECTOR_HOOK(open_response_body, curl_response.body);
   {
-    log_body("Response", curl_response.body, response.logs);
-    nlohmann::json doc;
+    log_body("Response", curl_response.body, settings, response.logs);
+    JsonDocument doc;
     try {
-      doc = nlohmann::json::parse(curl_response.body);
+      doc = JsonDocument::parse(curl_response.body);
       doc.at("report_id").get_to(response.report_id);
     } catch (const std::exception &exc) {
-      response.logs.push_back(exc.what());
+      if (settings.log_level >= LogLevel::warning) {
+        push_log_(response.logs, LogLevel::warning, exc.what());
+      }
       response.reason = exc.what();
       return response;
     }
@@ -461,292 +2360,3568 @@ static OpenResponse open_with_client_(
 OpenResponse open(const OpenRequest &request,
                   const Settings &settings) noexcept {
   curl::Client client;
-  return open_with_client_(client, request, settings);
+  unsigned retries = 0;
+  return with_retries_<OpenResponse>(settings, [&]() {
+    return open_with_client_(client, request, settings, settings.timeout);
+  }, retries);
+}
+
+// validate_data_format_version_ throws if the already parsed measurement
+// @p content does not have a supported data_format_version.
+template <typename Json>
+static void validate_data_format_version_(const Json &content) {
+  // Implementation note: the following checks rely on the fact that
+  // nlohmann/json will throw if content is not an object, a field is
+  // missing, etc. That's also why we're using throw to signal failure.
+  if (content.at("data_format_version") != "0.2.0") {
+    throw std::runtime_error("Unsupported data_format_version");
+  }
+}
+
+// validate_update_content_ throws if the already parsed measurement
+// @p content cannot be submitted as part of the report @p report_id.
+template <typename Json>
+static void validate_update_content_(
+    const Json &content, const std::string &report_id) {
+  validate_data_format_version_(content);
+  if (content.at("report_id") != report_id) {
+    throw std::runtime_error("The report_id is inconsistent");
+  }
+}
+
+// json_skip_space_ returns the position of the first non whitespace
+// character of @p s starting from @p pos.
+static size_t json_skip_space_(const std::string &s, size_t pos) noexcept {
+  while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' ||
+                            s[pos] == '\n' || s[pos] == '\r')) {
+    ++pos;
+  }
+  return pos;
+}
+
+// json_skip_string_ returns the position right after the end of the JSON
+// string starting at @p pos, or std::string::npos on error.
+static size_t json_skip_string_(const std::string &s, size_t pos) noexcept {
+  if (pos >= s.size() || s[pos] != '"') {
+    return std::string::npos;
+  }
+  for (++pos; pos < s.size(); ++pos) {
+    if (s[pos] == '\\') {
+      ++pos;  // skip the escaped character
+    } else if (s[pos] == '"') {
+      return pos + 1;
+    }
+  }
+  return std::string::npos;
+}
+
+// json_skip_value_ returns the position right after the end of the JSON
+// value starting at @p pos, or std::string::npos on error. This function
+// only checks that strings, objects and arrays are properly terminated.
+static size_t json_skip_value_(const std::string &s, size_t pos) noexcept {
+  if (pos >= s.size()) {
+    return std::string::npos;
+  }
+  if (s[pos] == '"') {
+    return json_skip_string_(s, pos);
+  }
+  if (s[pos] == '{' || s[pos] == '[') {
+    size_t depth = 0;
+    while (pos < s.size()) {
+      if (s[pos] == '"') {
+        pos = json_skip_string_(s, pos);
+        continue;
+      }
+      if (s[pos] == '{' || s[pos] == '[') {
+        ++depth;
+      } else if (s[pos] == '}' || s[pos] == ']') {
+        if (--depth == 0) {
+          return pos + 1;
+        }
+      }
+      ++pos;
+    }
+    return std::string::npos;
+  }
+  // Here we have a number, true, false or null: stop at the first
+  // separator or at the first whitespace character.
+  size_t begin = pos;
+  while (pos < s.size() && s[pos] != ',' && s[pos] != '}' && s[pos] != ']' &&
+         json_skip_space_(s, pos) == pos) {
+    ++pos;
+  }
+  return (pos > begin) ? pos : std::string::npos;
+}
+
+// splice_report_id_ sets the top-level report_id of the serialized
+// measurement @p measurement to @p report_id, by replacing the bytes of the
+// existing value, or by inserting the field if missing. When there are
+// duplicate keys, we replace the last one, because that is the one that
+// a DOM parser would retain. Throws on failure.
+static void splice_report_id_(
+    std::string &measurement, const std::string &report_id) {
+  // Note: this throws if report_id is not valid UTF-8.
+  std::string value = nlohmann::json(report_id).dump();
+  size_t pos = json_skip_space_(measurement, 0);
+  if (pos >= measurement.size() || measurement[pos] != '{') {
+    throw std::runtime_error("splice: the measurement is not an object");
+  }
+  size_t open_brace = pos;
+  size_t value_begin = std::string::npos, value_end = std::string::npos;
+  pos = json_skip_space_(measurement, pos + 1);
+  if (pos < measurement.size() && measurement[pos] == '}') {
+    measurement.insert(open_brace + 1, R"("report_id":)" + value);
+    return;
+  }
+  for (;;) {
+    size_t key_begin = pos;
+    pos = json_skip_string_(measurement, pos);
+    if (pos == std::string::npos) {
+      throw std::runtime_error("splice: cannot parse key");
+    }
+    bool is_report_id =
+        measurement.compare(key_begin, pos - key_begin, R"("report_id")") == 0;
+    pos = json_skip_space_(measurement, pos);
+    if (pos >= measurement.size() || measurement[pos] != ':') {
+      throw std::runtime_error("splice: expected colon");
+    }
+    pos = json_skip_space_(measurement, pos + 1);
+    size_t begin = pos;
+    pos = json_skip_value_(measurement, pos);
+    if (pos == std::string::npos) {
+      throw std::runtime_error("splice: cannot parse value");
+    }
+    if (is_report_id) {
+      value_begin = begin;
+      value_end = pos;
+    }
+    pos = json_skip_space_(measurement, pos);
+    if (pos >= measurement.size()) {
+      throw std::runtime_error("splice: unterminated object");
+    }
+    if (measurement[pos] == '}') {
+      break;
+    }
+    if (measurement[pos] != ',') {
+      throw std::runtime_error("splice: expected comma");
+    }
+    pos = json_skip_space_(measurement, pos + 1);
+  }
+  if (value_begin == std::string::npos) {
+    measurement.insert(open_brace + 1, R"("report_id":)" + value + ",");
+    return;
+  }
+  measurement.replace(value_begin, value_end - value_begin, value);
+}
+
+// update_body_prefix_ is what precedes the measurement in an update body.
+static const char update_body_prefix_[] = R"({"content":)";
+
+// update_body_suffix_ is what follows the measurement in an update body.
+static const char update_body_suffix_[] = R"(,"format":"json"})";
+
+// update_body_overhead_ is the size of an update body minus the size of
+// the measurement it contains.
+static const size_t update_body_overhead_ =
+    sizeof(update_body_prefix_) - 1 + sizeof(update_body_suffix_) - 1;
+
+// make_update_body_ wraps the serialized measurement @p content into the
+// body expected by the collector. The result is byte-by-byte equal to what
+// we would obtain by serializing a {"format": "json", "content": ...} JSON
+// object, but we don't need to parse and serialize @p content again.
+static std::string make_update_body_(const std::string &content) noexcept {
+  std::string body;
+  body.reserve(update_body_overhead_ + content.size());
+  body += update_body_prefix_;
+  body += content;
+  body += update_body_suffix_;
+  return body;
+}
+
+// make_update_body_ is like the above overload except that it reuses the
+// memory of @p content, which is left in an unspecified state. We move
+// @p content in place, hence we reallocate at most once.
+static std::string make_update_body_(std::string &&content) noexcept {
+  content.reserve(update_body_overhead_ + content.size());
+  content.insert(0, update_body_prefix_);
+  content += update_body_suffix_;
+  return std::move(content);
+}
+
+// maybe_compress_update_body_ compresses @p body in place according to
+// @p settings and records the body sizes into @p response. We upload the
+// body as is when it is smaller than the threshold, when compression
+// fails, and when compression does not make it smaller.
+//
+// @return the Content-Encoding of the body, or nullptr if not compressed.
+static const char *maybe_compress_update_body_(
+    std::string &body, const Settings &settings,
+    UpdateResponse &response) noexcept {
+  response.body_bytes = response.upload_bytes = body.size();
+  const char *encoding = nullptr;
+  int window_bits = MAX_WBITS;
+  switch (settings.compression) {
+    case Compression::none:
+      return nullptr;
+    case Compression::gzip:
+      encoding = "gzip";
+      window_bits += 16;  // tells zlib to write a gzip header
+      break;
+    case Compression::deflate:
+      encoding = "deflate";
+      break;
+  }
+  if (encoding == nullptr || body.size() < settings.compression_threshold ||
+      body.size() > UINT_MAX) {
+    return nullptr;
+  }
+  z_stream stream{};
+  if (deflateInit2(&stream, settings.compression_level, Z_DEFLATED,
+                   window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (settings.log_level >= LogLevel::warning) {
+      push_log_(response.logs, LogLevel::warning,
+                "collector: cannot initialize zlib");
+    }
+    return nullptr;
+  }
+  std::string compressed;
+  compressed.resize(deflateBound(&stream, (uLong)body.size()));
+  stream.next_in = (Bytef *)body.data();
+  stream.avail_in = (uInt)body.size();
+  stream.next_out = (Bytef *)&compressed[0];
+  stream.avail_out = (uInt)compressed.size();
+  int ret = deflate(&stream, Z_FINISH);
+  compressed.resize(stream.total_out);
+  (void)deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    if (settings.log_level >= LogLevel::warning) {
+      push_log_(response.logs, LogLevel::warning,
+                "collector: cannot compress the update body");
+    }
+    return nullptr;
+  }
+  if (compressed.size() >= body.size()) {
+    return nullptr;
+  }
+  if (settings.log_level >= LogLevel::debug) {
+    std::stringstream ss;
+    ss << "Compressed body: " << body.size() << " => " << compressed.size()
+       << " bytes using " << encoding;
+    push_log_(response.logs, LogLevel::debug, ss.str());
+  }
+  std::swap(body, compressed);
+  response.upload_bytes = body.size();
+  return encoding;
+}
+
+// make_update_request_ returns the request submitting the already prepared
+// @p body to the report identified by @p report_id, using @p timeout rather
+// than the timeout of @p settings. We log and maybe compress @p body, and
+// we account for that into @p response.
+static curl::Request make_update_request_(
+    const std::string &report_id, std::string body, const Settings &settings,
+    int64_t timeout, UpdateResponse &response) noexcept {
+  curl::Request curl_request;
+  curl_request.ca_path = settings.ca_bundle_path;
+  curl_request.timeout = timeout;
+  curl_request.enable_http2 = http2_enabled_(settings);
+  curl_request.method = "POST";
+  curl_request.headers.push_back("Content-Type: application/json");
+  {
+    std::string url = settings.base_url;
+    url += "/report/";
+    url += report_id;
+    std::swap(url, curl_request.url);
+  }
+  log_body("Request", body, settings, response.logs);
+  const char *encoding = maybe_compress_update_body_(body, settings, response);
+  if (encoding != nullptr) {
+    curl_request.headers.push_back(std::string{"Content-Encoding: "} +
+                                   encoding);
+  }
+  std::swap(body, curl_request.body);
+  return curl_request;
+}
+
+// finish_update_ completes @p response using @p curl_response, which is
+// the response of the collector to an update.
+static void finish_update_(curl::Response &curl_response,
+                           const Settings &settings,
+                           UpdateResponse &response) noexcept {
+  response.bytes_sent = (uint64_t)curl_response.bytes_sent;
+  response.bytes_received = (uint64_t)curl_response.bytes_recv;
+  log_curl_response(curl_response, settings, response.logs);
+  MKCOLLECTOR_HOOK(update_response_error, curl_response.error);
+  MKCOLLECTOR_HOOK(update_response_status_code, curl_response.status_code);
+  if (curl_response.error != 0 || curl_response.status_code != 200) {
+    response.reason = curl_reason_for_failure(curl_response);
+    response.retryable = is_retryable_failure(
+        curl_response.error, curl_response.status_code);
+    return;
+  }
+  log_body("Response", curl_response.body, settings, response.logs);
+  response.good = true;
+}
+
+// update_with_client_and_body_ submits the already prepared @p body to
+// the report identified by @p report_id, using @p timeout rather than the
+// timeout of @p settings.
+template <typename Client>
+static UpdateResponse update_with_client_and_body_(
+    Client &client, const std::string &report_id, std::string body,
+    const Settings &settings, int64_t timeout) noexcept {
+  UpdateResponse response;
+  curl::Request curl_request = make_update_request_(
+      report_id, std::move(body), settings, timeout, response);
+  curl::Response curl_response = client.perform(std::move(curl_request));
+  finish_update_(curl_response, settings, response);
+  return response;
+}
+
+// validate_update_request_ returns whether @p request can be submitted.
+// Otherwise, it fills @p response. We parse request.content only to
+// validate it. Since it is valid JSON we can then embed the original
+// bytes into the body without serializing it again.
+static bool validate_update_request_(const UpdateRequest &request,
+                                     const Settings &settings,
+                                     UpdateResponse &response) noexcept {
+  try {
+    validate_update_content_(
+        JsonDocument::parse(request.content), request.report_id);
+  } catch (const std::exception &exc) {
+    if (settings.log_level >= LogLevel::warning) {
+      push_log_(response.logs, LogLevel::warning, exc.what());
+    }
+    response.reason = exc.what();
+    return false;
+  }
+  return true;
 }
 
 static UpdateResponse update_with_client_(
     curl::Client &client, const UpdateRequest &request,
     const Settings &settings) noexcept {
   UpdateResponse response;
+  if (!validate_update_request_(request, settings, response)) {
+    return response;
+  }
+  return update_with_client_and_body_(
+      client, request.report_id, make_update_body_(request.content),
+      settings, settings.timeout);
+}
+
+UpdateResponse update(const UpdateRequest &request,
+                      const Settings &settings) noexcept {
+  curl::Client client;
+  unsigned retries = 0;
+  return with_retries_<UpdateResponse>(settings, [&]() {
+    return update_with_client_(client, request, settings);
+  }, retries);
+}
+
+UpdateResponse update(UpdateRequest &&request,
+                      const Settings &settings) noexcept {
+  UpdateResponse response;
+  if (!validate_update_request_(request, settings, response)) {
+    return response;
+  }
+  std::string body = make_update_body_(std::move(request.content));
+  curl::Client client;
+  unsigned retries = 0;
+  return with_retries_<UpdateResponse>(settings, [&]() {
+    // We only need to keep the body around if we may retry.
+    return update_with_client_and_body_(
+        client, request.report_id,
+        (settings.retry_policy.max_attempts > 1) ? body : std::move(body),
+        settings, settings.timeout);
+  }, retries);
+}
+
+template <typename Client>
+static CloseResponse close_with_client_(
+    Client &client, const CloseRequest &request,
+    const Settings &settings, int64_t timeout) noexcept {
+  CloseResponse response;
   curl::Request curl_request;
-  curl_request.ca_path = settings.ca_bundle_path;
-  curl_request.timeout = settings.timeout;
   curl_request.method = "POST";
-  curl_request.headers.push_back("Content-Type: application/json");
+  curl_request.ca_path = settings.ca_bundle_path;
+  curl_request.timeout = timeout;
+  curl_request.enable_http2 = http2_enabled_(settings);
   {
     std::string url = settings.base_url;
     url += "/report/";
     url += request.report_id;
+    url += "/close";
     std::swap(url, curl_request.url);
   }
-  {
-    std::string body;
-    nlohmann::json doc;
-    doc["format"] = "json";
-    try {
-      auto content = nlohmann::json::parse(request.content);
-      // Implementation note: the following checks rely on the fact that
-      // we're inside a try...catch block and nlohmann/json will throw if
-      // content is not an object, a field is missing, etc. That's also
-      // why we're using throw to leave this block rather than return.
-      if (content.at("data_format_version") != "0.2.0") {
-        throw std::runtime_error("Unsupported data_format_version");
-      }
-      if (content.at("report_id") != request.report_id) {
-        throw std::runtime_error("The report_id is inconsistent");
-      }
-      doc["content"] = std::move(content);
-      body = doc.dump();
-    } catch (const std::exception &exc) {
-      response.logs.push_back(exc.what());
-      response.reason = exc.what();
-      return response;
+  curl::Response curl_response = client.perform(std::move(curl_request));
+  response.bytes_sent = (uint64_t)curl_response.bytes_sent;
+  response.bytes_received = (uint64_t)curl_response.bytes_recv;
+  log_curl_response(curl_response, settings, response.logs);
+  if (curl_response.error != 0 || curl_response.status_code != 200) {
+    response.reason = curl_reason_for_failure(curl_response);
+    response.retryable = is_retryable_failure(
+        curl_response.error, curl_response.status_code);
+    return response;
+  }
+  log_body("Response", curl_response.body, settings, response.logs);
+  response.good = true;
+  return response;
+}
+
+CloseResponse close(const CloseRequest &request,
+                    const Settings &settings) noexcept {
+  curl::Client client;
+  unsigned retries = 0;
+  return with_retries_<CloseResponse>(settings, [&]() {
+    return close_with_client_(client, request, settings, settings.timeout);
+  }, retries);
+}
+
+std::vector<CollectorProbe> probe_collectors(
+    const std::vector<std::string> &base_urls,
+    const Settings &settings) noexcept {
+  std::vector<CollectorProbe> probes(base_urls.size());
+  std::vector<CURL *> handles(base_urls.size());
+  curl_write_callback discard = [](char *, size_t size, size_t nmemb,
+                                   void *) -> size_t {
+    return size * nmemb;  // we only care about the timing
+  };
+  CURLM *multi = curl_multi_init();
+  for (size_t i = 0; i < base_urls.size(); ++i) {
+    probes[i].base_url = base_urls[i];
+    std::string url = base_urls[i] + "/";
+    CURL *easy = curl_easy_init();
+    if (multi == nullptr || easy == nullptr ||
+        curl_easy_setopt(easy, CURLOPT_URL, url.c_str()) != CURLE_OK ||
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard) != CURLE_OK ||
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT,
+                         (long)settings.timeout) != CURLE_OK ||
+        (settings.ca_bundle_path != "" &&
+         curl_easy_setopt(easy, CURLOPT_CAINFO,
+                          settings.ca_bundle_path.c_str()) != CURLE_OK) ||
+        curl_multi_add_handle(multi, easy) != CURLM_OK) {
+      probes[i].reason = "collector: cannot initialize the probe";
+      curl_easy_cleanup(easy);
+      continue;
+    }
+    handles[i] = easy;
+  }
+  int running = 0;
+  do {
+    (void)curl_multi_perform(multi, &running);
+    if (running > 0) {
+      (void)curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+    }
+  } while (running > 0);
+  CURLMsg *msg = nullptr;
+  int left = 0;
+  while ((msg = curl_multi_info_read(multi, &left)) != nullptr) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    auto it = std::find(handles.begin(), handles.end(), msg->easy_handle);
+    if (it == handles.end()) {
+      continue;  // should not happen
+    }
+    CollectorProbe &probe = probes[(size_t)(it - handles.begin())];
+    curl::Response curl_response;
+    curl_response.error = (int64_t)msg->data.result;
+    long status_code = 0;
+    (void)curl_easy_getinfo(
+        msg->easy_handle, CURLINFO_RESPONSE_CODE, &status_code);
+    curl_response.status_code = (int64_t)status_code;
+    if (curl_response.error != 0 || status_code <= 0 || status_code >= 500) {
+      probe.reason = curl_reason_for_failure(curl_response);
+      continue;
+    }
+    (void)curl_easy_getinfo(
+        msg->easy_handle, CURLINFO_CONNECT_TIME, &probe.connect_time);
+    (void)curl_easy_getinfo(
+        msg->easy_handle, CURLINFO_STARTTRANSFER_TIME, &probe.ttfb);
+    probe.good = true;
+  }
+  for (CURL *easy : handles) {
+    if (easy != nullptr) {
+      (void)curl_multi_remove_handle(multi, easy);
+      curl_easy_cleanup(easy);
+    }
+  }
+  curl_multi_cleanup(multi);
+  std::stable_sort(probes.begin(), probes.end(),
+                   [](const CollectorProbe &a, const CollectorProbe &b) {
+                     if (a.good != b.good) {
+                       return a.good;
+                     }
+                     return a.good && a.ttfb < b.ttfb;
+                   });
+  return probes;
+}
+
+// replace_file_ replaces the file at @p path with @p data, such that other
+// processes reading it see either the old or the new content. To this end,
+// we write a temporary file with a unique name, readable only by its owner,
+// in the same directory, and we rename it. Returns whether we succeeded.
+static bool replace_file_(const std::string &path,
+                          const std::string &data) noexcept {
+#ifndef _WIN32
+  std::string temporary = path + ".XXXXXX";
+  int fd = ::mkstemp(&temporary[0]);
+  if (fd == -1) {
+    return false;
+  }
+  bool good = true;
+  for (size_t off = 0; good && off < data.size();) {
+    ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    good = n > 0;
+    off += good ? (size_t)n : 0;
+  }
+  good = ::close(fd) == 0 && good;
+  good = good && ::rename(temporary.c_str(), path.c_str()) == 0;
+#else
+  std::string temporary = path + "." + std::to_string(_getpid()) + ".tmp";
+  bool good = false;
+  {
+    std::ofstream file{temporary, std::ios::binary};
+    file << data;
+    file.close();
+    good = file.good();
+  }
+  if (good) {
+    (void)remove(path.c_str());  // rename does not replace on Windows
+    good = rename(temporary.c_str(), path.c_str()) == 0;
+  }
+#endif
+  if (!good) {
+    (void)remove(temporary.c_str());
+  }
+  return good;
+}
+
+// TlsSessionCache saves the TLS sessions negotiated by the UpdateEngine into
+// a file, keyed by collector host, and resumes them when the UpdateEngine,
+// possibly of another process, connects again to the same host. Since
+// libcurl does not expose its own sessions, we hook into the OpenSSL context
+// that it creates for each connection.
+class TlsSessionCache : public std::enable_shared_from_this<TlsSessionCache> {
+ public:
+  // Connection is the state of a connection that may use the cache.
+  struct Connection {
+    // cache is the cache to use.
+    std::shared_ptr<TlsSessionCache> cache;
+
+    // host is the collector host and port.
+    std::string host;
+
+    // handshake indicates that we performed a TLS handshake.
+    bool handshake = false;
+
+    // resumed indicates that the handshake resumed a session.
+    bool resumed = false;
+
+    // stored indicates that we already stored a session of this connection.
+    bool stored = false;
+
+#ifndef _WIN32
+    // next is the new session callback installed by libcurl, if any.
+    int (*next)(SSL *, SSL_SESSION *) = nullptr;
+#endif
+  };
+
+  // for_path returns the cache for @p path, creating it if needed.
+  static std::shared_ptr<TlsSessionCache> for_path(
+      const std::string &path) noexcept {
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<TlsSessionCache>> caches;
+    std::unique_lock<std::mutex> _{mutex};
+    auto cache = caches[path].lock();
+    if (!cache) {
+      cache = std::make_shared<TlsSessionCache>();
+      cache->path_ = path;
+      cache->sessions_ = read_(path);
+      caches[path] = cache;
+    }
+    return cache;
+  }
+
+  // flush merges the sessions negotiated since the last flush, if any,
+  // with the ones that other processes may have saved meanwhile, and saves
+  // them. We call it after the handshakes, since it performs I/O.
+  void flush() noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (!dirty_) {
+      return;
+    }
+    for (auto &pair : read_(path_)) {
+      Session &session = sessions_[pair.first];
+      if (pair.second.expires > session.expires) {
+        session = std::move(pair.second);
+      }
+    }
+    save_();
+    dirty_ = false;
+  }
+
+  // ~TlsSessionCache saves the sessions not saved yet.
+  ~TlsSessionCache() noexcept { flush(); }
+
+  // usable returns whether libcurl uses the OpenSSL we use, such that we
+  // can safely hook into the contexts it creates, i.e., whether its TLS
+  // backend is OpenSSL and it runs with the same version of OpenSSL.
+  static bool usable() noexcept {
+#ifdef _WIN32
+    return false;
+#else
+    static const bool usable = []() {
+      // libcurl formats the version of the OpenSSL it runs with like
+      // "OpenSSL/3.0.17" or, before 3.0, like "OpenSSL/1.1.1w", where the
+      // letter is the patch, which we ignore.
+      const char *theirs = curl_version_info(CURLVERSION_NOW)->ssl_version;
+      unsigned major = 0, minor = 0, fix = 0;
+      if (theirs == nullptr ||
+          sscanf(theirs, "OpenSSL/%u.%u.%u", &major, &minor, &fix) != 3) {
+        return false;
+      }
+      // See the OPENSSL_VERSION_NUMBER(3) man page for the format.
+      unsigned long ours = OpenSSL_version_num();
+      unsigned long our_fix =
+          ((ours >> 28) >= 3) ? (ours >> 4) & 0xff : (ours >> 12) & 0xff;
+      if (major != (ours >> 28) || minor != ((ours >> 20) & 0xff) ||
+          fix != our_fix) {
+        return false;
+      }
+      CURL *easy = curl_easy_init();
+      bool good = easy != nullptr && openssl_backend_(easy);
+      curl_easy_cleanup(easy);
+      return good;
+    }();
+    return usable;
+#endif
+  }
+
+  // attach configures @p easy, which will connect to @p url, to resume and
+  // save sessions using this cache, and initializes @p connection, which
+  // must outlive the transfer, with the state of the connection that libcurl
+  // may create for the transfer. Returns false if we cannot use the cache,
+  // e.g., because libcurl does not use our OpenSSL.
+  bool attach(CURL *easy, const std::string &url,
+              std::shared_ptr<Connection> &connection) noexcept {
+#ifdef _WIN32
+    (void)easy, (void)url, (void)connection;
+    return false;
+#else
+    if (!usable()) {
+      return false;
+    }
+    connection = std::make_shared<Connection>();
+    connection->cache = shared_from_this();
+    {
+      auto begin = url.find("://");
+      begin = (begin != std::string::npos) ? begin + 3 : 0;
+      connection->host = url.substr(begin, url.find('/', begin) - begin);
+    }
+    return curl_easy_setopt(easy, CURLOPT_SSL_CTX_FUNCTION,
+                            ssl_ctx_cb_) == CURLE_OK &&
+           curl_easy_setopt(easy, CURLOPT_SSL_CTX_DATA, &connection) ==
+               CURLE_OK;
+#endif
+  }
+
+ private:
+  // Session is a cached session.
+  struct Session {
+    // data is the DER encoded session.
+    std::string data;
+
+    // expires is the UNIX time in seconds when the session expires.
+    int64_t expires = 0;
+  };
+
+  // now_ returns the current UNIX time in seconds.
+  static int64_t now_() noexcept {
+    return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // lookup_ returns into @p data the session for @p host, if any.
+  bool lookup_(const std::string &host, std::string &data) noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    auto it = sessions_.find(host);
+    if (it == sessions_.end() || it->second.expires <= now_()) {
+      return false;
+    }
+    data = it->second.data;
+    return true;
+  }
+
+  // store_ stores the session @p data, which expires at @p expires, as the
+  // session for @p host. Since we are in the middle of a handshake, we do
+  // not save it until the next flush.
+  void store_(const std::string &host, std::string data,
+              int64_t expires) noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    Session &session = sessions_[host];
+    std::swap(session.data, data);
+    session.expires = expires;
+    dirty_ = true;
+  }
+
+  // read_ returns the sessions saved at @p path. On error, there are none.
+  static std::map<std::string, Session> read_(
+      const std::string &path) noexcept {
+    std::map<std::string, Session> sessions;
+    std::ifstream file{path};
+    if (!file.good()) {
+      return sessions;
+    }
+    try {
+      nlohmann::json doc;
+      file >> doc;
+      for (auto &entry : doc.at("sessions").items()) {
+        Session session;
+        std::string hex = entry.value().at("data");
+        if (!decode_hex_(hex, session.data)) {
+          throw std::runtime_error("invalid session data");
+        }
+        entry.value().at("expires").get_to(session.expires);
+        sessions[entry.key()] = std::move(session);
+      }
+    } catch (const std::exception &) {
+      sessions.clear();
+    }
+    return sessions;
+  }
+
+  // save_ saves the unexpired sessions to disk. We ignore errors, since the
+  // worst that could happen is that we will perform a full handshake again.
+  void save_() const noexcept {
+    std::string data;
+    try {
+      nlohmann::json doc;
+      doc["sessions"] = nlohmann::json::object();
+      int64_t now = now_();
+      for (auto &pair : sessions_) {
+        if (pair.second.expires <= now) {
+          continue;
+        }
+        doc["sessions"][pair.first]["data"] = encode_hex_(pair.second.data);
+        doc["sessions"][pair.first]["expires"] = pair.second.expires;
+      }
+      data = doc.dump();
+    } catch (const std::exception &) {
+      return;
+    }
+    // The sessions contain secrets, which replace_file_ does not expose
+    // to other users while writing them.
+    (void)replace_file_(path_, data);
+  }
+
+  // encode_hex_ returns the hexadecimal encoding of @p data.
+  static std::string encode_hex_(const std::string &data) noexcept {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(data.size() * 2);
+    for (char c : data) {
+      out += digits[((uint8_t)c) >> 4];
+      out += digits[((uint8_t)c) & 0x0f];
+    }
+    return out;
+  }
+
+  // decode_hex_ decodes the hexadecimal @p hex into @p data.
+  static bool decode_hex_(const std::string &hex, std::string &data) noexcept {
+    // value returns the value of the digit @p c, or -1.
+    auto value = [](char c) -> int {
+      return (c >= '0' && c <= '9')   ? c - '0'
+             : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                      : -1;
+    };
+    if (hex.size() % 2 != 0) {
+      return false;
+    }
+    data.clear();
+    data.reserve(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2) {
+      int high = value(hex[i]), low = value(hex[i + 1]);
+      if (high < 0 || low < 0) {
+        return false;
+      }
+      data += (char)(uint8_t)(high << 4 | low);
+    }
+    return true;
+  }
+
+#ifndef _WIN32
+  // openssl_backend_ returns whether the TLS backend of @p easy is OpenSSL,
+  // i.e., whether it passes us OpenSSL contexts.
+  static bool openssl_backend_(CURL *easy) noexcept {
+    struct curl_tlssessioninfo *info = nullptr;
+    return curl_easy_getinfo(easy, CURLINFO_TLS_SSL_PTR, &info) ==
+               CURLE_OK &&
+           info != nullptr && info->backend == CURLSSLBACKEND_OPENSSL;
+  }
+
+  // index_ returns the index of the Connection in the OpenSSL contexts.
+  static int index_() noexcept {
+    static const int index = SSL_CTX_get_ex_new_index(
+        0, nullptr, nullptr, nullptr,
+        [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *) {
+          delete static_cast<std::shared_ptr<Connection> *>(ptr);
+        });
+    return index;
+  }
+
+  // connection_ returns the Connection of @p ssl, if any.
+  static Connection *connection_(const SSL *ssl) noexcept {
+    auto ptr = static_cast<std::shared_ptr<Connection> *>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), index_()));
+    return (ptr != nullptr) ? ptr->get() : nullptr;
+  }
+
+  // ssl_ctx_cb_ is called by libcurl when it creates the OpenSSL context
+  // of a new connection, before creating the connection itself.
+  static CURLcode ssl_ctx_cb_(CURL *easy, void *ssl_ctx,
+                              void *userptr) noexcept {
+    if (!openssl_backend_(easy)) {
+      return CURLE_OK;  // not a context we can touch
+    }
+    SSL_CTX *ctx = static_cast<SSL_CTX *>(ssl_ctx);
+    auto connection = new std::shared_ptr<Connection>(
+        *static_cast<std::shared_ptr<Connection> *>(userptr));
+    if (index_() < 0 || SSL_CTX_set_ex_data(ctx, index_(), connection) != 1) {
+      delete connection;
+      return CURLE_OK;  // we can still connect without the cache
+    }
+    (*connection)->next = SSL_CTX_sess_get_new_cb(ctx);
+    SSL_CTX_set_session_cache_mode(
+        ctx, SSL_CTX_get_session_cache_mode(ctx) | SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb_);
+    SSL_CTX_set_info_callback(ctx, info_cb_);
+    return CURLE_OK;
+  }
+
+  // info_cb_ is called by OpenSSL when the state of @p ssl changes. When
+  // the handshake starts, we offer the cached session, unless libcurl has
+  // already offered a session. When it is done, we check the outcome.
+  static void info_cb_(const SSL *ssl, int where, int) noexcept {
+    Connection *connection = connection_(ssl);
+    if (connection == nullptr) {
+      return;
+    }
+    if ((where & SSL_CB_HANDSHAKE_START) != 0 &&
+        SSL_get_session(ssl) == nullptr) {
+      std::string data;
+      if (!connection->cache->lookup_(connection->host, data)) {
+        return;
+      }
+      auto ptr = (const unsigned char *)data.data();
+      SSL_SESSION *session = d2i_SSL_SESSION(nullptr, &ptr, (long)data.size());
+      if (session != nullptr) {
+        (void)SSL_set_session((SSL *)ssl, session);
+        SSL_SESSION_free(session);
+      }
+    }
+    if ((where & SSL_CB_HANDSHAKE_DONE) != 0 && !connection->handshake) {
+      connection->handshake = true;
+      connection->resumed = SSL_session_reused((SSL *)ssl) == 1;
+    }
+  }
+
+  // new_session_cb_ is called by OpenSSL when the server gives us the new
+  // @p session, which we store, before passing it to libcurl.
+  static int new_session_cb_(SSL *ssl, SSL_SESSION *session) noexcept {
+    Connection *connection = connection_(ssl);
+    if (connection == nullptr) {
+      return 0;
+    }
+    // With TLS 1.3, servers may send many sessions per connection. One is
+    // enough, and avoids saving the cache again.
+    int size = 0;
+    if (!connection->stored && SSL_SESSION_is_resumable(session) == 1 &&
+        (size = i2d_SSL_SESSION(session, nullptr)) > 0) {
+      std::string data((size_t)size, '\0');
+      auto ptr = (unsigned char *)&data[0];
+      if (i2d_SSL_SESSION(session, &ptr) == size) {
+        connection->cache->store_(
+            connection->host, std::move(data),
+            (int64_t)SSL_SESSION_get_time(session) +
+                (int64_t)SSL_SESSION_get_timeout(session));
+        connection->stored = true;
+      }
+    }
+    return (connection->next != nullptr) ? connection->next(ssl, session) : 0;
+  }
+#endif
+
+  // mutex_ protects the fields below.
+  std::mutex mutex_;
+
+  // path_ is the cache path.
+  std::string path_;
+
+  // sessions_ maps collector hosts to their sessions.
+  std::map<std::string, Session> sessions_;
+
+  // dirty_ indicates that sessions_ contains sessions not saved yet.
+  bool dirty_ = false;
+};
+
+class UpdateEngine::Impl {
+ public:
+  // Transfer is a request in flight.
+  struct Transfer {
+    // easy is the cURL easy handle.
+    CURL *easy = nullptr;
+
+    // headers contains the request headers.
+    curl_slist *headers = nullptr;
+
+    // request is the request.
+    curl::Request request;
+
+    // response is the response we're building.
+    curl::Response response;
+
+    // callback is the callback to call when done.
+    PerformCallback callback;
+
+    // verbose indicates that we log the request and the response.
+    bool verbose = false;
+
+    // tls is the state of the connection created for this request, if any,
+    // when using a TLS session cache.
+    std::shared_ptr<TlsSessionCache::Connection> tls;
+
+    // ~Transfer releases the cURL resources.
+    ~Transfer() noexcept {
+      curl_easy_cleanup(easy);
+      curl_slist_free_all(headers);
+    }
+  };
+
+  // multi is the cURL multi handle.
+  CURLM *multi = nullptr;
+
+  // max_in_flight is the maximum number of requests in flight.
+  size_t max_in_flight = 1;
+
+  // transfers contains the requests in flight.
+  std::vector<std::unique_ptr<Transfer>> transfers;
+
+  // write_cb is the cURL callback for reading the response body.
+  static size_t write_cb(
+      char *ptr, size_t size, size_t nmemb, void *userdata) noexcept {
+    // Note: size is guaranteed to be 1 by cURL.
+    auto transfer = static_cast<Transfer *>(userdata);
+    transfer->response.body.append(ptr, size * nmemb);
+    return size * nmemb;
+  }
+
+  // log adds @p line to the logs of the response of @p transfer.
+  static void log(Transfer &transfer, std::string line) noexcept {
+    curl::Log entry;
+    std::swap(entry.line, line);
+    transfer.response.logs.push_back(std::move(entry));
+  }
+};
+
+
+UpdateEngine::UpdateEngine(size_t max_in_flight) noexcept : impl_{new Impl} {
+  impl_->multi = curl_multi_init();
+  if (impl_->multi != nullptr) {
+    (void)curl_multi_setopt(impl_->multi, CURLMOPT_PIPELINING,
+                            CURLPIPE_MULTIPLEX);
+  }
+  impl_->max_in_flight = (max_in_flight > 0) ? max_in_flight : 1;
+}
+
+void UpdateEngine::update(const UpdateRequest &request,
+                          const Settings &settings,
+                          UpdateCallback callback) noexcept {
+  UpdateResponse response;
+  if (!validate_update_request_(request, settings, response)) {
+    callback(std::move(response));
+    return;
+  }
+  update_with_body_(request.report_id, make_update_body_(request.content),
+                    settings, settings.timeout, std::move(callback));
+}
+
+void UpdateEngine::update(UpdateRequest &&request, const Settings &settings,
+                          UpdateCallback callback) noexcept {
+  UpdateResponse response;
+  if (!validate_update_request_(request, settings, response)) {
+    callback(std::move(response));
+    return;
+  }
+  update_with_body_(request.report_id,
+                    make_update_body_(std::move(request.content)), settings,
+                    settings.timeout, std::move(callback));
+}
+
+void UpdateEngine::update_with_body_(const std::string &report_id,
+                                     std::string body,
+                                     const Settings &settings,
+                                     int64_t timeout,
+                                     UpdateCallback callback) noexcept {
+  UpdateResponse response;
+  curl::Request request = make_update_request_(
+      report_id, std::move(body), settings, timeout, response);
+  // We only need the logging settings, so we don't copy the strings.
+  Settings logging;
+  logging.log_level = settings.log_level;
+  logging.max_body_log_size = settings.max_body_log_size;
+  perform_(std::move(request), settings,
+           [response, logging, callback](curl::Response curl_response,
+                                         bool tls_handshake,
+                                         bool tls_resumed) mutable {
+             response.tls_handshake = tls_handshake;
+             response.tls_resumed = tls_resumed;
+             finish_update_(curl_response, logging, response);
+             callback(std::move(response));
+           });
+}
+
+void UpdateEngine::perform_(curl::Request request, const Settings &settings,
+                            PerformCallback callback) noexcept {
+  while (impl_->transfers.size() >= impl_->max_in_flight) {
+    run_once(1000);
+  }
+  std::unique_ptr<Impl::Transfer> transfer{new Impl::Transfer};
+  transfer->callback = std::move(callback);
+  transfer->verbose = settings.log_level >= LogLevel::debug;
+  std::swap(transfer->request, request);
+  const curl::Request &req = transfer->request;
+  bool good = true;
+  for (auto &header : req.headers) {
+    curl_slist *headers = curl_slist_append(transfer->headers, header.c_str());
+    if (headers == nullptr) {
+      good = false;
+      break;
+    }
+    transfer->headers = headers;
+  }
+  transfer->easy = curl_easy_init();
+  if (transfer->easy != nullptr && settings.tls_session_cache_path != "") {
+    // Note: we can connect without the cache, hence we ignore errors.
+    (void)TlsSessionCache::for_path(settings.tls_session_cache_path)
+        ->attach(transfer->easy, req.url, transfer->tls);
+  }
+  CURLMcode mcode = CURLM_OK;
+  if (!good || transfer->easy == nullptr ||
+      curl_easy_setopt(transfer->easy, CURLOPT_URL,
+                       req.url.c_str()) != CURLE_OK ||
+      curl_easy_setopt(transfer->easy, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+      curl_easy_setopt(transfer->easy, CURLOPT_HTTPHEADER,
+                       transfer->headers) != CURLE_OK ||
+      (req.method == "POST" &&
+       (curl_easy_setopt(transfer->easy, CURLOPT_POST, 1L) != CURLE_OK ||
+        curl_easy_setopt(transfer->easy, CURLOPT_POSTFIELDS,
+                         req.body.data()) != CURLE_OK ||
+        curl_easy_setopt(transfer->easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)req.body.size()) != CURLE_OK)) ||
+      (req.method != "POST" && req.method != "GET" &&
+       curl_easy_setopt(transfer->easy, CURLOPT_CUSTOMREQUEST,
+                        req.method.c_str()) != CURLE_OK) ||
+      curl_easy_setopt(transfer->easy, CURLOPT_WRITEFUNCTION,
+                       Impl::write_cb) != CURLE_OK ||
+      curl_easy_setopt(transfer->easy, CURLOPT_WRITEDATA,
+                       transfer.get()) != CURLE_OK ||
+      curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE,
+                       transfer.get()) != CURLE_OK ||
+      curl_easy_setopt(transfer->easy, CURLOPT_TIMEOUT,
+                       (long)req.timeout) != CURLE_OK ||
+      (req.enable_http2 &&
+       (curl_easy_setopt(transfer->easy, CURLOPT_HTTP_VERSION,
+                         http2_version_(req.url)) != CURLE_OK ||
+        // Wait for the connection to be established, rather than opening
+        // a new connection, so that we can multiplex over it.
+        curl_easy_setopt(transfer->easy, CURLOPT_PIPEWAIT, 1L) !=
+            CURLE_OK)) ||
+      (req.ca_path != "" &&
+       curl_easy_setopt(transfer->easy, CURLOPT_CAINFO,
+                        req.ca_path.c_str()) != CURLE_OK) ||
+      (mcode = curl_multi_add_handle(impl_->multi, transfer->easy)) !=
+          CURLM_OK) {
+    if (transfer->verbose) {
+      std::string line = "cannot initialize the request";
+      if (mcode != CURLM_OK) {
+        line += ": ";
+        line += curl_multi_strerror(mcode);
+      }
+      Impl::log(*transfer, std::move(line));
+    }
+    transfer->response.error = CURLE_FAILED_INIT;
+    transfer->callback(std::move(transfer->response), false, false);
+    return;
+  }
+  if (transfer->verbose) {
+    Impl::log(*transfer, "> " + req.method + " " + req.url);
+  }
+  impl_->transfers.push_back(std::move(transfer));
+}
+
+size_t UpdateEngine::in_flight() const noexcept {
+  return impl_->transfers.size();
+}
+
+void UpdateEngine::run_once(int timeout_msec) noexcept {
+  if (impl_->transfers.empty()) {
+    return;
+  }
+  int running = 0;
+  (void)curl_multi_perform(impl_->multi, &running);
+  if (running > 0) {
+    (void)curl_multi_wait(impl_->multi, nullptr, 0, timeout_msec, nullptr);
+    (void)curl_multi_perform(impl_->multi, &running);
+  }
+  CURLMsg *msg = nullptr;
+  int left = 0;
+  while ((msg = curl_multi_info_read(impl_->multi, &left)) != nullptr) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    char *ptr = nullptr;
+    (void)curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ptr);
+    // Note: msg does not survive removing the handle.
+    CURLcode result = msg->data.result;
+    (void)curl_multi_remove_handle(impl_->multi, msg->easy_handle);
+    std::unique_ptr<Impl::Transfer> transfer;
+    for (auto it = impl_->transfers.begin(); it != impl_->transfers.end();
+         ++it) {
+      if ((char *)it->get() == ptr) {
+        transfer = std::move(*it);
+        impl_->transfers.erase(it);
+        break;
+      }
+    }
+    if (!transfer) {
+      continue;  // should not happen
+    }
+    auto &response = transfer->response;
+    response.error = (int64_t)result;
+    {
+      long status_code = 0;
+      (void)curl_easy_getinfo(
+          transfer->easy, CURLINFO_RESPONSE_CODE, &status_code);
+      response.status_code = (int64_t)status_code;
+    }
+    {
+      long request_size = 0, header_size = 0;
+      curl_off_t upload_size = 0, download_size = 0;
+      (void)curl_easy_getinfo(
+          transfer->easy, CURLINFO_REQUEST_SIZE, &request_size);
+      (void)curl_easy_getinfo(
+          transfer->easy, CURLINFO_SIZE_UPLOAD_T, &upload_size);
+      (void)curl_easy_getinfo(
+          transfer->easy, CURLINFO_HEADER_SIZE, &header_size);
+      (void)curl_easy_getinfo(
+          transfer->easy, CURLINFO_SIZE_DOWNLOAD_T, &download_size);
+      response.bytes_sent = (double)request_size + (double)upload_size;
+      response.bytes_recv = (double)header_size + (double)download_size;
+    }
+    if (transfer->verbose) {
+      std::stringstream ss;
+      ss << "< " << response.status_code;
+      Impl::log(*transfer, ss.str());
+    }
+    bool tls_handshake = transfer->tls && transfer->tls->handshake;
+    bool tls_resumed = transfer->tls && transfer->tls->resumed;
+    if (transfer->tls) {
+      // Now that the handshake is over, we can save the new sessions.
+      transfer->tls->cache->flush();
+    }
+    transfer->callback(std::move(response), tls_handshake, tls_resumed);
+  }
+}
+
+void UpdateEngine::wait() noexcept {
+  while (!impl_->transfers.empty()) {
+    run_once(1000);
+  }
+}
+
+UpdateEngine::~UpdateEngine() noexcept {
+  wait();
+  curl_multi_cleanup(impl_->multi);
+}
+
+// ReporterClient performs the requests of a Reporter. When the settings
+// have a TLS session cache, it sends them using an UpdateEngine, whose
+// connections resume the cached sessions, and it counts the handshakes.
+// Otherwise, it sends them using a mkcurl client. Like curl::Client, it
+// reuses the connections of previous requests.
+class ReporterClient {
+ public:
+  // ReporterClient uses @p engine, creating it with @p max_in_flight when
+  // needed, if @p settings has a TLS session cache, otherwise @p client. We
+  // count the handshakes into @p stats. The referenced objects must outlive
+  // this object.
+  ReporterClient(curl::Client &client, std::unique_ptr<UpdateEngine> &engine,
+                 size_t max_in_flight, const Settings &settings,
+                 Reporter::Stats &stats) noexcept
+      : client_{client}, engine_{engine}, max_in_flight_{max_in_flight},
+        settings_{settings}, stats_{stats} {}
+
+  // perform performs @p request, like curl::Client::perform. With the
+  // engine, we also complete the other requests that complete meanwhile.
+  curl::Response perform(curl::Request request) noexcept {
+    if (settings_.tls_session_cache_path == "") {
+      return client_.perform(request);
+    }
+    if (!engine_) {
+      engine_.reset(new UpdateEngine{max_in_flight_});
+    }
+    curl::Response response;
+    bool done = false;
+    engine_->perform_(std::move(request), settings_,
+                      [this, &response, &done](curl::Response resp,
+                                               bool tls_handshake,
+                                               bool tls_resumed) {
+                        if (tls_handshake) {
+                          (tls_resumed ? stats_.tls_handshake_resumed
+                                       : stats_.tls_handshake_full) += 1;
+                        }
+                        response = std::move(resp);
+                        done = true;
+                      });
+    while (!done) {
+      engine_->run_once(1000);
+    }
+    return response;
+  }
+
+ private:
+  // client_ is the client we use without the engine.
+  curl::Client &client_;
+
+  // engine_ is the engine we use with a TLS session cache.
+  std::unique_ptr<UpdateEngine> &engine_;
+
+  // max_in_flight_ is the maximum number of requests in flight of engine_.
+  size_t max_in_flight_;
+
+  // settings_ contains the settings.
+  const Settings &settings_;
+
+  // stats_ contains the stats.
+  Reporter::Stats &stats_;
+};
+
+// Spool records are made of a fixed size header followed by the payload. All
+// the header fields are little endian 32 bit unsigned integers:
+//
+//     magic | payload length | payload crc32 | flags
+//
+// where flags is zero for pending records and spool_flag_removed_ for the
+// records that have been removed.
+static const uint32_t spool_magic_ = 0x4c4f4f53;  // "SPOL"
+static const uint32_t spool_flag_removed_ = 1;
+static const size_t spool_header_size_ = 16;
+static const size_t spool_flags_offset_ = 12;
+
+// spool_encode_u32_ writes @p value at @p p in little endian.
+static void spool_encode_u32_(unsigned char *p, uint32_t value) noexcept {
+  for (size_t i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+// spool_decode_u32_ reads a little endian value from @p p.
+static uint32_t spool_decode_u32_(const unsigned char *p) noexcept {
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    value |= (uint32_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+// spool_crc32_ computes the crc32 of @p size bytes at @p data.
+static uint32_t spool_crc32_(const unsigned char *data, size_t size) noexcept {
+  uLong crc = crc32(0L, Z_NULL, 0);
+  while (size > 0) {
+    uInt count = (size > UINT_MAX) ? UINT_MAX : (uInt)size;
+    crc = crc32(crc, data, count);
+    data += count;
+    size -= count;
+  }
+  return (uint32_t)crc;
+}
+
+class Spool::Impl {
+ public:
+  // Segment is a segment of the spool.
+  struct Segment {
+    // fd is the open file descriptor.
+    int fd = -1;
+
+    // size is the size of the valid part of the segment.
+    uint64_t size = 0;
+
+    // pending contains the offsets of the entries not removed yet.
+    std::set<uint64_t> pending;
+  };
+
+  // directory is the spool directory.
+  std::string directory;
+
+  // lock_fd is the descriptor of the lock file.
+  int lock_fd = -1;
+
+  // max_segment_size is the size after which we start a new segment.
+  uint64_t max_segment_size = (uint64_t)64 << 20;
+
+  // sync_interval is the number of writes after which we sync.
+  size_t sync_interval = 64;
+
+  // unsynced is the number of writes since the last sync.
+  size_t unsynced = 0;
+
+  // segments contains the segments, indexed by sequence number.
+  std::map<uint64_t, Segment> segments;
+
+  // count is the number of entries not removed yet.
+  size_t count = 0;
+
+#ifndef _WIN32
+  // path returns the path of the segment with sequence number @p seq.
+  std::string path(uint64_t seq) const noexcept {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.spool", (unsigned long long)seq);
+    return directory + "/" + name;
+  }
+
+  // error returns a reason of failure including errno.
+  static std::string error(const char *what) noexcept {
+    std::string reason = "spool: ";
+    reason += what;
+    reason += ": ";
+    reason += strerror(errno);
+    return reason;
+  }
+
+  // sync_directory makes the directory entries changes durable.
+  bool sync_directory(std::string &reason) noexcept {
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+      reason = error("cannot open directory");
+      return false;
+    }
+    bool good = ::fsync(fd) == 0;
+    if (!good) {
+      reason = error("cannot sync directory");
+    }
+    ::close(fd);
+    return good;
+  }
+
+  // load loads the segment @p seg, truncating it at the first invalid
+  // record if @p last is true. Otherwise, it ignores the invalid records.
+  bool load(Segment &seg, bool last, std::string &reason) noexcept {
+    struct stat st{};
+    if (::fstat(seg.fd, &st) != 0) {
+      reason = error("cannot stat segment");
+      return false;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    if (size <= 0) {
+      return true;
+    }
+    void *base = ::mmap(nullptr, (size_t)size, PROT_READ, MAP_SHARED,
+                        seg.fd, 0);
+    if (base == MAP_FAILED) {
+      reason = error("cannot map segment");
+      return false;
+    }
+    const unsigned char *p = (const unsigned char *)base;
+    uint64_t off = 0;
+    while (size - off >= spool_header_size_) {
+      uint32_t magic = spool_decode_u32_(p + off);
+      uint64_t length = spool_decode_u32_(p + off + 4);
+      if (magic != spool_magic_ ||
+          size - off - spool_header_size_ < length ||
+          spool_decode_u32_(p + off + 8) !=
+              spool_crc32_(p + off + spool_header_size_, (size_t)length)) {
+        break;
+      }
+      uint32_t flags = spool_decode_u32_(p + off + spool_flags_offset_);
+      if ((flags & spool_flag_removed_) == 0) {
+        seg.pending.insert(off);
+      }
+      off += spool_header_size_ + length;
+    }
+    (void)::munmap(base, (size_t)size);
+    seg.size = off;
+    if (off != size && last && ::ftruncate(seg.fd, (off_t)off) != 0) {
+      reason = error("cannot truncate segment");
+      return false;
+    }
+    return true;
+  }
+
+  // create creates a new segment at the end of the spool.
+  Segment *create(std::string &reason) noexcept {
+    uint64_t seq = segments.empty() ? 1 : segments.rbegin()->first + 1;
+    int fd = ::open(path(seq).c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0600);
+    if (fd == -1) {
+      reason = error("cannot create segment");
+      return nullptr;
+    }
+    if (!sync_directory(reason)) {
+      ::close(fd);
+      (void)::unlink(path(seq).c_str());
+      return nullptr;
+    }
+    Segment &seg = segments[seq];
+    seg.fd = fd;
+    return &seg;
+  }
+
+  // maybe_drop removes the segment @p it if it is fully consumed and it
+  // is not the segment we're appending to.
+  void maybe_drop(std::map<uint64_t, Segment>::iterator it) noexcept {
+    if (!it->second.pending.empty() || std::next(it) == segments.end()) {
+      return;
+    }
+    ::close(it->second.fd);
+    (void)::unlink(path(it->first).c_str());
+    segments.erase(it);
+  }
+
+  // wrote accounts for a write and syncs if needed.
+  bool wrote(std::string &reason) noexcept {
+    if (++unsynced < sync_interval) {
+      return true;
+    }
+    return sync(reason);
+  }
+
+  // sync flushes all the segments to stable storage.
+  bool sync(std::string &reason) noexcept {
+    if (unsynced <= 0) {
+      return true;
+    }
+    for (auto &entry : segments) {
+      if (::fsync(entry.second.fd) != 0) {
+        reason = error("cannot sync segment");
+        return false;
+      }
+    }
+    unsynced = 0;
+    return true;
+  }
+#endif
+};
+
+Spool::Spool(std::string directory) noexcept : impl_{new Impl} {
+  std::swap(impl_->directory, directory);
+}
+
+void Spool::set_max_segment_size(uint64_t size) noexcept {
+  impl_->max_segment_size = size;
+}
+
+void Spool::set_sync_interval(size_t count) noexcept {
+  impl_->sync_interval = (count > 0) ? count : 1;
+}
+
+size_t Spool::size() const noexcept { return impl_->count; }
+
+#ifdef _WIN32
+
+bool Spool::open(std::string &reason) noexcept {
+  reason = "spool: not supported on this platform";
+  return false;
+}
+
+bool Spool::append(const std::string &, std::string &reason) noexcept {
+  reason = "spool: not supported on this platform";
+  return false;
+}
+
+bool Spool::read(size_t, std::vector<SpoolEntry> &,
+                 std::string &reason) noexcept {
+  reason = "spool: not supported on this platform";
+  return false;
+}
+
+bool Spool::remove(const SpoolEntry &, std::string &reason) noexcept {
+  reason = "spool: not supported on this platform";
+  return false;
+}
+
+bool Spool::sync(std::string &) noexcept { return true; }
+
+Spool::~Spool() noexcept {}
+
+#else
+
+bool Spool::open(std::string &reason) noexcept {
+  if (impl_->lock_fd != -1) {
+    reason = "spool: already open";
+    return false;
+  }
+  if (::mkdir(impl_->directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    reason = Impl::error("cannot create directory");
+    return false;
+  }
+  // The lock prevents two processes from using the same spool.
+  std::string lock_path = impl_->directory + "/lock";
+  int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1) {
+    reason = Impl::error("cannot open lock file");
+    return false;
+  }
+  if (::flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    reason = Impl::error("cannot lock");
+    ::close(lock_fd);
+    return false;
+  }
+  impl_->lock_fd = lock_fd;
+  std::vector<uint64_t> seqs;
+  {
+    DIR *dir = ::opendir(impl_->directory.c_str());
+    if (dir == nullptr) {
+      reason = Impl::error("cannot read directory");
+      return false;
+    }
+    struct dirent *de = nullptr;
+    while ((de = ::readdir(dir)) != nullptr) {
+      unsigned long long seq = 0;
+      int used = 0;
+      if (strlen(de->d_name) == 26 &&
+          sscanf(de->d_name, "%20llu.spool%n", &seq, &used) == 1 &&
+          used == 26) {
+        seqs.push_back((uint64_t)seq);
+      }
+    }
+    ::closedir(dir);
+  }
+  std::sort(seqs.begin(), seqs.end());
+  for (size_t i = 0; i < seqs.size(); ++i) {
+    int fd = ::open(impl_->path(seqs[i]).c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+      reason = Impl::error("cannot open segment");
+      return false;
+    }
+    Impl::Segment &seg = impl_->segments[seqs[i]];
+    seg.fd = fd;
+    if (!impl_->load(seg, i + 1 == seqs.size(), reason)) {
+      return false;
+    }
+    impl_->count += seg.pending.size();
+  }
+  for (auto it = impl_->segments.begin(); it != impl_->segments.end();) {
+    impl_->maybe_drop(it++);
+  }
+  return true;
+}
+
+bool Spool::append(const std::string &measurement,
+                   std::string &reason) noexcept {
+  if (impl_->lock_fd == -1) {
+    reason = "spool: not open";
+    return false;
+  }
+  if (measurement.size() > UINT32_MAX) {
+    reason = "spool: measurement too large";
+    return false;
+  }
+  uint64_t record_size = spool_header_size_ + measurement.size();
+  Impl::Segment *seg = nullptr;
+  if (!impl_->segments.empty()) {
+    seg = &impl_->segments.rbegin()->second;
+    if (seg->size > 0 && seg->size + record_size > impl_->max_segment_size) {
+      seg = nullptr;
+    }
+  }
+  if (seg == nullptr) {
+    if ((seg = impl_->create(reason)) == nullptr) {
+      return false;
+    }
+    // The segment we were appending to may be already consumed, in which
+    // case we could not remove it until now.
+    if (impl_->segments.size() > 1) {
+      impl_->maybe_drop(std::prev(impl_->segments.end(), 2));
+    }
+  }
+  unsigned char header[spool_header_size_];
+  spool_encode_u32_(header, spool_magic_);
+  spool_encode_u32_(header + 4, (uint32_t)measurement.size());
+  spool_encode_u32_(header + 8, spool_crc32_(
+      (const unsigned char *)measurement.data(), measurement.size()));
+  spool_encode_u32_(header + spool_flags_offset_, 0);
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void *)measurement.data();
+  iov[1].iov_len = measurement.size();
+  uint64_t written = 0;
+  while (written < record_size) {
+    // Rather than handling partial writes of the header, which are very
+    // unlikely, we just retry writing the whole record.
+    ssize_t n = ::pwritev(seg->fd, iov, 2, (off_t)seg->size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 || (uint64_t)n != record_size) {
+      reason = Impl::error("cannot write record");
+      // Make sure that the next append overwrites the partial record.
+      (void)::ftruncate(seg->fd, (off_t)seg->size);
+      return false;
+    }
+    written = (uint64_t)n;
+  }
+  seg->pending.insert(seg->size);
+  seg->size += record_size;
+  impl_->count += 1;
+  return impl_->wrote(reason);
+}
+
+bool Spool::read(size_t max_count, std::vector<SpoolEntry> &entries,
+                 std::string &reason) noexcept {
+  for (auto &entry : impl_->segments) {
+    Impl::Segment &seg = entry.second;
+    if (max_count <= 0) {
+      break;
+    }
+    if (seg.pending.empty()) {
+      continue;
+    }
+    void *base = ::mmap(nullptr, (size_t)seg.size, PROT_READ, MAP_SHARED,
+                        seg.fd, 0);
+    if (base == MAP_FAILED) {
+      reason = Impl::error("cannot map segment");
+      return false;
+    }
+    const unsigned char *p = (const unsigned char *)base;
+    for (auto off : seg.pending) {
+      if (max_count <= 0) {
+        break;
+      }
+      SpoolEntry e;
+      e.segment = entry.first;
+      e.offset = off;
+      e.measurement.assign((const char *)p + off + spool_header_size_,
+                           spool_decode_u32_(p + off + 4));
+      entries.push_back(std::move(e));
+      max_count -= 1;
+    }
+    (void)::munmap(base, (size_t)seg.size);
+  }
+  return true;
+}
+
+bool Spool::remove(const SpoolEntry &entry, std::string &reason) noexcept {
+  auto it = impl_->segments.find(entry.segment);
+  if (it == impl_->segments.end() ||
+      it->second.pending.count(entry.offset) <= 0) {
+    reason = "spool: no such entry";
+    return false;
+  }
+  unsigned char flags[4];
+  spool_encode_u32_(flags, spool_flag_removed_);
+  if (::pwrite(it->second.fd, flags, sizeof(flags),
+               (off_t)(entry.offset + spool_flags_offset_)) !=
+      (ssize_t)sizeof(flags)) {
+    reason = Impl::error("cannot remove record");
+    return false;
+  }
+  it->second.pending.erase(entry.offset);
+  impl_->count -= 1;
+  impl_->maybe_drop(it);
+  return impl_->wrote(reason);
+}
+
+bool Spool::sync(std::string &reason) noexcept {
+  return impl_->sync(reason);
+}
+
+Spool::~Spool() noexcept {
+  std::string reason;
+  (void)impl_->sync(reason);
+  for (auto &entry : impl_->segments) {
+    ::close(entry.second.fd);
+  }
+  if (impl_->lock_fd != -1) {
+    ::close(impl_->lock_fd);  // also releases the lock
+  }
+}
+
+#endif  // _WIN32
+
+// latency_sub_buckets_ is the number of buckets per power of two.
+constexpr uint64_t latency_sub_buckets_ = 16;
+
+size_t LatencyHistogram::bucket_index_(uint64_t usec) noexcept {
+  if (usec < latency_sub_buckets_) {
+    return (size_t)usec;
+  }
+  // Find the shift such that usec >> shift is in [16, 32), so the four bits
+  // following the most significant one select the sub-bucket.
+  unsigned shift = 0;
+  while ((usec >> shift) >= 2 * latency_sub_buckets_) {
+    ++shift;
+  }
+  return (size_t)((shift + 1) * latency_sub_buckets_ +
+                  ((usec >> shift) - latency_sub_buckets_));
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound_(size_t index) noexcept {
+  if (index < latency_sub_buckets_) {
+    return (uint64_t)index;
+  }
+  uint64_t shift = index / latency_sub_buckets_ - 1;
+  uint64_t base = latency_sub_buckets_ + index % latency_sub_buckets_;
+  return ((base + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t usec) noexcept {
+  if (usec < 0) {
+    usec = 0;  // the clock went backwards?
+  }
+  size_t index = bucket_index_((uint64_t)usec);
+  if (index >= buckets_.size()) {
+    buckets_.resize(index + 1);
+  }
+  buckets_[index] += 1;
+  if (count_ == 0 || usec < min_) {
+    min_ = usec;
+  }
+  if (count_ == 0 || usec > max_) {
+    max_ = usec;
+  }
+  count_ += 1;
+  sum_ += (double)usec;
+}
+
+void LatencyHistogram::record_since(
+    std::chrono::steady_clock::time_point start) noexcept {
+  record((int64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count());
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) noexcept {
+  if (other.count_ == 0) {
+    return;
+  }
+  if (other.buckets_.size() > buckets_.size()) {
+    buckets_.resize(other.buckets_.size());
+  }
+  for (size_t i = 0; i < other.buckets_.size(); ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  if (count_ == 0 || other.min_ < min_) {
+    min_ = other.min_;
+  }
+  if (count_ == 0 || other.max_ > max_) {
+    max_ = other.max_;
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+}
+
+uint64_t LatencyHistogram::count() const noexcept { return count_; }
+
+int64_t LatencyHistogram::min() const noexcept { return min_; }
+
+int64_t LatencyHistogram::max() const noexcept { return max_; }
+
+double LatencyHistogram::mean() const noexcept {
+  return (count_ > 0) ? sum_ / (double)count_ : 0.0;
+}
+
+int64_t LatencyHistogram::percentile(double p) const noexcept {
+  if (count_ == 0) {
+    return 0;
+  }
+  if (p <= 0.0) {
+    return min_;
+  }
+  double rank = p / 100.0 * (double)count_;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    seen += buckets_[i];
+    if (seen > 0 && (double)seen >= rank) {
+      // The bucket upper bound may exceed the largest recorded value.
+      return std::max(std::min((int64_t)bucket_upper_bound_(i), max_), min_);
+    }
+  }
+  return max_;
+}
+
+std::string LatencyHistogram::to_json() const noexcept {
+  nlohmann::json doc;
+  doc["count"] = count_;
+  doc["min"] = min_;
+  doc["max"] = max_;
+  doc["mean"] = mean();
+  doc["p50"] = percentile(50.0);
+  doc["p90"] = percentile(90.0);
+  doc["p99"] = percentile(99.0);
+  doc["p999"] = percentile(99.9);
+  doc["buckets"] = nlohmann::json::array();
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    if (buckets_[i] > 0) {
+      doc["buckets"].push_back({bucket_upper_bound_(i), buckets_[i]});
+    }
+  }
+  return doc.dump();
+}
+
+// CollectorCache caches the collectors discovered using the bouncer. It is
+// persisted as a JSON file, which we replace atomically when it changes,
+// and it is shared by all the Reporters using the same file.
+class CollectorCache {
+ public:
+  // for_path returns the cache for @p path, creating it if needed.
+  static std::shared_ptr<CollectorCache> for_path(
+      const std::string &path) noexcept {
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<CollectorCache>> caches;
+    std::unique_lock<std::mutex> _{mutex};
+    auto cache = caches[path].lock();
+    if (!cache) {
+      cache = std::make_shared<CollectorCache>();
+      cache->path_ = path;
+      caches[path] = cache;
+    }
+    return cache;
+  }
+
+  // lookup returns the cached collectors, if any, into @p collectors.
+  bool lookup(std::vector<std::string> &collectors) noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    // Another process may have refreshed the file since we read it.
+    if (collectors_.empty() || expired_()) {
+      load_();
+    }
+    if (collectors_.empty() || expired_()) {
+      return false;
+    }
+    collectors = collectors_;
+    return true;
+  }
+
+  // store replaces the cached collectors with @p collectors, which are
+  // valid for @p ttl seconds.
+  void store(std::vector<std::string> collectors, int64_t ttl) noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    std::swap(collectors_, collectors);
+    expires_ = now_() + ttl;
+    failures_.clear();
+    save_();
+  }
+
+  // record records whether a call to @p collector @p failed because of a
+  // transient error and removes @p collector from the cache once it has
+  // failed @p max_failures times in a row. Returns true if we removed it.
+  bool record(const std::string &collector, bool failed,
+              unsigned max_failures) noexcept {
+    std::unique_lock<std::mutex> _{mutex_};
+    if (!failed) {
+      failures_.erase(collector);
+      return false;
+    }
+    if (++failures_[collector] < max_failures) {
+      return false;
+    }
+    failures_.erase(collector);
+    auto it = std::find(collectors_.begin(), collectors_.end(), collector);
+    if (it != collectors_.end()) {
+      collectors_.erase(it);
+      save_();
+    }
+    return true;
+  }
+
+ private:
+  // now_ returns the current UNIX time in seconds.
+  static int64_t now_() noexcept {
+    return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // expired_ returns whether the cache has expired.
+  bool expired_() const noexcept { return now_() >= expires_; }
+
+  // load_ loads the cache from disk. On error, the cache is empty.
+  void load_() noexcept {
+    collectors_.clear();
+    expires_ = 0;
+    std::ifstream file{path_};
+    if (!file.good()) {
+      return;
+    }
+    try {
+      nlohmann::json doc;
+      file >> doc;
+      doc.at("collectors").get_to(collectors_);
+      doc.at("expires").get_to(expires_);
+    } catch (const std::exception &) {
+      collectors_.clear();
+      expires_ = 0;
+    }
+  }
+
+  // save_ saves the cache to disk. We ignore errors, since the worst that
+  // could happen is that we will query the bouncer again.
+  void save_() const noexcept {
+    std::string data;
+    try {
+      nlohmann::json doc;
+      doc["collectors"] = collectors_;
+      doc["expires"] = expires_;
+      data = doc.dump();
+    } catch (const std::exception &) {
+      return;
+    }
+    (void)replace_file_(path_, data);
+  }
+
+  // mutex_ protects the fields below.
+  std::mutex mutex_;
+
+  // path_ is the cache path.
+  std::string path_;
+
+  // collectors_ contains the cached collectors.
+  std::vector<std::string> collectors_;
+
+  // expires_ is the UNIX time in seconds when the cache expires.
+  int64_t expires_ = 0;
+
+  // failures_ maps collectors to their consecutive failures.
+  std::map<std::string, unsigned> failures_;
+};
+
+// BackgroundCloser closes reports in a background thread on behalf of the
+// Reporters with background close enabled. See Reporter::flush.
+class BackgroundCloser {
+ public:
+  // shared returns the closer shared by all Reporters.
+  static BackgroundCloser &shared() noexcept {
+    static BackgroundCloser closer;
+    return closer;
+  }
+
+  // close queues the closing of @p report_id, using @p settings, unless the
+  // queue is full. We give up if we cannot close it before @p deadline.
+  // Returns false if the queue is full.
+  bool close(const Settings &settings, std::string report_id,
+             std::chrono::steady_clock::time_point deadline) noexcept {
+    Job job;
+    job.settings = settings;
+    job.report_id = std::move(report_id);
+    job.deadline = deadline;
+    return queue_(std::move(job));
+  }
+
+  // close_preopened is like close, except that we first wait for
+  // @p preopener to open the report to close.
+  bool close_preopened(
+      const Settings &settings, std::shared_ptr<ReportPreopener> preopener,
+      std::chrono::steady_clock::time_point deadline) noexcept {
+    Job job;
+    job.settings = settings;
+    job.preopener = std::move(preopener);
+    job.deadline = deadline;
+    return queue_(std::move(job));
+  }
+
+  // close_prepared is like close, except that we first wait for
+  // @p preparer to prepare the report to close.
+  bool close_prepared(
+      std::shared_ptr<ReportPreparer> preparer,
+      std::chrono::steady_clock::time_point deadline) noexcept {
+    Job job;
+    job.preparer = std::move(preparer);
+    job.deadline = deadline;
+    return queue_(std::move(job));
+  }
+
+  // flush waits until we processed all the jobs or until @p deadline.
+  bool flush(std::chrono::steady_clock::time_point deadline) noexcept {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return idle_.wait_until(lock, deadline, [this]() {
+      return jobs_.empty() && !busy_;
+    });
+  }
+
+  // ~BackgroundCloser stops the background thread, after the current job
+  // if any, without processing the jobs still in the queue.
+  ~BackgroundCloser() noexcept;
+
+ private:
+  // Job is a report to close.
+  struct Job {
+    // settings contains the settings of the Reporter.
+    Settings settings;
+
+    // report_id is the ID of the report to close.
+    std::string report_id;
+
+    // preopener, if set, is opening the report to close.
+    std::shared_ptr<ReportPreopener> preopener;
+
+    // preparer, if set, is preparing the report to close.
+    std::shared_ptr<ReportPreparer> preparer;
+
+    // deadline is when we give up.
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  // queue_ queues @p job, unless the queue is full.
+  bool queue_(Job job) noexcept {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (jobs_.size() >= max_jobs_) {
+      return false;
+    }
+    jobs_.push_back(std::move(job));
+    if (!thread_.joinable()) {
+      thread_ = std::thread{[this]() { run_(); }};
+    }
+    wakeup_.notify_one();
+    return true;
+  }
+
+  // collect_ waits for the report to close of @p job, if it is still
+  // being opened, and stores its ID into @p job.
+  static void collect_(Job &job) noexcept;
+
+  // run_ is the main function of the background thread.
+  void run_() noexcept {
+    curl::Client client;
+    std::unique_ptr<UpdateEngine> engine;
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;) {
+      wakeup_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+      if (stop_) {
+        break;
+      }
+      Job job = std::move(jobs_.front());
+      jobs_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      collect_(job);
+      auto now = std::chrono::steady_clock::now();
+      if (job.report_id != "" && now < job.deadline) {
+        // Round up, since a zero timeout means no timeout at all.
+        int64_t timeout = std::chrono::duration_cast<std::chrono::seconds>(
+                              job.deadline - now).count() + 1;
+        CloseRequest request;
+        request.report_id = std::move(job.report_id);
+        // The Reporter is gone, hence we cannot count the handshakes.
+        Reporter::Stats unused;
+        ReporterClient reporter_client{client, engine, 1, job.settings,
+                                       unused};
+        (void)close_with_client_(reporter_client, request, job.settings,
+                                 timeout);
+      }
+      lock.lock();
+      busy_ = false;
+      if (jobs_.empty()) {
+        idle_.notify_all();
+      }
+    }
+  }
+
+  // max_jobs_ is the maximum number of queued jobs.
+  static constexpr size_t max_jobs_ = 1024;
+
+  // mutex_ protects the fields below.
+  std::mutex mutex_;
+
+  // wakeup_ wakes up the background thread.
+  std::condition_variable wakeup_;
+
+  // idle_ wakes up flush when there is nothing left to do.
+  std::condition_variable idle_;
+
+  // jobs_ contains the queued jobs.
+  std::deque<Job> jobs_;
+
+  // busy_ indicates that the background thread is closing a report.
+  bool busy_ = false;
+
+  // stop_ indicates that the background thread should stop.
+  bool stop_ = false;
+
+  // thread_ is the background thread, started when needed.
+  std::thread thread_;
+};
+
+// ReportPreopener opens a report in a background thread, using its own
+// client, so that rotating a report does not slow down submissions.
+class ReportPreopener {
+ public:
+  // ReportPreopener starts opening a report for @p open_request.
+  ReportPreopener(OpenRequestKey open_request, Settings settings) noexcept
+      : open_request_{std::move(open_request)},
+        settings_{std::move(settings)} {
+    thread_ = std::thread{[this]() {
+      curl::Client client;
+      std::unique_ptr<UpdateEngine> engine;
+      ReporterClient reporter_client{client, engine, 1, settings_, stats_};
+      auto start = std::chrono::steady_clock::now();
+      response_ = open_with_client_(reporter_client, open_request_.request(),
+                                    settings_, settings_.timeout);
+      stats_.open_latency.record_since(start);
+      done_ = true;
+    }};
+  }
+
+  // ReportPreopener is the deleted copy constructor.
+  ReportPreopener(const ReportPreopener &) noexcept = delete;
+
+  // ReportPreopener is the deleted copy assignment.
+  ReportPreopener &operator=(const ReportPreopener &) noexcept = delete;
+
+  // ReportPreopener is the deleted move constructor.
+  ReportPreopener(ReportPreopener &&) noexcept = delete;
+
+  // ReportPreopener is the deleted move assignment.
+  ReportPreopener &operator=(ReportPreopener &&) noexcept = delete;
+
+  // ready returns whether we are done, without blocking.
+  bool ready() const noexcept { return done_; }
+
+  // wait waits until we are done and returns the response, whose latency
+  // and TLS handshake, if any, are merged into @p stats.
+  OpenResponse wait(Reporter::Stats &stats) noexcept {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    stats += stats_;
+    return std::move(response_);
+  }
+
+  // ~ReportPreopener waits until we are done.
+  ~ReportPreopener() noexcept {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  // open_request_ is the request of the report to open.
+  OpenRequestKey open_request_;
+
+  // settings_ contains the settings to use.
+  Settings settings_;
+
+  // response_ is the response, valid when done_ is true.
+  OpenResponse response_;
+
+  // stats_ contains the latency of opening the report and the TLS
+  // handshake, if any.
+  Reporter::Stats stats_;
+
+  // done_ indicates that we are done.
+  std::atomic<bool> done_{false};
+
+  // thread_ is the background thread.
+  std::thread thread_;
+};
+
+// ReportPreparer prepares a report in a background thread, using its own
+// Reporter, from which the Reporter calling prepare adopts the collector,
+// the connection, and the report. See Reporter::prepare.
+class ReportPreparer {
+ public:
+  // ReportPreparer starts preparing the report for @p key using @p helper,
+  // which must have the same settings as the calling Reporter.
+  ReportPreparer(Reporter helper, OpenRequestKey key) noexcept
+      : reporter{std::move(helper)}, open_request{std::move(key)} {
+    thread_ = std::thread{[this]() {
+      // We use a sink to keep the level of each line, such that the calling
+      // Reporter can log them like its own lines.
+      reporter.log_sink_ = [this](LogLevel level, std::string message) {
+        push_log_(logs, level, std::move(message));
+      };
+      std::vector<std::string> unused;
+      good = reporter.maybe_discover_(unused, stats, reason) &&
+             reporter.maybe_reopen_(open_request, unused, stats, reason);
+      reporter.log_sink_ = nullptr;
+    }};
+  }
+
+  // ReportPreparer is the deleted copy constructor.
+  ReportPreparer(const ReportPreparer &) noexcept = delete;
+
+  // ReportPreparer is the deleted copy assignment.
+  ReportPreparer &operator=(const ReportPreparer &) noexcept = delete;
+
+  // ReportPreparer is the deleted move constructor.
+  ReportPreparer(ReportPreparer &&) noexcept = delete;
+
+  // ReportPreparer is the deleted move assignment.
+  ReportPreparer &operator=(ReportPreparer &&) noexcept = delete;
+
+  // wait waits until we are done. The fields below are valid afterwards.
+  void wait() noexcept {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // release waits until we are done and returns the ID of the report we
+  // prepared, if any, which the caller must close using @p settings.
+  std::string release(Settings &settings) noexcept {
+    wait();
+    settings = reporter.settings_;
+    std::string report_id;
+    std::swap(report_id, reporter.report_id_);  // helper won't close it
+    return report_id;
+  }
+
+  // ~ReportPreparer waits until we are done.
+  ~ReportPreparer() noexcept { wait(); }
+
+  // reporter is the Reporter preparing the report. When it is destroyed,
+  // it closes the report, unless it has been adopted.
+  Reporter reporter;
+
+  // open_request is the request of the report to prepare.
+  OpenRequestKey open_request;
+
+  // logs contains the logs.
+  std::vector<LogLine> logs;
+
+  // stats contains the stats.
+  Reporter::Stats stats;
+
+  // reason is the reason of failure.
+  std::string reason;
+
+  // good indicates whether we succeeded.
+  bool good = false;
+
+ private:
+  // thread_ is the background thread.
+  std::thread thread_;
+};
+
+BackgroundCloser::~BackgroundCloser() noexcept {
+  {
+    std::unique_lock<std::mutex> lock{mutex_};
+    stop_ = true;
+    wakeup_.notify_one();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  // The helper Reporters would otherwise ask us to close their reports
+  // when they are destroyed along with the queue.
+  for (auto &job : jobs_) {
+    if (job.preparer) {
+      Settings unused;
+      (void)job.preparer->release(unused);
+    }
+  }
+}
+
+void BackgroundCloser::collect_(Job &job) noexcept {
+  if (job.preopener) {
+    Reporter::Stats unused;
+    OpenResponse response = job.preopener->wait(unused);
+    job.preopener.reset();
+    if (response.good) {
+      job.report_id = std::move(response.report_id);
+    }
+  }
+  if (job.preparer) {
+    job.report_id = job.preparer->release(job.settings);
+    job.preparer.reset();
+  }
+}
+
+Reporter::Reporter(
+    std::string software_name, std::string software_version) noexcept {
+  std::swap(software_version_, software_version);
+  std::swap(software_name_, software_name);
+  json_arena_.reset(new JsonArena{json_arena_max_size_});
+}
+
+void Reporter::set_ca_bundle_path(std::string path) noexcept {
+  std::swap(path, settings_.ca_bundle_path);
+}
+
+const std::string &Reporter::ca_bundle_path() const noexcept {
+  return settings_.ca_bundle_path;
+}
+
+void Reporter::set_base_url(std::string url) noexcept {
+  std::swap(settings_.base_url, url);
+  collectors_.clear();
+  discovered_ = false;
+  rediscover_ = false;
+}
+
+const std::string &Reporter::base_url() const noexcept {
+  return settings_.base_url;
+}
+
+void Reporter::set_max_updates_in_flight(size_t count) noexcept {
+  max_updates_in_flight_ = count;
+  engine_.reset();
+}
+
+size_t Reporter::max_updates_in_flight() const noexcept {
+  return max_updates_in_flight_;
+}
+
+void Reporter::set_max_open_reports(size_t count) noexcept {
+  max_open_reports_ = count;
+}
+
+size_t Reporter::max_open_reports() const noexcept {
+  return max_open_reports_;
+}
+
+void Reporter::set_report_idle_timeout(int64_t timeout) noexcept {
+  report_idle_timeout_ = timeout;
+}
+
+int64_t Reporter::report_idle_timeout() const noexcept {
+  return report_idle_timeout_;
+}
+
+size_t Reporter::open_reports() const noexcept {
+  return parked_reports_.size() + ((report_id_ != "") ? 1 : 0);
+}
+
+void Reporter::set_compression(Compression compression) noexcept {
+  settings_.compression = compression;
+}
+
+Compression Reporter::compression() const noexcept {
+  return settings_.compression;
+}
+
+void Reporter::set_compression_level(int level) noexcept {
+  settings_.compression_level = level;
+}
+
+int Reporter::compression_level() const noexcept {
+  return settings_.compression_level;
+}
+
+void Reporter::set_compression_threshold(size_t size) noexcept {
+  settings_.compression_threshold = size;
+}
+
+size_t Reporter::compression_threshold() const noexcept {
+  return settings_.compression_threshold;
+}
+
+void Reporter::set_http2(bool enabled) noexcept { settings_.http2 = enabled; }
+
+bool Reporter::http2() const noexcept { return settings_.http2; }
+
+bool Reporter::set_tls_session_cache_path(std::string path) noexcept {
+  bool good = path == "" || TlsSessionCache::usable();
+  if (!good) {
+    path.clear();
+  }
+  tls_session_cache_ =
+      (path != "") ? TlsSessionCache::for_path(path) : nullptr;
+  std::swap(settings_.tls_session_cache_path, path);
+  return good;
+}
+
+const std::string &Reporter::tls_session_cache_path() const noexcept {
+  return settings_.tls_session_cache_path;
+}
+
+void Reporter::set_collector_cache_path(std::string path) noexcept {
+  collector_cache_ = (path != "") ? CollectorCache::for_path(path) : nullptr;
+  std::swap(collector_cache_path_, path);
+}
+
+const std::string &Reporter::collector_cache_path() const noexcept {
+  return collector_cache_path_;
+}
+
+void Reporter::set_collector_cache_ttl(int64_t ttl) noexcept {
+  collector_cache_ttl_ = ttl;
+}
+
+int64_t Reporter::collector_cache_ttl() const noexcept {
+  return collector_cache_ttl_;
+}
+
+void Reporter::set_collector_max_failures(unsigned count) noexcept {
+  collector_max_failures_ = (count > 0) ? count : 1;
+}
+
+unsigned Reporter::collector_max_failures() const noexcept {
+  return collector_max_failures_;
+}
+
+void Reporter::set_collector_probing(bool enabled) noexcept {
+  collector_probing_ = enabled;
+}
+
+bool Reporter::collector_probing() const noexcept {
+  return collector_probing_;
+}
+
+const std::vector<CollectorStats> &Reporter::collectors() const noexcept {
+  return collectors_;
+}
+
+void Reporter::set_retry_policy(RetryPolicy policy) noexcept {
+  std::swap(settings_.retry_policy, policy);
+}
+
+const RetryPolicy &Reporter::retry_policy() const noexcept {
+  return settings_.retry_policy;
+}
+
+void Reporter::set_report_rotation_policy(
+    ReportRotationPolicy policy) noexcept {
+  std::swap(rotation_policy_, policy);
+}
+
+const ReportRotationPolicy &Reporter::report_rotation_policy() const noexcept {
+  return rotation_policy_;
+}
+
+void Reporter::set_spool(std::shared_ptr<Spool> spool) noexcept {
+  std::swap(spool_, spool);
+}
+
+const std::shared_ptr<Spool> &Reporter::spool() const noexcept {
+  return spool_;
+}
+
+void Reporter::set_log_level(LogLevel level) noexcept {
+  settings_.log_level = level;
+}
+
+LogLevel Reporter::log_level() const noexcept { return settings_.log_level; }
+
+void Reporter::set_max_body_log_size(size_t size) noexcept {
+  settings_.max_body_log_size = size;
+}
+
+size_t Reporter::max_body_log_size() const noexcept {
+  return settings_.max_body_log_size;
+}
+
+void Reporter::set_max_logs(size_t count) noexcept { max_logs_ = count; }
+
+size_t Reporter::max_logs() const noexcept { return max_logs_; }
+
+void Reporter::set_log_sink(LogSink sink) noexcept {
+  log_sink_ = std::move(sink);
+}
+
+void Reporter::set_background_close(bool enabled) noexcept {
+  background_close_ = enabled;
+}
+
+bool Reporter::background_close() const noexcept { return background_close_; }
+
+bool Reporter::flush(std::chrono::steady_clock::time_point deadline) noexcept {
+  return BackgroundCloser::shared().flush(deadline);
+}
+
+void Reporter::set_json_arena_max_size(size_t size) noexcept {
+  json_arena_max_size_ = size;
+  json_arena_.reset((size > 0) ? new JsonArena{size} : nullptr);
+}
+
+size_t Reporter::json_arena_max_size() const noexcept {
+  return json_arena_max_size_;
+}
+
+void Reporter::set_report_id_splicing(bool enabled) noexcept {
+  report_id_splicing_ = enabled;
+}
+
+bool Reporter::report_id_splicing() const noexcept {
+  return report_id_splicing_;
+}
+
+bool Reporter::Stats::operator==(const Stats &other) const {
+#define XX(name_) if (name_ != other.name_) return false;
+  MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
+#undef XX
+  return true;
+}
+
+Reporter::Stats &Reporter::Stats::operator+=(const Stats &other) noexcept {
+#define XX(name_) name_ += other.name_;
+  MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
+#undef XX
+  update_body_bytes += other.update_body_bytes;
+  update_upload_bytes += other.update_upload_bytes;
+  bytes_sent += other.bytes_sent;
+  bytes_received += other.bytes_received;
+  bouncer_latency.merge(other.bouncer_latency);
+  open_latency.merge(other.open_latency);
+  update_latency.merge(other.update_latency);
+  close_latency.merge(other.close_latency);
+  load_latency.merge(other.load_latency);
+  serialize_latency.merge(other.serialize_latency);
+  return *this;
+}
+
+std::string Reporter::Stats::to_json() const noexcept {
+  nlohmann::json doc;
+  nlohmann::json &counters = doc["counters"];
+#define XX(name_) counters[#name_] = name_;
+  MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
+#undef XX
+  doc["update_body_bytes"] = update_body_bytes;
+  doc["update_upload_bytes"] = update_upload_bytes;
+  doc["bytes_sent"] = bytes_sent;
+  doc["bytes_received"] = bytes_received;
+  // Note: parsing JSON we have just generated cannot fail.
+  nlohmann::json &latency = doc["latency"];
+  latency["bouncer"] = nlohmann::json::parse(bouncer_latency.to_json());
+  latency["open"] = nlohmann::json::parse(open_latency.to_json());
+  latency["update"] = nlohmann::json::parse(update_latency.to_json());
+  latency["close"] = nlohmann::json::parse(close_latency.to_json());
+  latency["load"] = nlohmann::json::parse(load_latency.to_json());
+  latency["serialize"] = nlohmann::json::parse(serialize_latency.to_json());
+  return doc.dump();
+}
+
+Reporter::Stats::Stats() noexcept {}
+
+Reporter::Stats::Stats(std::initializer_list<std::string> list) noexcept {
+#define XX(name_)    \
+  if (s == #name_) { \
+    name_ = 1;       \
+    continue;        \
+  }
+  for (auto &s : list) {
+    MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
+  }
+#undef XX
+}
+
+void Reporter::prepare(const OpenRequest &open_request) noexcept {
+  OpenRequest request = open_request;
+  request.software_name = software_name_;
+  request.software_version = software_version_;
+  OpenRequestKey key{std::move(request)};
+  // We do not prepare when failing over, which maybe_discover_ handles.
+  if (preparer_ || rediscover_ ||
+      (report_id_ != "" && key == cached_open_request_)) {
+    return;
+  }
+  for (auto &parked : parked_reports_) {
+    if (parked.open_request == key) {
+      return;
+    }
+  }
+  Reporter helper{software_name_, software_version_};
+  helper.settings_ = settings_;
+  helper.tls_session_cache_ = tls_session_cache_;
+  helper.max_updates_in_flight_ = max_updates_in_flight_;
+  helper.short_timeout_ = short_timeout_;
+  helper.background_close_ = background_close_;
+  helper.json_arena_max_size_ = 0;
+  helper.json_arena_.reset();
+  helper.collector_cache_ = collector_cache_;
+  helper.collector_cache_ttl_ = collector_cache_ttl_;
+  helper.collector_max_failures_ = collector_max_failures_;
+  helper.collector_probing_ = collector_probing_;
+  helper.collectors_ = collectors_;
+  helper.discovered_ = discovered_;
+  preparer_ = std::make_shared<ReportPreparer>(std::move(helper),
+                                               std::move(key));
+}
+
+void Reporter::collect_prepared_(std::vector<std::string> &logs,
+                                 Stats &stats, std::string &reason) noexcept {
+  if (!preparer_) {
+    return;
+  }
+  std::shared_ptr<ReportPreparer> preparer;
+  std::swap(preparer, preparer_);
+  preparer->wait();
+  Reporter &helper = preparer->reporter;
+  stats += preparer->stats;
+  append_logs_(logs, preparer->logs);
+  if (settings_.base_url == "" && helper.settings_.base_url != "") {
+    settings_.base_url = helper.settings_.base_url;
+    collectors_ = std::move(helper.collectors_);
+    discovered_ = helper.discovered_;
+  }
+  // DESIGN CHOICE: failing to prepare is not fatal, since we try again when
+  // submitting, hence we log the reason of failure but we don't return it.
+  if (!preparer->good) {
+    log_(LogLevel::warning, logs,
+         "Cannot prepare the report: " + preparer->reason);
+    return;
+  }
+  if (helper.settings_.base_url != settings_.base_url) {
+    log_(LogLevel::info, logs, "Not using the report prepared for: " +
+                                   helper.settings_.base_url);
+    return;
+  }
+  leave_current_report_(preparer->open_request, logs, stats, reason);
+  if (report_id_ != "") {
+    return;  // we are reusing a parked report
+  }
+  log_(LogLevel::info, logs, "Using the prepared report");
+  std::swap(report_id_, helper.report_id_);  // helper won't close it
+  cached_open_request_ = std::move(preparer->open_request);
+  report_usage_ = helper.report_usage_;
+  // The helper's client, or engine, is connected to the collector. We
+  // cannot replace our engine while it has updates in flight.
+  std::swap(client_, helper.client_);
+  if (!engine_ || engine_->in_flight() == 0) {
+    std::swap(engine_, helper.engine_);
+  }
+  stats.report_prepared += 1;
+}
+
+bool Reporter::maybe_discover_(std::vector<std::string> &logs, Stats &stats,
+                               std::string &reason) noexcept {
+  collect_prepared_(logs, stats, reason);
+  if (rediscover_) {
+    // The reports we opened belong to the collector we are abandoning, so
+    // we cannot use them anymore. The collector will eventually close them.
+    log_(LogLevel::info, logs,
+         "Abandoning unhealthy collector: " + settings_.base_url);
+    rediscover_ = false;
+    if (background_close_ && preopener_ &&
+        BackgroundCloser::shared().close_preopened(
+            settings_, preopener_,
+            std::chrono::steady_clock::now() +
+                std::chrono::seconds(short_timeout_))) {
+      preopener_.reset();  // the closer waits for the next report
+    }
+    settings_.base_url.clear();
+    report_id_.clear();
+    cached_open_request_ = OpenRequestKey{};
+    parked_reports_.clear();
+    preopener_.reset();
+    breaker_open_ = false;
+    breaker_failures_ = 0;
+    breaker_probing_ = false;
+    // The collectors whose probe failed are the last ones, so we use them
+    // only when all the others are failing as well.
+    for (auto &collector : collectors_) {
+      if (collector.consecutive_failures < collector_max_failures_) {
+        settings_.base_url = collector.probe.base_url;
+        stats.collector_failover += 1;
+        if (settings_.log_level >= LogLevel::info) {
+          log_(LogLevel::info, logs, "Failing over to: " + settings_.base_url);
+        }
+        return true;
+      }
+    }
+    discovered_ = false;
+    collectors_.clear();
+  }
+  if (settings_.base_url != "") {
+    return true;
+  }
+  {
+    std::vector<std::string> collectors;
+    if (collector_cache_ && collector_cache_->lookup(collectors)) {
+      stats.bouncer_cache_hit += 1;
+      log_(LogLevel::info, logs, "Using cached collectors");
+      select_collector_(std::move(collectors), logs, stats);
+      return true;
+    }
+  }
+  // TODO(bassosimone): the bouncer API we're currently using only returns
+  // a single collector, but a more modern API returns them all. We can maybe
+  // change the bouncer client code to use the new API and then use that
+  // here for robustness. Or, we can just switch to ooni/probe-engine that
+  // already implements this functionality. Whatever happens first?
+  log_(LogLevel::info, logs, "Using bouncer to discover a collector");
+  mk::bouncer::Request request;
+  request.ca_bundle_path = settings_.ca_bundle_path;
+  request.name = "web_connectivity";  // any test name is fine
+  request.timeout = short_timeout_;
+  request.version = "0.0.1";          // any version is fine
+  auto start = std::chrono::steady_clock::now();
+  mk::bouncer::Response response = mk::bouncer::perform(request);
+  stats.bouncer_latency.record_since(start);
+  append_logs_(logs, response.logs);
+  MKCOLLECTOR_HOOK(bouncer_response_good, response.good);
+  if (!response.good) {
+    reason = response.reason;
+    stats.bouncer_error++;
+    failure_retryable_ = true;
+    return false;
+  }
+  MKCOLLECTOR_HOOK(bouncer_response_collectors, response.collectors);
+  std::vector<std::string> collectors;
+  for (auto &entry : response.collectors) {
+    if (entry.type == "https") {
+      collectors.push_back(entry.address);
+    }
+  }
+  if (collectors.empty()) {
+    const char *r = "No suitable collector found in bouncer response";
+    log_(LogLevel::warning, logs, r);
+    reason = r;
+    stats.bouncer_no_collectors++;
+    failure_retryable_ = true;
+    return false;
+  }
+  stats.bouncer_okay += 1;
+  if (collector_cache_) {
+    collector_cache_->store(collectors, collector_cache_ttl_);
+  }
+  select_collector_(std::move(collectors), logs, stats);
+  return true;
+}
+
+void Reporter::select_collector_(std::vector<std::string> base_urls,
+                                 std::vector<std::string> &logs,
+                                 Stats &stats) noexcept {
+  std::vector<CollectorProbe> probes;
+  bool probing = collector_probing_ && base_urls.size() > 1;
+  if (probing) {
+    Settings settings = settings_;
+    settings.timeout = short_timeout_;
+    probes = probe_collectors(base_urls, settings);
+  } else {
+    for (auto &base_url : base_urls) {
+      CollectorProbe probe;
+      probe.base_url = std::move(base_url);
+      probe.good = true;  // we assume it's good since we did not probe
+      probes.push_back(std::move(probe));
+    }
+  }
+  collectors_.clear();
+  for (auto &probe : probes) {
+    if (probing) {
+      if (!probe.good) {
+        stats.collector_probe_error += 1;
+        if (settings_.log_level >= LogLevel::warning) {
+          log_(LogLevel::warning, logs,
+               "Cannot probe " + probe.base_url + ": " + probe.reason);
+        }
+      } else {
+        stats.collector_probe_okay += 1;
+        if (settings_.log_level >= LogLevel::info) {
+          std::stringstream ss;
+          ss << "Probed " << probe.base_url << ": connect "
+             << probe.connect_time << " s, first byte " << probe.ttfb << " s";
+          log_(LogLevel::info, logs, ss.str());
+        }
+      }
+    }
+    CollectorStats collector;
+    collector.probe = std::move(probe);
+    collectors_.push_back(std::move(collector));
+  }
+  // Note: we use the first collector even if its probe failed, since we
+  // may have failed because our network was temporarily not working.
+  settings_.base_url = collectors_[0].probe.base_url;
+  discovered_ = true;
+  if (settings_.log_level >= LogLevel::info) {
+    log_(LogLevel::info, logs, "Found this collector: " + settings_.base_url);
+  }
+}
+
+void Reporter::close_report_(
+    std::string report_id, std::vector<std::string> &logs, Stats &stats,
+    std::string &reason) noexcept {
+  CloseRequest close_request;
+  close_request.report_id = std::move(report_id);
+  ReporterClient client{client_, engine_, max_updates_in_flight_, settings_,
+                        stats};
+  auto start = std::chrono::steady_clock::now();
+  auto close_response = call_<CloseResponse>(settings_, [&]() {
+    return close_with_client_(client, close_request, settings_,
+                              short_timeout_);
+  }, stats);
+  stats.close_latency.record_since(start);
+  stats.bytes_sent += close_response.bytes_sent;
+  stats.bytes_received += close_response.bytes_received;
+  append_logs_(logs, close_response.logs);
+  MKCOLLECTOR_HOOK(reporter_close_response_good, close_response.good);
+  // DESIGN CHOICE: it's fine if we cannot close a report - keep going
+  if (!close_response.good) {
+    stats.close_report_error += 1;
+    reason = std::move(close_response.reason);
+  } else {
+    stats.close_report_okay += 1;
+  }
+}
+
+void Reporter::close_idle_reports_(std::vector<std::string> &logs,
+                                   Stats &stats, std::string &reason) noexcept {
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = parked_reports_.begin(); it != parked_reports_.end();) {
+    bool expired = report_idle_timeout_ > 0 &&
+                   now - it->last_used >=
+                       std::chrono::seconds(report_idle_timeout_);
+    MKCOLLECTOR_HOOK(reporter_parked_report_expired, expired);
+    if (!expired) {
+      ++it;
+      continue;
+    }
+    log_(LogLevel::info, logs, "Closing idle report");
+    close_report_(std::move(it->report_id), logs, stats, reason);
+    it = parked_reports_.erase(it);
+  }
+}
+
+bool Reporter::rotation_due_() const noexcept {
+  const ReportRotationPolicy &policy = rotation_policy_;
+  return (policy.max_measurements > 0 &&
+          report_usage_.measurements >= policy.max_measurements) ||
+         (policy.max_bytes > 0 && report_usage_.bytes >= policy.max_bytes) ||
+         (policy.max_age > 0 &&
+          std::chrono::steady_clock::now() - report_usage_.opened >=
+              std::chrono::seconds(policy.max_age));
+}
+
+void Reporter::maybe_preopen_(std::vector<std::string> &logs) noexcept {
+  if (report_id_ == "" || preopener_ || !rotation_due_()) {
+    return;
+  }
+  log_(LogLevel::info, logs, "Opening the next report in background");
+  // The background thread needs its own copy of the settings.
+  Settings settings = settings_;
+  settings.timeout = short_timeout_;
+  preopener_ = std::make_shared<ReportPreopener>(cached_open_request_,
+                                                 std::move(settings));
+}
+
+bool Reporter::collect_preopened_(
+    std::string &report_id, std::vector<std::string> &logs, Stats &stats,
+    std::string &reason) noexcept {
+  auto open_response = preopener_->wait(stats);
+  preopener_.reset();
+  stats.bytes_sent += open_response.bytes_sent;
+  stats.bytes_received += open_response.bytes_received;
+  append_logs_(logs, open_response.logs);
+  MKCOLLECTOR_HOOK(reporter_open_response_good, open_response.good);
+  if (!open_response.good) {
+    stats.open_report_error += 1;
+    reason = std::move(open_response.reason);
+    return false;
+  }
+  if (open_response.report_id == "") {
+    const char *r = "Server returned an empty report ID";
+    log_(LogLevel::warning, logs, r);
+    reason = r;
+    stats.report_id_empty += 1;
+    return false;
+  }
+  stats.open_report_okay += 1;
+  report_id = std::move(open_response.report_id);
+  return true;
+}
+
+void Reporter::discard_preopened_(std::vector<std::string> &logs,
+                                  Stats &stats, std::string &reason) noexcept {
+  std::string report_id;
+  if (preopener_ && collect_preopened_(report_id, logs, stats, reason)) {
+    log_(LogLevel::info, logs, "Closing the unused next report");
+    close_report_(std::move(report_id), logs, stats, reason);
+  }
+}
+
+void Reporter::maybe_rotate_(
+    const OpenRequestKey &open_request, std::vector<std::string> &logs,
+    Stats &stats, std::string &reason) noexcept {
+  if (report_id_ == "" || open_request != cached_open_request_ ||
+      defer_rotation_) {
+    return;
+  }
+  if (!preopener_ || !preopener_->ready()) {
+    maybe_preopen_(logs);
+    return;
+  }
+  // DESIGN CHOICE: if we could not open the next report, we keep using the
+  // current report and we try again with the next submission.
+  std::string report_id;
+  if (!collect_preopened_(report_id, logs, stats, reason)) {
+    return;
+  }
+  log_(LogLevel::info, logs, "Rotating the current report");
+  std::swap(report_id_, report_id);
+  report_usage_ = ReportUsage{};
+  stats.report_rotated += 1;
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(short_timeout_);
+  if (!BackgroundCloser::shared().close(settings_, report_id, deadline)) {
+    close_report_(std::move(report_id), logs, stats, reason);
+  }
+}
+
+void Reporter::leave_current_report_(
+    const OpenRequestKey &open_request, std::vector<std::string> &logs,
+    Stats &stats, std::string &reason) noexcept {
+  if (report_id_ != "" && open_request == cached_open_request_) {
+    return;
+  }
+  if (report_id_ != "") {
+    // The next report belongs to the current report's open request.
+    discard_preopened_(logs, stats, reason);
+    // When we keep more than one report open, we park the current report
+    // rather than closing it.
+    if (max_open_reports_ > 1) {
+      log_(LogLevel::info, logs, "Parking previously open report");
+      ParkedReport parked;
+      std::swap(parked.open_request, cached_open_request_);
+      std::swap(parked.report_id, report_id_);  // clears report_id_
+      std::swap(parked.usage, report_usage_);
+      parked.last_used = std::chrono::steady_clock::now();
+      parked_reports_.insert(parked_reports_.begin(), std::move(parked));
+    } else {
+      log_(LogLevel::info, logs, "Closing previously open report");
+      close_report_(std::move(report_id_), logs, stats, reason);
+      report_id_.clear();  // don't rely on moved-from state
     }
-    log_body("Request", body, response.logs);
-    std::swap(body, curl_request.body);
   }
-  curl::Response curl_response = client.perform(curl_request);
-  for (auto &entry : curl_response.logs) {
-    response.logs.push_back(std::move(entry.line));
+  // We get here also when there is no current report, e.g., after we
+  // failed to open a report, in which case a parked report may still
+  // belong to @p open_request.
+  for (auto it = parked_reports_.begin(); it != parked_reports_.end();
+       ++it) {
+    if (it->open_request == open_request) {
+      log_(LogLevel::info, logs, "Reusing parked report");
+      std::swap(cached_open_request_, it->open_request);
+      std::swap(report_id_, it->report_id);
+      std::swap(report_usage_, it->usage);
+      parked_reports_.erase(it);
+      stats.open_report_avoided += 1;
+      break;
+    }
   }
-  MKCOLLECTOR_HOOK(update_response_error, curl_response.error);
-  MKCOLLECTOR_HOOK(update_response_status_code, curl_response.status_code);
-  if (curl_response.error != 0 || curl_response.status_code != 200) {
-    response.reason = curl_reason_for_failure(curl_response);
-    return response;
+  // We close the least recently used report when we have too many open
+  // reports, counting the one we are going to use.
+  while (!parked_reports_.empty() &&
+         parked_reports_.size() >= max_open_reports_) {
+    log_(LogLevel::info, logs, "Closing least recently used report");
+    close_report_(std::move(parked_reports_.back().report_id), logs,
+                  stats, reason);
+    parked_reports_.pop_back();
   }
-  log_body("Response", curl_response.body, response.logs);
-  response.good = true;
-  return response;
 }
 
-UpdateResponse update(const UpdateRequest &request,
-                      const Settings &settings) noexcept {
-  curl::Client client;
-  return update_with_client_(client, request, settings);
+bool Reporter::maybe_reopen_(
+    OpenRequestKey open_request, std::vector<std::string> &logs, Stats &stats,
+    std::string &reason) noexcept {
+  close_idle_reports_(logs, stats, reason);
+  maybe_rotate_(open_request, logs, stats, reason);
+  // step 3 - is this part of a previous report (if any)?
+  leave_current_report_(open_request, logs, stats, reason);
+  // step 4 - do we need to open a new report?
+  if (report_id_ == "") {
+    log_(LogLevel::info, logs, "Opening new report");
+    ReporterClient client{client_, engine_, max_updates_in_flight_,
+                          settings_, stats};
+    auto start = std::chrono::steady_clock::now();
+    auto open_response = call_<OpenResponse>(settings_, [&]() {
+      return open_with_client_(client, open_request.request(), settings_,
+                               short_timeout_);
+    }, stats);
+    stats.open_latency.record_since(start);
+    stats.bytes_sent += open_response.bytes_sent;
+    stats.bytes_received += open_response.bytes_received;
+    append_logs_(logs, open_response.logs);
+    MKCOLLECTOR_HOOK(reporter_open_response_good, open_response.good);
+    if (!open_response.good) {
+      stats.open_report_error += 1;
+      reason = std::move(open_response.reason);
+      failure_retryable_ = open_response.retryable;
+      return false;
+    }
+    MKCOLLECTOR_HOOK(
+        reporter_open_response_report_id, open_response.report_id);
+    if (open_response.report_id == "") {
+      const char *r = "Server returned an empty report ID";
+      log_(LogLevel::warning, logs, r);
+      reason = r;
+      stats.report_id_empty += 1;
+      failure_retryable_ = true;
+      return false;
+    }
+    stats.open_report_okay += 1;
+    cached_open_request_ = std::move(open_request);  // open_request now empty
+    report_id_ = std::move(open_response.report_id);
+    report_usage_ = ReportUsage{};
+  }
+  return true;
 }
 
-static CloseResponse close_with_client_(
-    curl::Client &client, const CloseRequest &request,
-    const Settings &settings) noexcept {
-  CloseResponse response;
-  curl::Request curl_request;
-  curl_request.method = "POST";
-  curl_request.ca_path = settings.ca_bundle_path;
-  curl_request.timeout = settings.timeout;
+bool Reporter::prepare_discovered_(
+    MeasurementView measurement, std::vector<std::string> &logs,
+    Stats &stats, std::string &reason, std::string &serialized) noexcept {
+  // step 1 - use same HTTP client. Implied by using `client_` for any
+  // collector operation throughout this function.
+  // The documents we create until we return live in the JSON arena, which
+  // is reset when we return, after they have been destroyed.
+  JsonArenaScope arena_scope{json_arena_.get()};
+  JsonDocument json_measurement;
   {
-    std::string url = settings.base_url;
-    url += "/report/";
-    url += request.report_id;
-    url += "/close";
-    std::swap(url, curl_request.url);
+    // step 2 - load measurement
+    log_(LogLevel::info, logs, "Loading the measurement from JSON");
+    auto start = std::chrono::steady_clock::now();
+    auto load_result = open_request_from_measurement_with_json_(
+        measurement, software_name_, software_version_, json_measurement);
+    stats.load_latency.record_since(start);
+    if (!load_result.good) {
+      log_(LogLevel::warning, logs, load_result.reason);
+      stats.load_request_error += 1;
+      reason = std::move(load_result.reason);
+      failure_retryable_ = false;
+      return false;
+    }
+    stats.load_request_okay += 1;
+    // steps 3 and 4 - maybe close the current report and open a new one
+    if (!maybe_reopen_(OpenRequestKey{std::move(load_result.value)}, logs,
+                       stats, reason)) {
+      return false;
+    }
   }
-  curl::Response curl_response = client.perform(curl_request);
-  for (auto &entry : curl_response.logs) {
-    response.logs.push_back(std::move(entry.line));
+  // step 5 - prepare the measurement. We reuse the document we have
+  // already parsed, so we serialize the measurement just once and we
+  // wrap it into the update body without parsing it again.
+  log_(LogLevel::info, logs, "Reformatting the measurement");
+  auto start = std::chrono::steady_clock::now();
+  if (!report_id_splicing_) {
+    json_measurement["report_id"] = report_id_;  // copy
   }
-  if (curl_response.error != 0 || curl_response.status_code != 200) {
-    response.reason = curl_reason_for_failure(curl_response);
-    return response;
+  try {
+    if (report_id_splicing_) {
+      if (measurement.data != serialized.data() ||
+          measurement.size != serialized.size()) {
+        // Make room for the report ID field, so that splicing does not
+        // reallocate, since report IDs are much shorter than 128 bytes.
+        serialized.reserve(measurement.size + 128);
+        serialized.assign(measurement.data, measurement.size);  // copy
+      }
+      splice_report_id_(serialized, report_id_);
+    } else {
+      serialized = json_measurement.dump();
+    }
+    stats.serialize_latency.record_since(start);
+  } catch (const std::exception &exc) {
+    // Note: this seems extremely unlikely because the original measurement
+    // was loaded from JSON and the report ID also was received as JSON, yet
+    // we catch the exception nonetheless for ${robustness}.
+    stats.serialize_measurement_error += 1;
+    log_(LogLevel::warning, logs, exc.what());
+    reason = exc.what();
+    failure_retryable_ = false;
+    return false;
   }
-  log_body("Response", curl_response.body, response.logs);
-  response.good = true;
-  return response;
+  try {
+    // When splicing, the report ID is correct by construction, so we do not
+    // copy it into the document just to check it.
+    if (report_id_splicing_) {
+      validate_data_format_version_(json_measurement);
+    } else {
+      validate_update_content_(json_measurement, report_id_);
+    }
+  } catch (const std::exception &exc) {
+    stats.update_report_error += 1;
+    log_(LogLevel::warning, logs, exc.what());
+    reason = exc.what();
+    failure_retryable_ = false;
+    return false;
+  }
+  return true;
 }
 
-CloseResponse close(const CloseRequest &request,
-                    const Settings &settings) noexcept {
-  curl::Client client;
-  return close_with_client_(client, request, settings);
+bool Reporter::complete_update_(
+    UpdateResponse update_response, std::string &serialized,
+    std::string &measurement, std::vector<std::string> &logs, Stats &stats,
+    std::string &reason) noexcept {
+  append_logs_(logs, update_response.logs);
+  stats.update_body_bytes += update_response.body_bytes;
+  stats.update_upload_bytes += update_response.upload_bytes;
+  stats.bytes_sent += update_response.bytes_sent;
+  stats.bytes_received += update_response.bytes_received;
+  MKCOLLECTOR_HOOK(reporter_update_response_good, update_response.good);
+  if (!update_response.good) {
+    stats.update_report_error += 1;
+    reason = std::move(update_response.reason);
+    failure_retryable_ = update_response.retryable;
+    return false;
+  }
+  // step 6 - modify measurement to refer to the correct report ID
+  measurement = std::move(serialized);
+  stats.update_report_okay += 1;
+  report_usage_.measurements += 1;
+  report_usage_.bytes += update_response.body_bytes;
+  maybe_preopen_(logs);
+  log_(LogLevel::info, logs, "Submission succeded");
+  return true;
 }
 
-Reporter::Reporter(
-    std::string software_name, std::string software_version) noexcept {
-  std::swap(software_version_, software_version);
-  std::swap(software_name_, software_name);
+bool Reporter::submit_discovered_(
+    MeasurementView measurement, std::string &updated,
+    std::vector<std::string> &logs, int64_t upload_timeout, Stats &stats,
+    std::string &reason) noexcept {
+  std::string serialized;
+  if (!prepare_discovered_(measurement, logs, stats, reason, serialized)) {
+    return false;
+  }
+  return complete_update_(
+      update_prepared_(serialized, false, logs, upload_timeout, stats),
+      serialized, updated, logs, stats, reason);
 }
 
-void Reporter::set_ca_bundle_path(std::string path) noexcept {
-  std::swap(path, ca_bundle_path_);
+UpdateResponse Reporter::update_prepared_(
+    std::string &serialized, bool consume, std::vector<std::string> &logs,
+    int64_t upload_timeout, Stats &stats) noexcept {
+  // step 5 (continued) - submit the measurement
+  log_(LogLevel::info, logs, "Updating the report");
+  std::string body = consume ? make_update_body_(std::move(serialized))
+                             : make_update_body_(serialized);
+  auto start = std::chrono::steady_clock::now();
+  auto update_response = call_<UpdateResponse>(settings_, [&]() {
+    // We only need to keep the body around if we may retry.
+    return update_once_(
+        (settings_.retry_policy.max_attempts > 1) ? body : std::move(body),
+        upload_timeout, stats);
+  }, stats);
+  stats.update_latency.record_since(start);
+  return update_response;
 }
 
-const std::string &Reporter::ca_bundle_path() const noexcept {
-  return ca_bundle_path_;
+UpdateResponse Reporter::update_once_(std::string body, int64_t timeout,
+                                      Stats &stats) noexcept {
+  ReporterClient client{client_, engine_, max_updates_in_flight_, settings_,
+                        stats};
+  return update_with_client_and_body_(client, report_id_, std::move(body),
+                                      settings_, timeout);
 }
 
-void Reporter::set_base_url(std::string url) noexcept {
-  std::swap(base_url_, url);
+void Reporter::count_tls_handshake_(const UpdateResponse &response,
+                                    Stats &stats) noexcept {
+  if (response.tls_handshake) {
+    (response.tls_resumed ? stats.tls_handshake_resumed
+                          : stats.tls_handshake_full) += 1;
+  }
 }
 
-const std::string &Reporter::base_url() const noexcept {
-  return base_url_;
+bool Reporter::maybe_discover_and_submit_with_stats_and_reason(
+    std::string &measurement, std::vector<std::string> &logs,
+    int64_t upload_timeout, Stats &stats, std::string &reason) noexcept {
+  // step 0 (see description of the algorithm above) - maybe discover bouncer
+  bool good = maybe_discover_(logs, stats, reason) &&
+              submit_discovered_(measurement, measurement, logs,
+                                 upload_timeout, stats, reason);
+  if (!good) {
+    // Note: the measurement is not modified on failure.
+    spool_measurement_(measurement, failure_retryable_, logs, stats);
+  }
+  trim_logs_(logs);
+  return good;
 }
 
-bool Reporter::Stats::operator==(const Stats &other) const {
-#define XX(name_) if (name_ != other.name_) return false;
-  MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
-#undef XX
-  return true;
+bool Reporter::maybe_discover_and_submit_with_stats_and_reason(
+    std::string &&measurement, std::vector<std::string> &logs,
+    int64_t upload_timeout, Stats &stats, std::string &reason) noexcept {
+  std::string serialized = std::move(measurement);
+  if (report_id_splicing_) {
+    // Make room for the report ID field, which is much shorter than 128
+    // bytes, and for the update envelope, so that we modify the measurement
+    // in place without reallocating it again.
+    serialized.reserve(serialized.size() + 128 + update_body_overhead_);
+  }
+  // step 0 (see description of the algorithm above) - maybe discover bouncer
+  bool good = maybe_discover_(logs, stats, reason) &&
+              prepare_discovered_(serialized, logs, stats, reason,
+                                  serialized);
+  if (good) {
+    // We need to keep the measurement around only if we may spool it.
+    std::string unused;
+    good = complete_update_(
+        update_prepared_(serialized, !spool_, logs, upload_timeout, stats),
+        serialized, unused, logs, stats, reason);
+  }
+  if (!good) {
+    spool_measurement_(serialized, failure_retryable_, logs, stats);
+  }
+  trim_logs_(logs);
+  return good;
 }
 
-Reporter::Stats::Stats() noexcept {}
+void Reporter::submit_async_(
+    std::string serialized, std::string &measurement, BatchResult &result,
+    std::vector<std::string> &logs, int64_t upload_timeout, Stats &stats,
+    std::vector<std::function<void()>> &deferred) noexcept {
+  if (!engine_) {
+    engine_.reset(new UpdateEngine{max_updates_in_flight_});
+  }
+  // step 5 (continued) - submit the measurement
+  log_(LogLevel::info, logs, "Updating the report");
+  if (!breaker_allows_(stats)) {
+    result.good = complete_update_(
+        circuit_breaker_response_<UpdateResponse>(settings_), serialized,
+        measurement, logs, stats, result.reason);
+    result.retryable = !result.good && failure_retryable_;
+    return;
+  }
+  std::string body = make_update_body_(serialized);
+  auto shared = std::make_shared<std::string>(std::move(serialized));
+  // Wait for a free slot, so that the latency does not include the time
+  // spent waiting for other updates to complete.
+  while (engine_->in_flight() >= max_updates_in_flight_) {
+    engine_->run_once(1000);
+  }
+  auto start = std::chrono::steady_clock::now();
+  engine_->update_with_body_(
+      report_id_, std::move(body), settings_, upload_timeout,
+      [this, shared, &measurement, &result, &logs, &stats, &deferred,
+       upload_timeout, start](UpdateResponse resp) {
+        count_tls_handshake_(resp, stats);
+        if (!resp.good && resp.retryable &&
+            settings_.retry_policy.max_attempts > 1) {
+          // Retrying here would block the other updates in flight, so we
+          // retry later, continuing from the attempt we just made.
+          deferred.push_back([this, shared, &measurement, &result, &logs,
+                              &stats, upload_timeout, resp, start]() {
+            UpdateResponse response = resp;
+            if (breaker_allows_(stats)) {
+              std::string body = make_update_body_(*shared);
+              unsigned retries = 0;
+              response = retry_<UpdateResponse>(settings_, [&]() {
+                return update_once_(body, upload_timeout, stats);
+              }, std::move(response), 1, retries);
+              stats.retry_attempt += retries;
+              record_health_(!response.good && response.retryable, stats);
+            } else {
+              // We must record the attempt we made, which may have been
+              // the call that the half open circuit breaker let through.
+              record_health_(true, stats);
+            }
+            // Note: this includes the time waiting for the other updates.
+            stats.update_latency.record_since(start);
+            result.good = complete_update_(std::move(response), *shared,
+                                           measurement, logs, stats,
+                                           result.reason);
+            result.retryable = !result.good && failure_retryable_;
+          });
+          return;
+        }
+        stats.update_latency.record_since(start);
+        record_health_(!resp.good && resp.retryable, stats);
+        result.good = complete_update_(std::move(resp), *shared, measurement,
+                                       logs, stats, result.reason);
+        result.retryable = !result.good && failure_retryable_;
+      });
+}
 
-Reporter::Stats::Stats(std::initializer_list<std::string> list) noexcept {
-#define XX(name_)    \
-  if (s == #name_) { \
-    name_ = 1;       \
-    continue;        \
+std::vector<Reporter::BatchResult> Reporter::submit_batch(
+    std::vector<std::string> &measurements, std::vector<std::string> &logs,
+    int64_t upload_timeout, Stats &stats) noexcept {
+  auto results = submit_batch_(measurements, logs, upload_timeout, stats);
+  for (size_t idx = 0; idx < results.size(); ++idx) {
+    if (!results[idx].good) {
+      spool_measurement_(measurements[idx], results[idx].retryable, logs,
+                         stats);
+    }
   }
-  for (auto &s : list) {
-    MKCOLLECTOR_REPORTER_STATS_ENUM(XX)
+  trim_logs_(logs);
+  return results;
+}
+
+size_t Reporter::drain_spool(size_t max_count, std::vector<std::string> &logs,
+                             int64_t upload_timeout, Stats &stats) noexcept {
+  if (!spool_) {
+    return 0;
   }
-#undef XX
+  std::vector<SpoolEntry> entries;
+  {
+    std::string reason;
+    if (!spool_->read(max_count, entries, reason)) {
+      log_(LogLevel::warning, logs, std::move(reason));
+      trim_logs_(logs);
+      return 0;
+    }
+  }
+  std::vector<std::string> measurements;
+  measurements.reserve(entries.size());
+  for (auto &entry : entries) {
+    measurements.push_back(std::move(entry.measurement));
+  }
+  auto results = submit_batch_(measurements, logs, upload_timeout, stats);
+  size_t removed = 0;
+  for (size_t idx = 0; idx < results.size(); ++idx) {
+    if (!results[idx].good && results[idx].retryable) {
+      continue;
+    }
+    std::string reason;
+    if (!spool_->remove(entries[idx], reason)) {
+      log_(LogLevel::warning, logs, std::move(reason));
+      stats.spool_remove_error += 1;
+      continue;
+    }
+    stats.spool_remove_okay += 1;
+    removed += 1;
+  }
+  trim_logs_(logs);
+  return removed;
 }
 
-bool Reporter::maybe_discover_and_submit_with_stats_and_reason(
-    std::string &measurement, std::vector<std::string> &logs,
-    int64_t upload_timeout, Stats &stats, std::string &reason) noexcept {
-  // step 0 (see description of the algorithm above) - maybe discover bouncer
-  if (base_url_ == "") {
-    // TODO(bassosimone): the bouncer API we're currently using only returns
-    // a single collector, but a more modern API returns them all. We can maybe
-    // change the bouncer client code to use the new API and then use that
-    // here for robustness. Or, we can just switch to ooni/probe-engine that
-    // already implements this functionality. Whatever happens first?
-    logs.push_back("Using bouncer to discover a collector");
-    mk::bouncer::Request request;
-    request.ca_bundle_path = ca_bundle_path_;
-    request.name = "web_connectivity";  // any test name is fine
-    request.timeout = short_timeout_;
-    request.version = "0.0.1";          // any version is fine
-    mk::bouncer::Response response = mk::bouncer::perform(request);
-    logs.insert(
-        std::end(logs), std::begin(response.logs), std::end(response.logs));
-    MKCOLLECTOR_HOOK(bouncer_response_good, response.good);
-    if (!response.good) {
-      reason = response.reason;
-      stats.bouncer_error++;
+#ifndef _WIN32
+
+// MappedFile is a read only memory mapping of a whole file.
+class MappedFile {
+ public:
+  // MappedFile is the default constructor.
+  MappedFile() noexcept = default;
+
+  // MappedFile is the deleted copy constructor.
+  MappedFile(const MappedFile &) noexcept = delete;
+
+  // MappedFile is the deleted copy assignment.
+  MappedFile &operator=(const MappedFile &) noexcept = delete;
+
+  // open maps the file at @p path. On failure, it sets @p reason.
+  bool open(const std::string &path, std::string &reason) noexcept {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      reason = error_("cannot open file");
       return false;
     }
-    MKCOLLECTOR_HOOK(bouncer_response_collectors, response.collectors);
-    for (auto &entry : response.collectors) {
-      if (entry.type == "https") {
-        base_url_ = entry.address;
-        break;
+    struct stat st {};
+    bool good = ::fstat(fd, &st) == 0;
+    if (!good) {
+      reason = error_("cannot stat file");
+    } else if (st.st_size > 0) {
+      void *data = ::mmap(nullptr, (size_t)st.st_size, PROT_READ,
+                          MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        reason = error_("cannot map file");
+        good = false;
+      } else {
+        // We read the file once, from the beginning to the end.
+        (void)::madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        data_ = (const char *)data;
+        size_ = (size_t)st.st_size;
       }
     }
-    if (base_url_ == "") {
-      const char *r = "No suitable collector found in bouncer response";
-      logs.push_back(r);
-      reason = r;
-      stats.bouncer_no_collectors++;
-      return false;
+    ::close(fd);
+    return good;
+  }
+
+  // data returns the mapped bytes, or null if the file is empty.
+  const char *data() const noexcept { return data_; }
+
+  // size returns the size of the file.
+  size_t size() const noexcept { return size_; }
+
+  // ~MappedFile unmaps the file.
+  ~MappedFile() noexcept {
+    if (data_ != nullptr) {
+      (void)::munmap((void *)data_, size_);
     }
-    stats.bouncer_okay += 1;
-    std::stringstream ss;
-    ss << "Found this collector: " << base_url_;
-    logs.push_back(ss.str());
-    // FALLTHROUGH
   }
-  // step 1 - use same HTTP client. Implied by using `client_` for any
-  // collector operation throughout this function.
-  UpdateRequest update_request;
+
+ private:
+  // error_ returns a reason of failure including errno.
+  static std::string error_(const char *what) noexcept {
+    std::string reason = "resubmit: ";
+    reason += what;
+    reason += ": ";
+    reason += strerror(errno);
+    return reason;
+  }
+
+  // data_ is the beginning of the mapping.
+  const char *data_ = nullptr;
+
+  // size_ is the size of the mapping.
+  size_t size_ = 0;
+};
+
+#endif  // _WIN32
+
+Reporter::ResubmitResult Reporter::resubmit_file(
+    const std::string &path, uint64_t offset, size_t max_count,
+    std::vector<std::string> &logs, int64_t upload_timeout,
+    Stats &stats) noexcept {
+  ResubmitResult result;
+  result.offset = offset;
+#ifdef _WIN32
+  (void)path, (void)max_count, (void)upload_timeout, (void)stats;
+  result.reason = "resubmit: not supported on this platform";
+  log_(LogLevel::warning, logs, result.reason);
+#else
+  MappedFile file;
+  if (!file.open(path, result.reason)) {
+    log_(LogLevel::warning, logs, result.reason);
+    trim_logs_(logs);
+    return result;
+  }
+  if (offset > file.size()) {
+    result.reason = "resubmit: offset is past the end of the file";
+    log_(LogLevel::warning, logs, result.reason);
+    trim_logs_(logs);
+    return result;
+  }
+  const char *end = file.data() + file.size();
+  size_t count = 0;
+  while (result.offset < file.size() &&
+         (max_count == 0 || count < max_count)) {
+    const char *begin = file.data() + result.offset;
+    const char *newline =
+        (const char *)memchr(begin, '\n', (size_t)(end - begin));
+    uint64_t next = (uint64_t)(((newline != nullptr) ? newline + 1 : end) -
+                               file.data());
+    MeasurementView line{
+        begin, (size_t)(((newline != nullptr) ? newline : end) - begin)};
+    if (line.size > 0 && line.data[line.size - 1] == '\r') {
+      line.size -= 1;
+    }
+    if (line.size > 0) {
+      count += 1;
+      std::string updated;
+      if (maybe_discover_(logs, stats, result.reason) &&
+          submit_discovered_(line, updated, logs, upload_timeout, stats,
+                             result.reason)) {
+        result.okay += 1;
+      } else if (!failure_retryable_) {
+        result.reason.clear();
+        result.skipped += 1;
+      } else {
+        // Keep the offset of this line, so that we retry it on resume.
+        break;
+      }
+    }
+    result.offset = next;
+  }
+  result.good = result.offset >= file.size();
+#endif
+  trim_logs_(logs);
+  return result;
+}
+
+void Reporter::spool_measurement_(const std::string &measurement,
+                                  bool retryable,
+                                  std::vector<std::string> &logs,
+                                  Stats &stats) noexcept {
+  if (!spool_ || !retryable) {
+    return;
+  }
+  std::string reason;
+  if (!spool_->append(measurement, reason)) {
+    log_(LogLevel::warning, logs, std::move(reason));
+    stats.spool_append_error += 1;
+    return;
+  }
+  log_(LogLevel::info, logs, "Saved the measurement into the spool");
+  stats.spool_append_okay += 1;
+}
+
+std::vector<Reporter::BatchResult> Reporter::submit_batch_(
+    std::vector<std::string> &measurements, std::vector<std::string> &logs,
+    int64_t upload_timeout, Stats &stats) noexcept {
+  std::vector<BatchResult> results(measurements.size());
+  if (measurements.empty()) {
+    return results;
+  }
   {
-    nlohmann::json json_measurement;
-    {
-      OpenRequest open_request;
-      {
-        // step 2 - load measurement
-        logs.push_back("Loading the measurement from JSON");
-        auto load_result = open_request_from_measurement_with_json_(
-            std::move(measurement),  // measurement becomes empty
-            software_name_, software_version_, json_measurement);
-        if (!load_result.good) {
-          logs.push_back(std::move(load_result.reason));
-          stats.load_request_error += 1;
-          reason = std::move(load_result.reason);
-          return false;
-        }
-        stats.load_request_okay += 1;
-        open_request = std::move(load_result.value);
-      }
-      // step 3 - is this part of a previous report (if any)?
-      if (report_id_ != "" && (open_request != cached_open_request_)) {
-        logs.push_back("Closing previously open report");
-        CloseRequest close_request;
-        close_request.report_id = std::move(report_id_);  // clears report_id_
-        auto close_response = close_with_client_(
-            client_, close_request, make_settings(short_timeout_));
-        logs.insert(std::end(logs), std::begin(close_response.logs),
-                    std::end(close_response.logs));
-        MKCOLLECTOR_HOOK(reporter_close_response_good, close_response.good);
-        // DESIGN CHOICE: it's fine if we cannot close a report - keep going
-        if (!close_response.good) {
-          stats.close_report_error += 1;
-          reason = std::move(close_response.reason);
-        } else {
-          stats.close_report_okay += 1;
-        }
+    std::string reason;
+    if (!maybe_discover_(logs, stats, reason)) {
+      for (auto &result : results) {
+        result.reason = reason;
+        result.retryable = failure_retryable_;
       }
-      // step 4 - do we need to open a new report?
-      if (report_id_ == "") {
-        logs.push_back("Opening new report");
-        auto open_response = open_with_client_(
-            client_, open_request, make_settings(short_timeout_));
-        logs.insert(std::end(logs), std::begin(open_response.logs),
-                    std::end(open_response.logs));
-        MKCOLLECTOR_HOOK(reporter_open_response_good, open_response.good);
-        if (!open_response.good) {
-          stats.open_report_error += 1;
-          reason = std::move(open_response.reason);
-          return false;
-        }
-        MKCOLLECTOR_HOOK(
-            reporter_open_response_report_id, open_response.report_id);
-        if (open_response.report_id == "") {
-          const char *r = "Server returned an empty report ID";
-          logs.push_back(r);
-          reason = r;
-          stats.report_id_empty += 1;
-          return false;
+      return results;
+    }
+  }
+  // Group the measurements by OpenRequest, keeping the order in which we
+  // have first seen each group, but processing first the group that belongs
+  // to the currently open report (if any). We use the scanner here, such
+  // that we don't keep all the DOMs in memory. The full load is performed
+  // later by submit_discovered_, which also performs validation.
+  std::unordered_map<OpenRequestKey, size_t> keys;
+  std::vector<std::vector<size_t>> groups;
+  std::vector<OpenRequestKey> group_keys;
+  for (size_t idx = 0; idx < measurements.size(); ++idx) {
+    auto load_result = open_request_from_measurement_with_scanner_(
+        measurements[idx], software_name_, software_version_);
+    if (!load_result.good) {
+      log_(LogLevel::warning, logs, load_result.reason);
+      stats.load_request_error += 1;
+      results[idx].reason = std::move(load_result.reason);
+      continue;
+    }
+    OpenRequestKey key{std::move(load_result.value)};
+    auto it = keys.find(key);
+    if (it == keys.end()) {
+      it = keys.insert(std::make_pair(key, groups.size())).first;
+      groups.emplace_back();
+      group_keys.push_back(std::move(key));
+    }
+    groups[it->second].push_back(idx);
+  }
+  if (report_id_ != "") {
+    for (size_t group = 1; group < group_keys.size(); ++group) {
+      if (group_keys[group] == cached_open_request_) {
+        std::rotate(groups.begin(), groups.begin() + group,
+                    groups.begin() + group + 1);
+        break;
+      }
+    }
+  }
+  std::vector<std::function<void()>> deferred;
+  for (auto &group : groups) {
+    for (size_t pos = 0; pos < group.size(); ++pos) {
+      auto &result = results[group[pos]];
+      auto &measurement = measurements[group[pos]];
+      std::string serialized;
+      Stats before = stats;
+      defer_rotation_ = (max_updates_in_flight_ > 1 && pos > 0);
+      if (max_updates_in_flight_ <= 1) {
+        result.good = submit_discovered_(measurement, measurement, logs,
+                                         upload_timeout, stats,
+                                         result.reason);
+        result.retryable = !result.good && failure_retryable_;
+      } else if (prepare_discovered_(
+                     measurement, logs, stats, result.reason,
+                     serialized)) {
+        submit_async_(std::move(serialized), measurement, result, logs,
+                      upload_timeout, stats, deferred);
+      } else {
+        result.retryable = failure_retryable_;
+      }
+      // If we cannot open the report for this group, it's pointless to
+      // try again for all the other measurements in the group. Failing to
+      // open the next report when rotating, instead, is not fatal.
+      if (report_id_ == "" &&
+          (stats.open_report_error != before.open_report_error ||
+           stats.report_id_empty != before.report_id_empty)) {
+        for (++pos; pos < group.size(); ++pos) {
+          results[group[pos]].reason = result.reason;
+          results[group[pos]].retryable = result.retryable;
         }
-        stats.open_report_okay += 1;
-        cached_open_request_ = std::move(open_request);  // open_request now empty
-        report_id_ = std::move(open_response.report_id);
       }
     }
-    // step 5 - prepare and submit measurement
-    logs.push_back("Reformatting the measurement");
-    update_request.report_id = report_id_;       // copy
-    json_measurement["report_id"] = report_id_;  // copy
-    try {
-      update_request.content = json_measurement.dump();
-    } catch (const std::exception &exc) {
-      // Note: this seems extremely unlikely because the original measurement
-      // was loaded from JSON and the report ID also was received as JSON, yet
-      // we catch the exception nonetheless for ${robustness}.
-      stats.serialize_measurement_error += 1;
-      logs.push_back(exc.what());
-      reason = exc.what();
-      return false;
+    // Make sure we don't close a report with updates in flight.
+    if (engine_) {
+      engine_->wait();
     }
+    for (auto &func : deferred) {
+      func();
+    }
+    deferred.clear();
   }
-  logs.push_back("Updating the report");
-  auto update_response = update_with_client_(
-      client_, update_request, make_settings(upload_timeout));
-  logs.insert(std::end(logs), std::begin(update_response.logs),
-              std::end(update_response.logs));
-  MKCOLLECTOR_HOOK(reporter_update_response_good, update_response.good);
-  if (!update_response.good) {
-    stats.update_report_error += 1;
-    reason = std::move(update_response.reason);
-    return false;
-  }
-  // step 6 - modify measurement to refer to the correct report ID
-  measurement = std::move(update_request.content);
-  stats.update_report_okay += 1;
-  logs.push_back("Submission succeded");
-  return true;
+  defer_rotation_ = false;
+  return results;
 }
 
 bool Reporter::maybe_discover_and_submit_with_timeout(
@@ -768,20 +5943,197 @@ const std::string &Reporter::report_id() const noexcept {
 }
 
 Reporter::~Reporter() noexcept {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(short_timeout_);
+  if (background_close_ && preopener_ &&
+      BackgroundCloser::shared().close_preopened(settings_, preopener_,
+                                                 deadline)) {
+    preopener_.reset();  // the closer waits for the next report
+  }
+  if (background_close_ && preparer_ &&
+      BackgroundCloser::shared().close_prepared(preparer_, deadline)) {
+    preparer_.reset();  // the closer waits for the prepared report
+  }
+  if (preparer_) {
+    // Adopt the prepared report, so that we close it with the other ones.
+    std::vector<std::string> logs;
+    Stats stats;
+    std::string reason;
+    collect_prepared_(logs, stats, reason);
+  }
+  if (preopener_) {
+    // Close the next report along with the other ones.
+    std::vector<std::string> logs;
+    Stats stats;
+    std::string reason;
+    ParkedReport parked;
+    if (collect_preopened_(parked.report_id, logs, stats, reason)) {
+      parked_reports_.push_back(std::move(parked));
+    }
+  }
+  if (background_close_) {
+    if (report_id_ != "") {
+      BackgroundCloser::shared().close(settings_, std::move(report_id_),
+                                       deadline);
+    }
+    for (auto &parked : parked_reports_) {
+      BackgroundCloser::shared().close(
+          settings_, std::move(parked.report_id), deadline);
+    }
+    return;
+  }
+  // Nobody can read the stats of the handshakes we perform now.
+  Stats unused;
+  ReporterClient client{client_, engine_, max_updates_in_flight_, settings_,
+                        unused};
   if (report_id_ != "") {
     CloseRequest close_request;
     close_request.report_id = std::move(report_id_);  // clear report ID
     (void)close_with_client_(
-        client_, close_request, make_settings(short_timeout_));
+        client, close_request, settings_, short_timeout_);
+  }
+  for (auto &parked : parked_reports_) {
+    CloseRequest close_request;
+    close_request.report_id = std::move(parked.report_id);
+    (void)close_with_client_(
+        client, close_request, settings_, short_timeout_);
+  }
+}
+
+template <typename Response, typename Func>
+Response Reporter::call_(const Settings &settings, Func &&func,
+                         Stats &stats) noexcept {
+  if (!breaker_allows_(stats)) {
+    return circuit_breaker_response_<Response>(settings);
+  }
+  unsigned retries = 0;
+  Response response = with_retries_<Response>(settings, func, retries);
+  stats.retry_attempt += retries;
+  record_health_(!response.good && response.retryable, stats);
+  return response;
+}
+
+bool Reporter::breaker_allows_(Stats &stats) noexcept {
+  if (!breaker_open_) {
+    return true;
+  }
+  // When the cooldown has expired we let a single call through, whose
+  // result closes or opens again the circuit breaker (see record_health_),
+  // while the other calls keep failing fast, even with updates in flight.
+  if (!breaker_probing_ &&
+      std::chrono::steady_clock::now() >= breaker_open_until_) {
+    breaker_probing_ = true;
+    return true;
+  }
+  stats.circuit_breaker_fail_fast += 1;
+  return false;
+}
+
+void Reporter::record_health_(bool failed, Stats &stats) noexcept {
+  // We only fail over from collectors we discovered, not the configured
+  // one. Switching collector now would break the batch we may be sending,
+  // hence we do that the next time we need a collector.
+  if (discovered_ && !rediscover_) {
+    auto it = std::find_if(
+        collectors_.begin(), collectors_.end(),
+        [this](const CollectorStats &collector) {
+          return collector.probe.base_url == settings_.base_url;
+        });
+    if (it != collectors_.end()) {
+      if (failed) {
+        it->failures += 1;
+        it->consecutive_failures += 1;
+      } else {
+        it->successes += 1;
+        it->consecutive_failures = 0;
+      }
+      rediscover_ = it->consecutive_failures >= collector_max_failures_;
+    }
+    if (collector_cache_ &&
+        collector_cache_->record(settings_.base_url, failed,
+                                 collector_max_failures_)) {
+      rediscover_ = true;
+      stats.bouncer_cache_invalidated += 1;
+    }
+    if (rediscover_ && it != collectors_.end()) {
+      // Other Reporters may have failed using the same cache.
+      it->consecutive_failures = collector_max_failures_;
+    }
+  }
+  if (settings_.retry_policy.breaker_threshold <= 0) {
+    return;
+  }
+  breaker_probing_ = false;
+  if (!failed) {
+    breaker_open_ = false;
+    breaker_failures_ = 0;
+    return;
+  }
+  breaker_failures_ += 1;
+  const RetryPolicy &policy = settings_.retry_policy;
+  if (breaker_open_ || breaker_failures_ >= policy.breaker_threshold) {
+    breaker_open_ = true;
+    breaker_failures_ = 0;
+    breaker_open_until_ = std::chrono::steady_clock::now() +
+                          std::chrono::seconds(policy.breaker_cooldown);
+    stats.circuit_breaker_trip += 1;
+  }
+}
+
+void Reporter::log_(LogLevel level, std::vector<std::string> &logs,
+                    const char *message) noexcept {
+  if (level > settings_.log_level) {
+    return;
   }
+  emit_(level, logs, std::string{message});
 }
 
-Settings Reporter::make_settings(int64_t timeout) const noexcept {
-  Settings settings;
-  settings.base_url = base_url_;
-  settings.ca_bundle_path = ca_bundle_path_;
-  settings.timeout = timeout;
-  return settings;
+void Reporter::log_(LogLevel level, std::vector<std::string> &logs,
+                    std::string message) noexcept {
+  if (level > settings_.log_level) {
+    return;
+  }
+  emit_(level, logs, std::move(message));
+}
+
+void Reporter::emit_(LogLevel level, std::vector<std::string> &logs,
+                     std::string &&message) noexcept {
+  if (log_sink_) {
+    log_sink_(level, std::move(message));
+    return;
+  }
+  logs.push_back(std::move(message));
+  // Trimming is amortized: we let the logs grow up to twice the bound
+  // before dropping lines, and we trim exactly before returning.
+  if (max_logs_ > 0 && logs.size() >= 2 * max_logs_) {
+    trim_logs_(logs);
+  }
+}
+
+void Reporter::append_logs_(std::vector<std::string> &logs,
+                            std::vector<LogLine> &lines) noexcept {
+  for (auto &line : lines) {
+    if (line.level <= settings_.log_level) {
+      emit_(line.level, logs, std::move(line.message));
+    }
+  }
+  lines.clear();
+}
+
+void Reporter::append_logs_(std::vector<std::string> &logs,
+                            std::vector<std::string> &lines) noexcept {
+  if (settings_.log_level >= LogLevel::debug) {
+    for (auto &line : lines) {
+      emit_(LogLevel::debug, logs, std::move(line));
+    }
+  }
+  lines.clear();
+}
+
+void Reporter::trim_logs_(std::vector<std::string> &logs) noexcept {
+  if (max_logs_ > 0 && logs.size() > max_logs_) {
+    logs.erase(logs.begin(), logs.end() - static_cast<ptrdiff_t>(max_logs_));
+  }
 }
 
 }  // inline namespace MKCOLLECTOR_INLINE_NAMESPACE
@@ -20,12 +20,16 @@ MKMOCK_DEFINE_HOOK(
 MKMOCK_DEFINE_HOOK(reporter_close_response_good, bool);
 MKMOCK_DEFINE_HOOK(reporter_open_response_good, bool);
 MKMOCK_DEFINE_HOOK(reporter_open_response_report_id, std::string);
+MKMOCK_DEFINE_HOOK(reporter_parked_report_expired, bool);
 MKMOCK_DEFINE_HOOK(reporter_update_response_good, bool);
 
 #define MKCOLLECTOR_MOCK
 #define MKCOLLECTOR_INLINE_IMPL
 #include "mkcollector.hpp"
 
+#include "loopback-collector.hpp"
+
+#include <fstream>
 #include <iostream>
 
 // You may want this commented out function for debugging
@@ -405,3 +409,2012 @@ TEST_CASE("Reporter::submit is covered") {
   auto good = reporter.maybe_discover_and_submit(measurement, logs);
   REQUIRE(good == false); // should fail with parse error
 }
+
+TEST_CASE("JsonArena works as expected") {
+  using namespace mk::collector;
+  JsonArena arena{1 << 20};
+
+  SECTION("documents allocated in the arena are equivalent") {
+    auto measurement = dummy_measurement("");
+    {
+      JsonArenaScope scope{&arena};
+      auto doc = JsonDocument::parse(measurement);
+      REQUIRE(doc.dump() == nlohmann::json::parse(measurement).dump());
+      REQUIRE(arena.owns(&doc.at("test_keys")));
+    }
+    REQUIRE(JsonArena::current() == nullptr);
+    // After reset, we reuse the memory of the single retained chunk.
+    JsonArenaScope scope{&arena};
+    void *p = arena.allocate(1);
+    REQUIRE(arena.owns(p));
+    REQUIRE(!arena.owns(&measurement));
+  }
+
+  SECTION("we use the heap when there is no current arena") {
+    auto doc = JsonDocument::parse(dummy_measurement(""));
+    REQUIRE(!arena.owns(&doc.at("test_keys")));
+  }
+
+  SECTION("we can allocate more than the chunk size") {
+    JsonArenaScope scope{&arena};
+    char *p = static_cast<char *>(arena.allocate(1 << 21));
+    REQUIRE(arena.owns(p));
+    REQUIRE(arena.owns(p + (1 << 21) - 1));
+  }
+}
+
+TEST_CASE("make_update_body_ is equivalent to serializing the envelope") {
+  auto content = dummy_measurement("xx");
+  nlohmann::json doc;
+  doc["format"] = "json";
+  doc["content"] = nlohmann::json::parse(content);
+  REQUIRE(mk::collector::make_update_body_(content) == doc.dump());
+  REQUIRE(mk::collector::make_update_body_(std::move(content)) == doc.dump());
+}
+
+TEST_CASE("open_request_from_measurement behaves like the DOM loader") {
+  std::vector<std::string> inputs{
+      "", "{", "[]", "17", "null", "{}",
+      R"({"probe_asn": "AS0"})",
+      R"({"probe_asn": 1, "probe_cc": "ZZ"})",
+      R"({"probe_asn": "AS0", "probe_cc": {"probe_cc": "ZZ"}})",
+      R"({"probe_asn": "AS0", "probe_cc": "ZZ", "test_name": "dummy",
+          "test_start_time": "2018-11-01 15:33:17", "test_version": []})",
+      R"({"probe_asn": "AS0", "probe_cc": "ZZ", "test_name": "dummy",
+          "test_start_time": "2018-11-01 15:33:17", "test_version": "0.0.1",
+          "test_keys": {"probe_asn": "AS1", "x": [1, 2.0, true, null]}})",
+      R"({"test_keys": {"probe_asn": "AS1"}, "probe_asn": "AS0",
+          "probe_cc": "ZZ", "test_name": "dummy", "test_version": "0.0.1",
+          "test_start_time": "2018-11-01 15:33:17"})",
+      dummy_measurement(""),
+  };
+  for (auto &input : inputs) {
+    nlohmann::json doc;
+    auto expect = mk::collector::open_request_from_measurement_with_json_(
+        input, "mkcollector", "0.0.1", doc);
+    auto re = mk::collector::open_request_from_measurement(
+        input, "mkcollector", "0.0.1");
+    REQUIRE(re.good == expect.good);
+    REQUIRE(re.reason == expect.reason);
+    if (!re.good) {
+      continue;  // value is only meaningful on success
+    }
+#define XX(name_) REQUIRE(re.value.name_ == expect.value.name_);
+    MKCOLLECTOR_OPEN_REQUEST_ENUM(XX)
+#undef XX
+  }
+}
+
+TEST_CASE("splice_report_id_ works as expected") {
+  auto splice = [](std::string measurement) {
+    mk::collector::splice_report_id_(measurement, "rid");
+    return measurement;
+  };
+
+  SECTION("when the report_id exists") {
+    REQUIRE(splice(R"({"a": 1.50, "report_id": "", "b": [ "x" ] })") ==
+            R"({"a": 1.50, "report_id": "rid", "b": [ "x" ] })");
+    REQUIRE(splice(R"({"report_id":null})") == R"({"report_id":"rid"})");
+  }
+
+  SECTION("when the report_id is missing") {
+    REQUIRE(splice(R"({"a": 1})") == R"({"report_id":"rid","a": 1})");
+    REQUIRE(splice(" { } ") == R"( {"report_id":"rid" } )");
+  }
+
+  SECTION("with nested or quoted report_id strings") {
+    REQUIRE(splice(R"({"x": {"report_id": "a"}, "y": "\"report_id\": \"b"})") ==
+            R"({"report_id":"rid","x": {"report_id": "a"}, "y": "\"report_id\": \"b"})");
+  }
+
+  SECTION("with duplicate keys") {
+    REQUIRE(splice(R"({"report_id": "a", "report_id": "b"})") ==
+            R"({"report_id": "a", "report_id": "rid"})");
+  }
+
+  SECTION("with invalid input") {
+    std::vector<std::string> inputs{
+        "", "[]", "{", R"({"a")", R"({"a": })", R"({"a": 1 "b": 2})",
+        R"({"a": "x)", R"({"a": [1, 2})", R"({a: 1})"};
+    for (auto &input : inputs) {
+      REQUIRE_THROWS(splice(input));
+    }
+  }
+
+  SECTION("with a binary report ID") {
+    auto rid = std::string{(const char *)binary_input, sizeof(binary_input)};
+    std::string measurement = "{}";
+    REQUIRE_THROWS(mk::collector::splice_report_id_(measurement, rid));
+  }
+}
+
+TEST_CASE("Reporter can splice the report ID") {
+  mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  REQUIRE(!reporter.report_id_splicing());
+  reporter.set_report_id_splicing(true);
+  REQUIRE(reporter.report_id_splicing());
+  auto original = nlohmann::json::parse(dummy_measurement("")).dump(2);
+  auto measurement = original;
+  mk::collector::Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+  REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+      measurement, logs, 0, stats, reason));
+  auto expected = original;
+  mk::collector::splice_report_id_(expected, reporter.report_id());
+  REQUIRE(measurement == expected);
+  REQUIRE(nlohmann::json::parse(measurement)["report_id"] ==
+          reporter.report_id());
+}
+
+TEST_CASE("Reporter::submit_batch works as expected") {
+  SECTION("with interleaved measurements") {
+    mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    std::vector<std::string> measurements{
+        dummy_measurement_with_nettest_name("", "dummy"),
+        dummy_measurement_with_nettest_name("", "gummy"),
+        "{",
+        dummy_measurement_with_nettest_name("", "dummy"),
+        dummy_measurement_with_nettest_name("", "gummy"),
+    };
+    mk::collector::Reporter::Stats stats;
+    std::vector<std::string> logs;
+    auto results = reporter.submit_batch(measurements, logs, 0, stats);
+    REQUIRE(results.size() == measurements.size());
+    for (size_t idx = 0; idx < results.size(); ++idx) {
+      REQUIRE(results[idx].good == (idx != 2));
+      REQUIRE(results[idx].reason.empty() == (idx != 2));
+    }
+    REQUIRE(measurements[2] == "{");
+    REQUIRE(nlohmann::json::parse(measurements[4])["report_id"] ==
+            reporter.report_id());
+    REQUIRE(nlohmann::json::parse(measurements[0])["report_id"] ==
+            nlohmann::json::parse(measurements[3])["report_id"]);
+    mk::collector::Reporter::Stats expected{
+        "bouncer_okay", "load_request_error", "close_report_okay"};
+    expected.load_request_okay = 4;
+    expected.open_report_okay = 2;
+    expected.update_report_okay = 4;
+    REQUIRE(stats == expected);
+    SECTION("and we start from the currently open report") {
+      measurements = {
+          dummy_measurement_with_nettest_name("", "dummy"),
+          dummy_measurement_with_nettest_name("", "gummy"),
+      };
+      stats = {};
+      results = reporter.submit_batch(measurements, logs, 0, stats);
+      REQUIRE(results[0].good);
+      REQUIRE(results[1].good);
+      expected = mk::collector::Reporter::Stats{
+          "close_report_okay", "open_report_okay"};
+      expected.load_request_okay = 2;
+      expected.update_report_okay = 2;
+      REQUIRE(stats == expected);
+    }
+  }
+
+  SECTION("when we cannot open reports") {
+    auto testcore = []() {
+      mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      std::vector<std::string> measurements{
+          dummy_measurement_with_nettest_name("", "dummy"),
+          dummy_measurement_with_nettest_name("", "gummy"),
+          dummy_measurement_with_nettest_name("", "dummy"),
+      };
+      mk::collector::Reporter::Stats stats;
+      std::vector<std::string> logs;
+      auto results = reporter.submit_batch(measurements, logs, 0, stats);
+      for (auto &result : results) {
+        REQUIRE(!result.good);
+      }
+      mk::collector::Reporter::Stats expected{"bouncer_okay"};
+      expected.load_request_okay = 2;
+      expected.open_report_error = 2;
+      REQUIRE(stats == expected);
+    };
+    MKMOCK_WITH_ENABLED_HOOK(reporter_open_response_good, false, {
+      testcore();
+    });
+  }
+
+  SECTION("when the bouncer fails") {
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, false, {
+      mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      std::vector<std::string> measurements{"{}", "{}"};
+      mk::collector::Reporter::Stats stats;
+      std::vector<std::string> logs;
+      auto results = reporter.submit_batch(measurements, logs, 0, stats);
+      REQUIRE(results.size() == 2);
+      REQUIRE(!results[0].good);
+      REQUIRE(!results[1].good);
+      REQUIRE(stats == (mk::collector::Reporter::Stats{"bouncer_error"}));
+    });
+  }
+}
+
+// with_mocked_transport runs @p func pretending that the collector accepts
+// all open and update requests. The base URL should point to a closed port
+// such that requests fail quickly before the hooks override the results.
+template <typename Func> static void with_mocked_transport(Func &&func) {
+  MKMOCK_WITH_ENABLED_HOOK(open_response_error, 0, {
+    MKMOCK_WITH_ENABLED_HOOK(open_response_status_code, 200, {
+      MKMOCK_WITH_ENABLED_HOOK(open_response_body,
+                               R"({"report_id": "20180208T095233Z_AS0_x"})", {
+        MKMOCK_WITH_ENABLED_HOOK(update_response_error, 0, {
+          MKMOCK_WITH_ENABLED_HOOK(update_response_status_code, 200, {
+            func();
+          });
+        });
+      });
+    });
+  });
+}
+
+static const char *closed_port_base_url = "http://127.0.0.1:9";
+
+TEST_CASE("UpdateEngine works as expected") {
+  mk::collector::Settings settings;
+  settings.base_url = closed_port_base_url;
+  std::string report_id = "20180208T095233Z_AS0_x";
+
+  SECTION("when the content is invalid") {
+    mk::collector::UpdateEngine engine{4};
+    mk::collector::UpdateRequest request;
+    request.content = "{";
+    bool called = false;
+    engine.update(request, settings, [&](mk::collector::UpdateResponse re) {
+      REQUIRE(!re.good);
+      called = true;
+    });
+    REQUIRE(called);  // immediately
+    REQUIRE(engine.in_flight() == 0);
+  }
+
+  SECTION("when we cannot connect") {
+    mk::collector::UpdateEngine engine{4};
+    mk::collector::UpdateRequest request;
+    request.report_id = report_id;
+    request.content = dummy_measurement(report_id);
+    std::string reason;
+    engine.update(request, settings, [&](mk::collector::UpdateResponse re) {
+      REQUIRE(!re.good);
+      reason = re.reason;
+    });
+    engine.wait();
+    REQUIRE(reason == "collector: Couldn't connect to server");
+  }
+
+  SECTION("when there are many updates") {
+    auto testcore = [&]() {
+      mk::collector::UpdateEngine engine{3};
+      mk::collector::UpdateRequest request;
+      request.report_id = report_id;
+      request.content = dummy_measurement(report_id);
+      size_t good = 0;
+      for (size_t i = 0; i < 10; ++i) {
+        engine.update(request, settings, [&](mk::collector::UpdateResponse re) {
+          REQUIRE(re.good);
+          REQUIRE(re.logs.size() > 0);
+          good += 1;
+        });
+        REQUIRE(engine.in_flight() <= 3);
+      }
+      engine.wait();
+      REQUIRE(engine.in_flight() == 0);
+      REQUIRE(good == 10);
+    };
+    with_mocked_transport(testcore);
+  }
+}
+
+TEST_CASE("Reporter::submit_batch can keep many updates in flight") {
+  auto testcore = []() {
+    mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(closed_port_base_url);
+    REQUIRE(reporter.max_updates_in_flight() == 1);
+    reporter.set_max_updates_in_flight(4);
+    REQUIRE(reporter.max_updates_in_flight() == 4);
+    std::vector<std::string> measurements;
+    for (size_t i = 0; i < 10; ++i) {
+      measurements.push_back(dummy_measurement_with_nettest_name(
+          "", (i % 2 == 0) ? "dummy" : "gummy"));
+    }
+    mk::collector::Reporter::Stats stats;
+    std::vector<std::string> logs;
+    auto results = reporter.submit_batch(measurements, logs, 0, stats);
+    for (size_t i = 0; i < results.size(); ++i) {
+      REQUIRE(results[i].good);
+      REQUIRE(nlohmann::json::parse(measurements[i])["report_id"] ==
+              "20180208T095233Z_AS0_x");
+    }
+    REQUIRE(stats.open_report_okay == 2);
+    REQUIRE(stats.update_report_okay == 10);
+  };
+  with_mocked_transport(testcore);
+}
+
+TEST_CASE("Reporter can keep many reports open") {
+  auto submit = [](mk::collector::Reporter &reporter, const char *name) {
+    auto measurement = dummy_measurement_with_nettest_name("", name);
+    mk::collector::Reporter::Stats stats;
+    std::vector<std::string> logs;
+    std::string reason;
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        measurement, logs, 0, stats, reason));
+    return stats;
+  };
+
+  SECTION("with the default settings") {
+    mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    REQUIRE(reporter.max_open_reports() == 1);
+    REQUIRE(reporter.report_idle_timeout() == 0);
+    REQUIRE(reporter.open_reports() == 0);
+    (void)submit(reporter, "dummy");
+    REQUIRE(reporter.open_reports() == 1);
+    auto stats = submit(reporter, "gummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "close_report_okay",
+                         "open_report_okay", "update_report_okay"}));
+    REQUIRE(reporter.open_reports() == 1);
+  }
+
+  SECTION("when we interleave measurements") {
+    mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_max_open_reports(2);
+    REQUIRE(reporter.max_open_reports() == 2);
+    (void)submit(reporter, "dummy");
+    auto dummy_report_id = reporter.report_id();
+    auto stats = submit(reporter, "gummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "open_report_okay",
+                         "update_report_okay"}));
+    auto gummy_report_id = reporter.report_id();
+    REQUIRE(reporter.open_reports() == 2);
+    stats = submit(reporter, "dummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "open_report_avoided",
+                         "update_report_okay"}));
+    REQUIRE(reporter.report_id() == dummy_report_id);
+    stats = submit(reporter, "gummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "open_report_avoided",
+                         "update_report_okay"}));
+    REQUIRE(reporter.report_id() == gummy_report_id);
+    // A third report should cause the eviction of the dummy report
+    stats = submit(reporter, "yummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "close_report_okay",
+                         "open_report_okay", "update_report_okay"}));
+    REQUIRE(reporter.open_reports() == 2);
+    stats = submit(reporter, "gummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "open_report_avoided",
+                         "update_report_okay"}));
+    REQUIRE(reporter.report_id() == gummy_report_id);
+  }
+
+  SECTION("when there is no current report") {
+    mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_max_open_reports(3);
+    (void)submit(reporter, "dummy");
+    auto dummy_report_id = reporter.report_id();
+    (void)submit(reporter, "gummy");
+    MKMOCK_WITH_ENABLED_HOOK(reporter_open_response_good, false, {
+      auto measurement = dummy_measurement_with_nettest_name("", "yummy");
+      mk::collector::Reporter::Stats stats;
+      std::vector<std::string> logs;
+      std::string reason;
+      REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+          measurement, logs, 0, stats, reason));
+    });
+    REQUIRE(reporter.report_id() == "");
+    REQUIRE(reporter.open_reports() == 2);
+    auto stats = submit(reporter, "dummy");
+    REQUIRE(stats == (mk::collector::Reporter::Stats{
+                         "load_request_okay", "open_report_avoided",
+                         "update_report_okay"}));
+    REQUIRE(reporter.report_id() == dummy_report_id);
+    REQUIRE(reporter.open_reports() == 2);
+  }
+
+  SECTION("when parked reports expire") {
+    auto testcore = [&]() {
+      mk::collector::Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_max_open_reports(4);
+      reporter.set_report_idle_timeout(60);
+      REQUIRE(reporter.report_idle_timeout() == 60);
+      (void)submit(reporter, "dummy");
+      (void)submit(reporter, "gummy");
+      REQUIRE(reporter.open_reports() == 2);
+      MKMOCK_WITH_ENABLED_HOOK(reporter_parked_report_expired, true, {
+        auto stats = submit(reporter, "gummy");
+        REQUIRE(stats == (mk::collector::Reporter::Stats{
+                             "load_request_okay", "close_report_okay",
+                             "update_report_okay"}));
+      });
+      REQUIRE(reporter.open_reports() == 1);
+    };
+    testcore();
+  }
+}
+
+TEST_CASE("OpenRequestKey works as expected") {
+  using namespace mk::collector;
+  OpenRequest request;
+  request.probe_asn = "AS0";
+  request.test_name = "dummy";
+  OpenRequestKey key{request};
+  REQUIRE(key.request() == request);
+  REQUIRE(key.hash() == request.hash());
+  REQUIRE(key.hash() == std::hash<OpenRequest>{}(request));
+  REQUIRE(key.hash() == std::hash<OpenRequestKey>{}(key));
+
+  SECTION("copies share the same request") {
+    OpenRequestKey copy = key;
+    REQUIRE(copy == key);
+    REQUIRE(&copy.request() == &key.request());
+  }
+
+  SECTION("equal requests produce equal keys") {
+    REQUIRE(OpenRequestKey{request} == key);
+    REQUIRE(!(OpenRequestKey{request} != key));
+    REQUIRE(OpenRequestKey{} == OpenRequestKey{OpenRequest{}});
+  }
+
+#define XX(name_)                          \
+  {                                        \
+    OpenRequest other = request;           \
+    other.name_ += "x";                    \
+    REQUIRE(other != request);             \
+    REQUIRE(!(other == request));          \
+    REQUIRE(OpenRequestKey{other} != key); \
+  }
+  MKCOLLECTOR_OPEN_REQUEST_ENUM(XX)
+#undef XX
+
+  SECTION("keys can be used with unordered containers") {
+    std::unordered_map<OpenRequestKey, int> keys;
+    keys[key] = 1;
+    keys[OpenRequestKey{}] = 2;
+    REQUIRE(keys.at(OpenRequestKey{request}) == 1);
+    std::unordered_map<OpenRequest, int> requests;
+    requests[request] = 3;
+    REQUIRE(requests.at(key.request()) == 3);
+  }
+}
+
+TEST_CASE("Logging can be configured") {
+  using namespace mk::collector;
+  mk::collector::Settings settings;
+  settings.base_url = closed_port_base_url;
+  UpdateRequest request;
+  request.report_id = "20180208T095233Z_AS0_x";
+  request.content = dummy_measurement(request.report_id);
+
+  SECTION("the quiet level does not log anything") {
+    settings.log_level = LogLevel::quiet;
+    auto re = update(request, settings);
+    REQUIRE(!re.good);
+    REQUIRE(re.logs.empty());
+  }
+
+  SECTION("bodies can be truncated") {
+    settings.max_body_log_size = 8;
+    auto re = update(request, settings);
+    bool found = false;
+    for (auto &line : re.logs) {
+      if (line.message.find("Request body: ") == 0) {
+        REQUIRE(line.level == LogLevel::debug);
+        REQUIRE(line.message == "Request body: {\"conten [truncated]");
+        found = true;
+      }
+    }
+    REQUIRE(found);
+  }
+
+  SECTION("warnings have the warning level") {
+    request.content = "{";
+    auto re = update(request, settings);
+    REQUIRE(!re.good);
+    REQUIRE(re.logs.size() == 1);
+    REQUIRE(re.logs[0].level == LogLevel::warning);
+    REQUIRE(re.logs[0].message == re.reason);
+  }
+
+  SECTION("the Reporter does not pass disabled bouncer logs to the sink") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_log_level(LogLevel::warning);
+    std::vector<std::pair<LogLevel, std::string>> messages;
+    reporter.set_log_sink([&](LogLevel level, std::string message) {
+      messages.emplace_back(level, std::move(message));
+    });
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, false, {
+      std::string measurement = dummy_measurement("");
+      std::vector<std::string> logs;
+      REQUIRE(!reporter.maybe_discover_and_submit(measurement, logs));
+    });
+    for (auto &entry : messages) {
+      REQUIRE(entry.first == LogLevel::warning);
+    }
+  }
+
+  auto testcore = [](Reporter &reporter, std::vector<std::string> &logs) {
+    reporter.set_base_url(closed_port_base_url);
+    std::vector<std::string> measurements;
+    for (size_t i = 0; i < 4; ++i) {
+      measurements.push_back(dummy_measurement(""));
+    }
+    Reporter::Stats stats;
+    with_mocked_transport([&]() {
+      for (auto &result : reporter.submit_batch(measurements, logs, 0, stats)) {
+        REQUIRE(result.good);
+      }
+    });
+  };
+
+  SECTION("the Reporter can bound the logs") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    REQUIRE(reporter.max_logs() == 0);
+    reporter.set_max_logs(3);
+    REQUIRE(reporter.max_logs() == 3);
+    std::vector<std::string> logs;
+    testcore(reporter, logs);
+    REQUIRE(logs.size() == 3);
+    REQUIRE(logs.back() == "Submission succeded");
+  }
+
+  SECTION("the Reporter can use a sink") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    REQUIRE(reporter.log_level() == LogLevel::debug);
+    reporter.set_log_level(LogLevel::info);
+    REQUIRE(reporter.log_level() == LogLevel::info);
+    REQUIRE(reporter.max_body_log_size() == SIZE_MAX);
+    reporter.set_max_body_log_size(16);
+    REQUIRE(reporter.max_body_log_size() == 16);
+    std::vector<std::pair<LogLevel, std::string>> messages;
+    reporter.set_log_sink([&](LogLevel level, std::string message) {
+      messages.emplace_back(level, std::move(message));
+    });
+    std::vector<std::string> logs;
+    testcore(reporter, logs);
+    REQUIRE(logs.empty());
+    REQUIRE(messages.size() > 0);
+    for (auto &entry : messages) {
+      REQUIRE(entry.first <= LogLevel::info);
+      REQUIRE(entry.second.find("body:") == std::string::npos);
+    }
+  }
+}
+
+TEST_CASE("maybe_compress_update_body_ works as expected") {
+  using namespace mk::collector;
+  Settings settings;
+  std::string original = make_update_body_(dummy_measurement("x"));
+  std::string body = original;
+  UpdateResponse response;
+
+  SECTION("when compression is disabled") {
+    REQUIRE(maybe_compress_update_body_(body, settings, response) == nullptr);
+    REQUIRE(body == original);
+    REQUIRE(response.body_bytes == original.size());
+    REQUIRE(response.upload_bytes == original.size());
+  }
+
+  SECTION("when the body is smaller than the threshold") {
+    settings.compression = Compression::gzip;
+    settings.compression_threshold = original.size() + 1;
+    REQUIRE(maybe_compress_update_body_(body, settings, response) == nullptr);
+    REQUIRE(body == original);
+  }
+
+  SECTION("when the level is invalid") {
+    settings.compression = Compression::gzip;
+    settings.compression_threshold = 0;
+    settings.compression_level = 17;
+    REQUIRE(maybe_compress_update_body_(body, settings, response) == nullptr);
+    REQUIRE(body == original);
+    REQUIRE(response.logs.size() == 1);
+  }
+
+  SECTION("when the body is compressed") {
+    settings.compression_threshold = 0;
+    for (auto compression : {Compression::gzip, Compression::deflate}) {
+      settings.compression = compression;
+      body = original;
+      response = UpdateResponse{};
+      auto encoding = maybe_compress_update_body_(body, settings, response);
+      REQUIRE(encoding != nullptr);
+      REQUIRE(std::string{encoding} ==
+              ((compression == Compression::gzip) ? "gzip" : "deflate"));
+      REQUIRE(response.body_bytes == original.size());
+      REQUIRE(response.upload_bytes == body.size());
+      REQUIRE(body.size() < original.size());
+    }
+  }
+}
+
+#ifndef _WIN32
+TEST_CASE("We can upload compressed measurements") {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  for (auto compression : {Compression::none, Compression::gzip,
+                           Compression::deflate}) {
+    for (size_t in_flight : {1, 4}) {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      reporter.set_compression(compression);
+      REQUIRE(reporter.compression() == compression);
+      reporter.set_compression_threshold(0);
+      REQUIRE(reporter.compression_threshold() == 0);
+      reporter.set_compression_level(9);
+      REQUIRE(reporter.compression_level() == 9);
+      reporter.set_max_updates_in_flight(in_flight);
+      std::vector<std::string> measurements(8, dummy_measurement(""));
+      std::vector<std::string> logs;
+      Reporter::Stats stats;
+      auto before = collector.stats();
+      for (auto &result : reporter.submit_batch(measurements, logs, 0, stats)) {
+        REQUIRE(result.good);
+      }
+      auto after = collector.stats();
+      REQUIRE(after.bad_requests == before.bad_requests);
+      REQUIRE(after.updates - before.updates == 8);
+      REQUIRE(after.update_upload_bytes - before.update_upload_bytes ==
+              stats.update_upload_bytes);
+      REQUIRE(after.update_body_bytes - before.update_body_bytes ==
+              stats.update_body_bytes);
+      if (compression == Compression::none) {
+        REQUIRE(after.compressed_updates == before.compressed_updates);
+        REQUIRE(stats.update_upload_bytes == stats.update_body_bytes);
+      } else {
+        REQUIRE(after.compressed_updates - before.compressed_updates == 8);
+        REQUIRE(stats.update_upload_bytes < stats.update_body_bytes);
+      }
+      REQUIRE(stats.bytes_sent >= stats.update_upload_bytes);
+      REQUIRE(stats.update_latency.count() == 8);
+    }
+  }
+}
+
+TEST_CASE("Reporter::Stats can be merged and exported") {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  Reporter::Stats total;
+  for (size_t i = 0; i < 2; ++i) {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    std::string reason;
+    std::string measurement = dummy_measurement("");
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        measurement, logs, 0, stats, reason));
+    REQUIRE(stats.load_latency.count() == 1);
+    REQUIRE(stats.open_latency.count() == 1);
+    REQUIRE(stats.serialize_latency.count() == 1);
+    REQUIRE(stats.update_latency.count() == 1);
+    REQUIRE(stats.bouncer_latency.count() == 0);
+    REQUIRE(stats.bytes_sent > 0);
+    REQUIRE(stats.bytes_received > 0);
+    total += stats;
+  }
+  REQUIRE(total.update_report_okay == 2);
+  REQUIRE(total.open_latency.count() == 2);
+  auto doc = nlohmann::json::parse(total.to_json());
+  REQUIRE(doc.at("counters").at("update_report_okay") == 2);
+  REQUIRE(doc.at("bytes_sent") == total.bytes_sent);
+  REQUIRE(doc.at("latency").at("update").at("count") == 2);
+  REQUIRE(doc.at("latency").at("close").at("count") == 0);
+}
+
+TEST_CASE("LoopbackCollector can inject faults") {
+  using namespace mk::collector;
+  OpenRequest request;
+  request.probe_asn = "AS0";
+  request.probe_cc = "ZZ";
+  request.software_name = "mkcollector-unit-tests";
+  request.software_version = "0.0.1";
+  request.test_name = "dummy";
+  request.test_start_time = "2018-11-01 15:33:17";
+  request.test_version = "0.0.1";
+  Settings settings;
+  settings.timeout = 5;
+  LoopbackCollector::Config config;
+
+  SECTION("latency") {
+    config.latency = 50;
+    LoopbackCollector collector{config};
+    settings.base_url = collector.base_url();
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(open(request, settings).good);
+    REQUIRE(std::chrono::steady_clock::now() - start >=
+            std::chrono::milliseconds{50});
+  }
+
+  SECTION("errors") {
+    config.error_rate = 1.0;
+    LoopbackCollector collector{config};
+    settings.base_url = collector.base_url();
+    auto response = open(request, settings);
+    REQUIRE(!response.good);
+    REQUIRE(response.retryable);
+    REQUIRE(collector.stats().injected_errors == 1);
+    REQUIRE(collector.stats().reports_opened == 0);
+  }
+
+  SECTION("throttling") {
+    config.max_requests_per_second = 1.0;
+    LoopbackCollector collector{config};
+    settings.base_url = collector.base_url();
+    REQUIRE(open(request, settings).good);
+    auto response = open(request, settings);
+    REQUIRE(!response.good);
+    REQUIRE(response.retryable);
+    REQUIRE(collector.stats().throttled == 1);
+  }
+
+  SECTION("body size limits") {
+    config.max_body_size = 16;
+    LoopbackCollector collector{config};
+    settings.base_url = collector.base_url();
+    auto response = open(request, settings);
+    REQUIRE(!response.good);
+    REQUIRE(!response.retryable);
+    REQUIRE(collector.stats().too_large == 1);
+  }
+
+  SECTION("the Reporter retries injected errors") {
+    config.error_rate = 0.3;
+    config.latency_jitter = 2;
+    LoopbackCollector collector{config};
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    RetryPolicy policy;
+    policy.max_attempts = 16;
+    policy.initial_backoff = 1;
+    reporter.set_retry_policy(policy);
+    reporter.set_max_updates_in_flight(4);
+    std::vector<std::string> measurements(32, dummy_measurement(""));
+    std::vector<std::string> logs;
+    Reporter::Stats stats;
+    for (auto &result : reporter.submit_batch(measurements, logs, 0, stats)) {
+      REQUIRE(result.good);
+    }
+    REQUIRE(collector.stats().updates == 32);
+    REQUIRE(collector.stats().injected_errors > 0);
+    REQUIRE(stats.retry_attempt == collector.stats().injected_errors);
+  }
+}
+
+TEST_CASE("Reporter multiplexes updates over HTTP/2") {
+  using namespace mk::collector;
+  LoopbackCollector::Config config;
+  config.latency = 20;
+  LoopbackCollector collector{config};
+  REQUIRE(collector.good());
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  reporter.set_base_url(collector.base_url());
+  REQUIRE(!reporter.http2());
+  reporter.set_http2(true);
+  REQUIRE(reporter.http2());
+  reporter.set_max_updates_in_flight(8);
+  reporter.set_compression(Compression::gzip);
+  reporter.set_compression_threshold(0);
+  std::vector<std::string> measurements(32, dummy_measurement(""));
+  std::vector<std::string> logs;
+  Reporter::Stats stats;
+  for (auto &result : reporter.submit_batch(measurements, logs, 0, stats)) {
+    REQUIRE(result.good);
+  }
+  REQUIRE(collector.stats().updates == 32);
+  REQUIRE(collector.stats().compressed_updates == 32);
+  // Note: with libcurl 7.88 the Reporter falls back to HTTP/1.1.
+  auto version = curl_version_info(CURLVERSION_NOW)->version_num;
+  if (version < 0x075800 || version >= 0x080000) {
+    REQUIRE(collector.stats().http2_streams >= 32);
+    // One connection for opening the report and one for the updates.
+    REQUIRE(collector.stats().connections <= 2);
+  } else {
+    REQUIRE(collector.stats().http2_streams == 0);
+  }
+}
+
+TEST_CASE("Reporter works with the JSON arena disabled") {
+  using namespace mk::collector;
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  REQUIRE(reporter.json_arena_max_size() == 4 * 1024 * 1024);
+  reporter.set_json_arena_max_size(0);
+  REQUIRE(reporter.json_arena_max_size() == 0);
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  reporter.set_base_url(collector.base_url());
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+  std::string measurement = dummy_measurement("");
+  REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+      measurement, logs, 0, stats, reason));
+  REQUIRE(collector.stats().updates == 1);
+}
+#endif
+
+TEST_CASE("LatencyHistogram works as expected") {
+  using namespace mk::collector;
+  LatencyHistogram histogram;
+  REQUIRE(histogram.count() == 0);
+  REQUIRE(histogram.percentile(50.0) == 0);
+  REQUIRE(histogram.mean() == 0.0);
+  for (int64_t usec = 1; usec <= 1000; ++usec) {
+    histogram.record(usec);
+  }
+  REQUIRE(histogram.count() == 1000);
+  REQUIRE(histogram.min() == 1);
+  REQUIRE(histogram.max() == 1000);
+  REQUIRE(histogram.mean() == 500.5);
+  REQUIRE(histogram.percentile(0.0) == 1);
+  REQUIRE(histogram.percentile(100.0) == 1000);
+
+  SECTION("percentiles are accurate within 1/16") {
+    for (double p : {1.0, 10.0, 50.0, 90.0, 99.0, 99.9}) {
+      auto value = (double)histogram.percentile(p);
+      REQUIRE(value >= p * 10.0);
+      REQUIRE(value <= p * 10.0 * 17.0 / 16.0);
+    }
+  }
+
+  SECTION("small values are exact") {
+    LatencyHistogram small;
+    for (int64_t usec : {-5, 0, 7, 15, 16, 17}) {
+      small.record(usec);
+    }
+    REQUIRE(small.min() == 0);
+    REQUIRE(small.percentile(50.0) == 7);
+    REQUIRE(small.percentile(66.0) == 15);
+    REQUIRE(small.percentile(80.0) == 16);
+    REQUIRE(small.percentile(100.0) == 17);
+  }
+
+  SECTION("merging is like recording all the samples") {
+    LatencyHistogram first, second, all;
+    for (int64_t usec = 0; usec < 100000; usec += 7) {
+      ((usec % 2) ? first : second).record(usec);
+      all.record(usec);
+    }
+    first.merge(LatencyHistogram{});
+    first.merge(second);
+    REQUIRE(first.count() == all.count());
+    REQUIRE(first.min() == all.min());
+    REQUIRE(first.max() == all.max());
+    REQUIRE(first.to_json() == all.to_json());
+  }
+
+  SECTION("we can export to JSON") {
+    auto doc = nlohmann::json::parse(histogram.to_json());
+    REQUIRE(doc.at("count") == 1000);
+    REQUIRE(doc.at("max") == 1000);
+    REQUIRE(doc.at("p50") == histogram.percentile(50.0));
+    uint64_t count = 0;
+    uint64_t previous = 0;
+    for (auto &bucket : doc.at("buckets")) {
+      REQUIRE(bucket.at(0).get<uint64_t>() >= previous);
+      previous = bucket.at(0).get<uint64_t>();
+      count += bucket.at(1).get<uint64_t>();
+    }
+    REQUIRE(count == 1000);
+  }
+}
+
+#ifndef _WIN32
+// temporary_directory is a temporary directory removed when out of scope.
+class temporary_directory {
+ public:
+  temporary_directory() {
+    char path[] = "/tmp/mkcollector-tests-XXXXXX";
+    REQUIRE(mkdtemp(path) != nullptr);
+    path_ = path;
+  }
+
+  const std::string &path() const { return path_; }
+
+  // files returns the names of the files in the directory.
+  std::vector<std::string> files() const {
+    std::vector<std::string> names;
+    DIR *dir = opendir(path_.c_str());
+    REQUIRE(dir != nullptr);
+    struct dirent *de = nullptr;
+    while ((de = readdir(dir)) != nullptr) {
+      std::string name = de->d_name;
+      if (name != "." && name != "..") {
+        names.push_back(std::move(name));
+      }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+  }
+
+  ~temporary_directory() {
+    for (auto &name : files()) {
+      (void)unlink((path_ + "/" + name).c_str());
+    }
+    (void)rmdir(path_.c_str());
+  }
+
+ private:
+  std::string path_;
+};
+
+TEST_CASE("Spool works as expected") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  std::string spooldir = tmpdir.path();
+  std::string reason;
+
+  SECTION("entries survive reopening and are removed in place") {
+    {
+      Spool spool{spooldir};
+      REQUIRE(spool.open(reason));
+      for (auto s : {"a", "bb", "ccc"}) {
+        REQUIRE(spool.append(s, reason));
+      }
+      std::vector<SpoolEntry> entries;
+      REQUIRE(spool.read(2, entries, reason));
+      REQUIRE(entries.size() == 2);
+      REQUIRE(entries[0].measurement == "a");
+      REQUIRE(entries[1].measurement == "bb");
+      REQUIRE(spool.remove(entries[1], reason));
+      REQUIRE(!spool.remove(entries[1], reason));
+      REQUIRE(spool.size() == 2);
+    }
+    Spool spool{spooldir};
+    REQUIRE(spool.open(reason));
+    REQUIRE(spool.size() == 2);
+    std::vector<SpoolEntry> entries;
+    REQUIRE(spool.read(10, entries, reason));
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[0].measurement == "a");
+    REQUIRE(entries[1].measurement == "ccc");
+  }
+
+  SECTION("we discard records that were not completely written") {
+    {
+      Spool spool{spooldir};
+      REQUIRE(spool.open(reason));
+      REQUIRE(spool.append("a", reason));
+      REQUIRE(spool.append("bb", reason));
+    }
+    REQUIRE(tmpdir.files() == (std::vector<std::string>{
+                                  "00000000000000000001.spool", "lock"}));
+    std::string segment = spooldir + "/00000000000000000001.spool";
+    struct stat st{};
+    REQUIRE(stat(segment.c_str(), &st) == 0);
+    // Simulate a crash while writing the second record.
+    REQUIRE(truncate(segment.c_str(), st.st_size - 1) == 0);
+    {
+      Spool spool{spooldir};
+      REQUIRE(spool.open(reason));
+      REQUIRE(spool.size() == 1);
+      REQUIRE(spool.append("ccc", reason));
+    }
+    Spool spool{spooldir};
+    REQUIRE(spool.open(reason));
+    std::vector<SpoolEntry> entries;
+    REQUIRE(spool.read(10, entries, reason));
+    REQUIRE(entries.size() == 2);
+    REQUIRE(entries[0].measurement == "a");
+    REQUIRE(entries[1].measurement == "ccc");
+  }
+
+  SECTION("we delete segments once consumed") {
+    Spool spool{spooldir};
+    spool.set_max_segment_size(64);
+    spool.set_sync_interval(1);
+    REQUIRE(spool.open(reason));
+    for (size_t i = 0; i < 8; ++i) {
+      REQUIRE(spool.append(std::string(32, 'x'), reason));
+    }
+    std::vector<SpoolEntry> entries;
+    REQUIRE(spool.read(10, entries, reason));
+    REQUIRE(entries.size() == 8);
+    for (auto &entry : entries) {
+      REQUIRE(spool.remove(entry, reason));
+    }
+    REQUIRE(spool.size() == 0);
+    // We only keep the segment we're appending to.
+    REQUIRE(tmpdir.files() == (std::vector<std::string>{
+                                  "00000000000000000008.spool", "lock"}));
+  }
+
+  SECTION("we delete consumed segments when we stop appending to them") {
+    Spool spool{spooldir};
+    spool.set_max_segment_size(64);
+    REQUIRE(spool.open(reason));
+    REQUIRE(spool.append(std::string(32, 'x'), reason));
+    std::vector<SpoolEntry> entries;
+    REQUIRE(spool.read(10, entries, reason));
+    REQUIRE(entries.size() == 1);
+    REQUIRE(spool.remove(entries[0], reason));
+    REQUIRE(tmpdir.files() == (std::vector<std::string>{
+                                  "00000000000000000001.spool", "lock"}));
+    // The next record does not fit into the consumed segment.
+    REQUIRE(spool.append(std::string(32, 'y'), reason));
+    REQUIRE(tmpdir.files() == (std::vector<std::string>{
+                                  "00000000000000000002.spool", "lock"}));
+    REQUIRE(spool.size() == 1);
+  }
+
+  SECTION("two instances cannot use the same spool") {
+    Spool spool{spooldir};
+    REQUIRE(spool.open(reason));
+    Spool other{spooldir};
+    REQUIRE(!other.open(reason));
+    REQUIRE(reason.find("spool: cannot lock") == 0);
+  }
+}
+
+TEST_CASE("Reporter can spool failed measurements") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  auto spool = std::make_shared<Spool>(tmpdir.path());
+  std::string reason;
+  REQUIRE(spool->open(reason));
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  REQUIRE(reporter.spool() == nullptr);
+  reporter.set_spool(spool);
+  REQUIRE(reporter.spool() == spool);
+  reporter.set_base_url(closed_port_base_url);
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  {
+    std::string measurement = dummy_measurement("");
+    REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+        measurement, logs, 0, stats, reason));
+    std::vector<std::string> measurements{dummy_measurement(""), "{"};
+    auto results = reporter.submit_batch(measurements, logs, 0, stats);
+    REQUIRE(!results[0].good);
+    REQUIRE(!results[1].good);
+  }
+  REQUIRE(stats.spool_append_okay == 2);  // the invalid one is not spooled
+  REQUIRE(spool->size() == 2);
+  REQUIRE(reporter.drain_spool(10, logs, 0, stats) == 0);
+  REQUIRE(spool->size() == 2);
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  reporter.set_base_url(collector.base_url());
+  REQUIRE(reporter.drain_spool(1, logs, 0, stats) == 1);
+  REQUIRE(reporter.drain_spool(10, logs, 0, stats) == 1);
+  REQUIRE(spool->size() == 0);
+  REQUIRE(stats.spool_remove_okay == 2);
+  REQUIRE(collector.stats().updates == 2);
+}
+
+TEST_CASE("Reporter drains the measurements it cannot submit") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  auto spool = std::make_shared<Spool>(tmpdir.path());
+  std::string reason;
+  REQUIRE(spool->open(reason));
+  // The scanner accepts this measurement, but validation rejects it.
+  auto doc = nlohmann::json::parse(dummy_measurement(""));
+  doc["data_format_version"] = "0.1.0";
+  REQUIRE(spool->append(doc.dump(), reason));
+  for (size_t i = 0; i < 2; ++i) {
+    REQUIRE(spool->append(dummy_measurement(""), reason));
+  }
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  reporter.set_spool(spool);
+  reporter.set_base_url(collector.base_url());
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  REQUIRE(reporter.drain_spool(1, logs, 0, stats) == 1);
+  REQUIRE(stats.update_report_error == 1);
+  REQUIRE(reporter.drain_spool(10, logs, 0, stats) == 2);
+  REQUIRE(spool->size() == 0);
+  REQUIRE(collector.stats().updates == 2);
+
+  SECTION("and it does not spool them") {
+    std::string measurement = doc.dump();
+    REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+        measurement, logs, 0, stats, reason));
+    std::vector<std::string> measurements{doc.dump()};
+    REQUIRE(!reporter.submit_batch(measurements, logs, 0, stats)[0].good);
+    REQUIRE(spool->size() == 0);
+  }
+}
+
+TEST_CASE("We can submit measurements without copying them") {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+
+  SECTION("update can take ownership of the request") {
+    Settings settings;
+    settings.base_url = collector.base_url();
+    OpenRequest open_request;
+    open_request.probe_asn = "AS0";
+    open_request.probe_cc = "ZZ";
+    open_request.software_name = "mkcollector-unit-tests";
+    open_request.software_version = "0.0.1";
+    open_request.test_name = "dummy";
+    open_request.test_start_time = "2018-11-01 15:33:17";
+    open_request.test_version = "0.0.1";
+    auto open_response = open(open_request, settings);
+    REQUIRE(open_response.good);
+    UpdateRequest request;
+    request.report_id = open_response.report_id;
+    request.content = dummy_measurement(open_response.report_id);
+    auto response = update(std::move(request), settings);
+    REQUIRE(response.good);
+    REQUIRE(collector.stats().updates == 1);
+    request.report_id = open_response.report_id;
+    request.content = "{";
+    REQUIRE(!update(std::move(request), settings).good);
+  }
+
+  SECTION("Reporter can consume the measurement") {
+    for (bool splicing : {false, true}) {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      reporter.set_report_id_splicing(splicing);
+      Reporter::Stats stats;
+      std::vector<std::string> logs;
+      std::string reason;
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+      REQUIRE(stats.update_report_okay == 1);
+    }
+    REQUIRE(collector.stats().updates == 2);
+  }
+
+  SECTION("Reporter spools a consumed measurement on failure") {
+    temporary_directory tmpdir;
+    auto spool = std::make_shared<Spool>(tmpdir.path());
+    std::string reason;
+    REQUIRE(spool->open(reason));
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.set_report_id_splicing(true);
+    reporter.set_spool(spool);
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    // We only spool measurements that failed because of transient errors.
+    MKMOCK_WITH_ENABLED_HOOK(update_response_status_code, 500, {
+      REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+    });
+    REQUIRE(spool->size() == 1);
+    REQUIRE(reporter.drain_spool(1, logs, 0, stats) == 1);
+    REQUIRE(collector.stats().updates == 2);
+  }
+}
+
+TEST_CASE("Reporter can close reports in background") {
+  using namespace mk::collector;
+  LoopbackCollector::Config config;
+  config.latency = 300;
+  LoopbackCollector collector{config};
+  REQUIRE(collector.good());
+  std::unique_ptr<Reporter> reporter{
+      new Reporter{"mkcollector-unit-tests", "0.0.1"}};
+  reporter->set_base_url(collector.base_url());
+  REQUIRE(!reporter->background_close());
+  reporter->set_background_close(true);
+  REQUIRE(reporter->background_close());
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+  REQUIRE(reporter->maybe_discover_and_submit_with_stats_and_reason(
+      dummy_measurement(""), logs, 0, stats, reason));
+  auto begin = std::chrono::steady_clock::now();
+  reporter.reset();
+  REQUIRE(std::chrono::steady_clock::now() - begin <
+          std::chrono::milliseconds(config.latency));
+  REQUIRE(!Reporter::flush(std::chrono::steady_clock::now()));
+  REQUIRE(Reporter::flush(std::chrono::steady_clock::now() +
+                          std::chrono::seconds(10)));
+  REQUIRE(collector.stats().reports_closed == 1);
+}
+
+TEST_CASE("Reporter closes the next report in background") {
+  using namespace mk::collector;
+  LoopbackCollector::Config config;
+  config.latency = 300;
+  LoopbackCollector collector{config};
+  REQUIRE(collector.good());
+  std::unique_ptr<Reporter> reporter{
+      new Reporter{"mkcollector-unit-tests", "0.0.1"}};
+  reporter->set_base_url(collector.base_url());
+  reporter->set_background_close(true);
+  ReportRotationPolicy policy;
+  policy.max_measurements = 1;
+  reporter->set_report_rotation_policy(policy);
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+  // The successful submission starts opening the next report, which we
+  // must not wait for when we are destroyed.
+  REQUIRE(reporter->maybe_discover_and_submit_with_stats_and_reason(
+      dummy_measurement(""), logs, 0, stats, reason));
+  auto begin = std::chrono::steady_clock::now();
+  reporter.reset();
+  REQUIRE(std::chrono::steady_clock::now() - begin <
+          std::chrono::milliseconds(config.latency));
+  REQUIRE(Reporter::flush(std::chrono::steady_clock::now() +
+                          std::chrono::seconds(10)));
+  REQUIRE(collector.stats().reports_opened == 2);
+  REQUIRE(collector.stats().reports_closed == 2);
+}
+
+TEST_CASE("Reporter rotates reports according to the policy") {
+  using namespace mk::collector;
+  LoopbackCollector collector;
+  REQUIRE(collector.good());
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+
+  SECTION("when the report has too many measurements") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    ReportRotationPolicy policy;
+    policy.max_measurements = 2;
+    reporter.set_report_rotation_policy(policy);
+    REQUIRE(reporter.report_rotation_policy().max_measurements == 2);
+    std::vector<std::string> report_ids;
+    for (size_t i = 0; i < 5; ++i) {
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+      report_ids.push_back(reporter.report_id());
+      // Give the next report the time to be open.
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    REQUIRE(stats.report_rotated == 2);
+    REQUIRE(stats.open_report_okay == 3);
+    REQUIRE(report_ids[0] == report_ids[1]);
+    REQUIRE(report_ids[1] != report_ids[2]);
+    REQUIRE(report_ids[2] == report_ids[3]);
+    REQUIRE(report_ids[3] != report_ids[4]);
+    REQUIRE(Reporter::flush(std::chrono::steady_clock::now() +
+                            std::chrono::seconds(10)));
+    REQUIRE(collector.stats().reports_closed == 2);
+  }
+
+  SECTION("when the report is too large") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    ReportRotationPolicy policy;
+    policy.max_bytes = 1;
+    reporter.set_report_rotation_policy(policy);
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(stats.report_rotated == 1);
+  }
+
+  SECTION("when the report is too old") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    ReportRotationPolicy policy;
+    policy.max_age = 1;
+    reporter.set_report_rotation_policy(policy);
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    // The first submission starts opening the next report and the second
+    // one uses the next report.
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(stats.report_rotated == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(stats.report_rotated == 1);
+  }
+
+  SECTION("but not when the open request changes") {
+    {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      ReportRotationPolicy policy;
+      policy.max_measurements = 1;
+      reporter.set_report_rotation_policy(policy);
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+      std::string measurement =
+          dummy_measurement_with_nettest_name("", "other");
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          measurement, logs, 0, stats, reason));
+      REQUIRE(stats.report_rotated == 0);
+    }
+    // We close both reports and the next report of each of them.
+    REQUIRE(collector.stats().reports_opened == 4);
+    REQUIRE(collector.stats().reports_closed == 4);
+  }
+}
+
+TEST_CASE("Reporter::prepare works as expected") {
+  using namespace mk::collector;
+  LoopbackCollector::Config config;
+  config.latency = 200;
+  LoopbackCollector collector{config};
+  REQUIRE(collector.good());
+  OpenRequest request;
+  request.probe_asn = "AS0";
+  request.probe_cc = "ZZ";
+  request.test_name = "dummy";
+  request.test_start_time = "2018-11-01 15:33:17";
+  request.test_version = "0.0.1";
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+
+  SECTION("when the measurement belongs to the prepared report") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.prepare(request);
+    reporter.prepare(request);  // should be a no-op
+    // Give the report the time to be open.
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    auto begin = std::chrono::steady_clock::now();
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(std::chrono::steady_clock::now() - begin <
+            std::chrono::milliseconds(2 * config.latency));
+    REQUIRE(stats.report_prepared == 1);
+    REQUIRE(stats.open_report_okay == 1);
+    REQUIRE(stats.update_report_okay == 1);
+    REQUIRE(collector.stats().reports_opened == 1);
+    reporter.prepare(request);  // the report is already open
+    REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(stats.report_prepared == 1);
+    REQUIRE(collector.stats().reports_opened == 1);
+  }
+
+  SECTION("when the measurement belongs to another report") {
+    {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      request.test_name = "other";
+      reporter.prepare(request);
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+      REQUIRE(stats.report_prepared == 1);
+      REQUIRE(stats.open_report_okay == 2);
+      REQUIRE(stats.close_report_okay == 1);
+    }
+    REQUIRE(collector.stats().reports_opened == 2);
+    REQUIRE(collector.stats().reports_closed == 2);
+  }
+
+  SECTION("when we cannot prepare the report") {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(closed_port_base_url);
+    reporter.prepare(request);
+    REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+        dummy_measurement(""), logs, 0, stats, reason));
+    REQUIRE(stats.report_prepared == 0);
+    REQUIRE(stats.open_report_error == 2);
+  }
+
+  SECTION("when the reporter is destroyed") {
+    {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      reporter.prepare(request);
+    }
+    REQUIRE(collector.stats().reports_opened == 1);
+    REQUIRE(collector.stats().reports_closed == 1);
+  }
+
+  SECTION("when the reporter is destroyed closing in background") {
+    auto begin = std::chrono::steady_clock::now();
+    {
+      Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+      reporter.set_base_url(collector.base_url());
+      reporter.set_background_close(true);
+      reporter.prepare(request);
+    }
+    REQUIRE(std::chrono::steady_clock::now() - begin <
+            std::chrono::milliseconds(config.latency));
+    REQUIRE(Reporter::flush(std::chrono::steady_clock::now() +
+                            std::chrono::seconds(10)));
+    REQUIRE(collector.stats().reports_opened == 1);
+    REQUIRE(collector.stats().reports_closed == 1);
+  }
+}
+
+TEST_CASE("Reporter::resubmit_file works as expected") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  std::string path = tmpdir.path() + "/report.jsonl";
+  std::string content = dummy_measurement("") + "\n{\n\r\n" +
+                        dummy_measurement("") + "\r\n" +
+                        dummy_measurement("");
+  {
+    std::ofstream file{path, std::ios::binary};
+    file << content;
+  }
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+
+  SECTION("we cannot resubmit a missing file") {
+    auto result = reporter.resubmit_file(tmpdir.path() + "/nonexistent", 0,
+                                         0, logs, 0, stats);
+    REQUIRE(!result.good);
+    REQUIRE(result.reason.find("resubmit: cannot open file") == 0);
+  }
+
+  SECTION("we cannot start past the end of the file") {
+    auto result = reporter.resubmit_file(path, content.size() + 1, 0, logs,
+                                         0, stats);
+    REQUIRE(!result.good);
+    REQUIRE(result.offset == content.size() + 1);
+  }
+
+  SECTION("we can resume from the returned offset") {
+    reporter.set_base_url(closed_port_base_url);
+    auto result = reporter.resubmit_file(path, 0, 0, logs, 0, stats);
+    REQUIRE(!result.good);
+    REQUIRE(result.reason != "");
+    REQUIRE(result.offset == 0);
+    REQUIRE(result.okay == 0);
+    LoopbackCollector collector;
+    REQUIRE(collector.good());
+    reporter.set_base_url(collector.base_url());
+    result = reporter.resubmit_file(path, result.offset, 2, logs, 0, stats);
+    REQUIRE(!result.good);
+    REQUIRE(result.reason == "");
+    REQUIRE(result.offset == content.find("{\n") + 2);
+    REQUIRE(result.okay == 1);
+    REQUIRE(result.skipped == 1);
+    result = reporter.resubmit_file(path, result.offset, 0, logs, 0, stats);
+    REQUIRE(result.good);
+    REQUIRE(result.offset == content.size());
+    REQUIRE(result.okay == 2);
+    REQUIRE(result.skipped == 0);
+    REQUIRE(collector.stats().reports_opened == 1);
+    REQUIRE(collector.stats().updates == 3);
+    result = reporter.resubmit_file(path, result.offset, 0, logs, 0, stats);
+    REQUIRE(result.good);
+    REQUIRE(result.okay == 0);
+  }
+
+  SECTION("we skip the measurements that fail validation") {
+    // The scanner accepts this measurement, but validation rejects it.
+    auto doc = nlohmann::json::parse(dummy_measurement(""));
+    doc["data_format_version"] = "0.1.0";
+    {
+      std::ofstream file{path, std::ios::binary};
+      file << doc.dump() << "\n" << dummy_measurement("") << "\n";
+    }
+    LoopbackCollector collector;
+    REQUIRE(collector.good());
+    reporter.set_base_url(collector.base_url());
+    auto result = reporter.resubmit_file(path, 0, 0, logs, 0, stats);
+    REQUIRE(result.good);
+    REQUIRE(result.reason == "");
+    REQUIRE(result.okay == 1);
+    REQUIRE(result.skipped == 1);
+    REQUIRE(collector.stats().updates == 1);
+  }
+
+  SECTION("we do not count empty lines as measurements") {
+    {
+      std::ofstream file{path, std::ios::binary};
+      file << "\n\r\n\n" << dummy_measurement("") << "\n";
+    }
+    LoopbackCollector collector;
+    REQUIRE(collector.good());
+    reporter.set_base_url(collector.base_url());
+    auto result = reporter.resubmit_file(path, 0, 1, logs, 0, stats);
+    REQUIRE(result.good);
+    REQUIRE(result.okay == 1);
+    REQUIRE(collector.stats().updates == 1);
+  }
+}
+
+TEST_CASE("replace_file_ works as expected") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  std::string path = tmpdir.path() + "/file.json";
+  std::vector<std::string> contents;
+  for (char c : {'a', 'b', 'c', 'd'}) {
+    contents.push_back(std::string(1 << 20, c));
+  }
+  // Concurrent writers must not interleave their writes. Note that we
+  // cannot use REQUIRE in threads, since Catch is not thread safe.
+  std::atomic<size_t> failures{0};
+  std::vector<std::thread> threads;
+  for (auto &data : contents) {
+    threads.emplace_back([&path, &data, &failures]() {
+      for (size_t i = 0; i < 8; ++i) {
+        failures += !replace_file_(path, data);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(failures == 0);
+  REQUIRE(tmpdir.files() == std::vector<std::string>{"file.json"});
+  std::ifstream file{path};
+  std::string data{std::istreambuf_iterator<char>{file},
+                   std::istreambuf_iterator<char>{}};
+  REQUIRE(std::find(contents.begin(), contents.end(), data) !=
+          contents.end());
+  struct stat st {};
+  REQUIRE(stat(path.c_str(), &st) == 0);
+  REQUIRE((st.st_mode & 0777) == 0600);
+}
+
+TEST_CASE("Reporter can cache discovered collectors") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  std::string path = tmpdir.path() + "/collectors.json";
+  std::vector<mk::bouncer::Record> records(2);
+  records[0].type = "onion";
+  records[0].address = "httpo://ihiderha53f36lsd.onion";
+  records[1].type = "https";
+  records[1].address = closed_port_base_url;
+  // submit_with_cache submits a measurement using a new Reporter that uses
+  // the cache at @p path and returns the Stats. The open request fails.
+  auto submit_with_cache = [&](int64_t ttl, Reporter::Stats &stats) {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    REQUIRE(reporter.collector_cache_path() == "");
+    reporter.set_collector_cache_path(path);
+    REQUIRE(reporter.collector_cache_path() == path);
+    REQUIRE(reporter.collector_cache_ttl() == 86400);
+    reporter.set_collector_cache_ttl(ttl);
+    reporter.set_collector_max_failures(2);
+    REQUIRE(reporter.collector_max_failures() == 2);
+    std::vector<std::string> logs;
+    std::string reason;
+    for (size_t i = 0; i < 3; ++i) {
+      std::string measurement = dummy_measurement("");
+      REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+          measurement, logs, 0, stats, reason));
+    }
+  };
+
+  SECTION("we use the bouncer only when the cache is empty") {
+    Reporter::Stats stats;
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, true, {
+      MKMOCK_WITH_ENABLED_HOOK(bouncer_response_collectors, records, {
+        submit_with_cache(3600, stats);
+      });
+    });
+    // The first failure invalidates the previous collector and we query the
+    // bouncer again. We never use the cache because it's invalidated.
+    REQUIRE(stats.bouncer_okay == 2);
+    REQUIRE(stats.bouncer_cache_hit == 0);
+    REQUIRE(stats.bouncer_cache_invalidated == 1);
+    REQUIRE(tmpdir.files() == std::vector<std::string>{"collectors.json"});
+  }
+
+  SECTION("we share the cache between Reporters and processes") {
+    Reporter::Stats stats;
+    Reporter first{"mkcollector-unit-tests", "0.0.1"};
+    first.set_collector_cache_path(path);
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, true, {
+      MKMOCK_WITH_ENABLED_HOOK(bouncer_response_collectors, records, {
+        std::vector<std::string> logs;
+        std::string reason;
+        std::string measurement = dummy_measurement("");
+        REQUIRE(!first.maybe_discover_and_submit_with_stats_and_reason(
+            measurement, logs, 0, stats, reason));
+      });
+    });
+    REQUIRE(stats.bouncer_okay == 1);
+    REQUIRE(first.base_url() == closed_port_base_url);
+    stats = {};
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, false, {
+      submit_with_cache(3600, stats);
+    });
+    // The first Reporter has already failed once, hence the cached collector
+    // is invalidated after another failure. Then the bouncer fails.
+    REQUIRE(stats.bouncer_cache_hit == 1);
+    REQUIRE(stats.bouncer_cache_invalidated == 1);
+    REQUIRE(stats.bouncer_error == 2);
+  }
+
+  SECTION("we reload the cache from disk") {
+    Reporter::Stats stats;
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, true, {
+      MKMOCK_WITH_ENABLED_HOOK(bouncer_response_collectors, records, {
+        Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+        reporter.set_collector_cache_path(path);
+        std::vector<std::string> logs;
+        std::string reason;
+        std::string measurement = dummy_measurement("");
+        REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+            measurement, logs, 0, stats, reason));
+      });
+    });
+    // Now nobody uses the cache, so the next Reporter reads the file.
+    stats = {};
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, false, {
+      submit_with_cache(3600, stats);
+    });
+    // We do not persist failures, hence we need two failures again.
+    REQUIRE(stats.bouncer_cache_hit == 1);
+    REQUIRE(stats.bouncer_cache_invalidated == 1);
+    REQUIRE(stats.bouncer_error == 1);
+  }
+
+  SECTION("we ignore expired and corrupt caches") {
+    Reporter::Stats stats;
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, true, {
+      MKMOCK_WITH_ENABLED_HOOK(bouncer_response_collectors, records, {
+        submit_with_cache(0, stats);
+      });
+    });
+    REQUIRE(stats.bouncer_cache_hit == 0);
+    {
+      std::ofstream file{path};
+      file << "{";
+    }
+    stats = {};
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, false, {
+      submit_with_cache(3600, stats);
+    });
+    REQUIRE(stats.bouncer_cache_hit == 0);
+    REQUIRE(stats.bouncer_error == 3);
+  }
+}
+
+TEST_CASE("Reporter resumes the TLS sessions saved by previous runs") {
+  using namespace mk::collector;
+  temporary_directory tmpdir;
+  std::string path = tmpdir.path() + "/tls-sessions.json";
+  LoopbackCollector::Config config;
+  config.tls = true;
+  LoopbackCollector collector{config};
+  REQUIRE(collector.good());
+  REQUIRE(collector.ca_bundle_path() != "");
+  // run submits measurements, keeping at most @p in_flight updates in
+  // flight, using a new Reporter, which hence needs new connections, and
+  // returns the Stats.
+  auto run = [&](const std::string &cache_path, size_t in_flight) {
+    Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+    reporter.set_base_url(collector.base_url());
+    reporter.set_ca_bundle_path(collector.ca_bundle_path());
+    REQUIRE(reporter.tls_session_cache_path() == "");
+    REQUIRE(reporter.set_tls_session_cache_path(cache_path));
+    REQUIRE(reporter.tls_session_cache_path() == cache_path);
+    std::vector<std::string> logs;
+    Reporter::Stats stats;
+    std::string reason;
+    if (in_flight <= 1) {
+      for (size_t i = 0; i < 4; ++i) {
+        REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+            dummy_measurement(""), logs, 0, stats, reason));
+      }
+      return stats;
+    }
+    reporter.set_max_updates_in_flight(in_flight);
+    std::vector<std::string> measurements(4, dummy_measurement(""));
+    for (auto &result : reporter.submit_batch(measurements, logs, 0, stats)) {
+      REQUIRE(result.good);
+    }
+    return stats;
+  };
+
+  SECTION("without the cache we do not count handshakes") {
+    auto stats = run("", 1);
+    REQUIRE(stats.tls_handshake_full == 0);
+    REQUIRE(stats.tls_handshake_resumed == 0);
+    REQUIRE(collector.stats().tls_resumed_handshakes == 0);
+  }
+
+  SECTION("with the cache we resume sessions after a restart") {
+    auto stats = run(path, 1);
+    // We open, update, and close the report over the same connection.
+    REQUIRE(stats.tls_handshake_full == 1);
+    REQUIRE(stats.tls_handshake_resumed == 0);
+    REQUIRE(collector.stats().tls_handshakes == 1);
+    REQUIRE(collector.stats().reports_closed == 1);
+    REQUIRE(tmpdir.files() == std::vector<std::string>{"tls-sessions.json"});
+    // The sessions are secrets, hence only we can read them.
+    struct stat st {};
+    REQUIRE(stat(path.c_str(), &st) == 0);
+    REQUIRE((st.st_mode & 0777) == 0600);
+    // Nobody uses the cache anymore, so the next Reporter reads the file.
+    stats = run(path, 1);
+    REQUIRE(stats.tls_handshake_full == 0);
+    REQUIRE(stats.tls_handshake_resumed == 1);
+    // Not even closing the report performs a full handshake.
+    REQUIRE(collector.stats().tls_handshakes == 2);
+    REQUIRE(collector.stats().tls_resumed_handshakes == 1);
+    REQUIRE(collector.stats().reports_closed == 2);
+  }
+
+  SECTION("we replace corrupt caches") {
+    {
+      std::ofstream file{path};
+      file << R"({"sessions": {"127.0.0.1": {"data": "zz", "expires": 1}}})";
+    }
+    auto stats = run(path, 1);
+    REQUIRE(stats.tls_handshake_full > 0);
+    stats = run(path, 1);
+    REQUIRE(stats.tls_handshake_full == 0);
+    REQUIRE(stats.tls_handshake_resumed > 0);
+  }
+
+  SECTION("we merge the sessions saved by other processes") {
+    LoopbackCollector other{config};
+    REQUIRE(other.good());
+    // submit submits a measurement to @p target using @p reporter.
+    auto submit = [&](Reporter &reporter, LoopbackCollector &target) {
+      reporter.set_base_url(target.base_url());
+      reporter.set_ca_bundle_path(target.ca_bundle_path());
+      REQUIRE(reporter.set_tls_session_cache_path(path));
+      std::vector<std::string> logs;
+      Reporter::Stats stats;
+      std::string reason;
+      REQUIRE(reporter.maybe_discover_and_submit_with_stats_and_reason(
+          dummy_measurement(""), logs, 0, stats, reason));
+      REQUIRE(stats.tls_handshake_full == 1);
+    };
+    Reporter first{"mkcollector-unit-tests", "0.0.1"};
+    submit(first, collector);
+    {
+      // Another process replaces the file meanwhile.
+      std::ofstream file{path};
+      file << R"({"sessions": {"example.org:443": )"
+           << R"({"data": "00", "expires": 4102444800}}})";
+    }
+    Reporter second{"mkcollector-unit-tests", "0.0.1"};
+    submit(second, other);
+    std::ifstream file{path};
+    nlohmann::json doc;
+    file >> doc;
+    REQUIRE(doc.at("sessions").size() == 3);
+    REQUIRE(doc.at("sessions").count("example.org:443") == 1);
+  }
+
+  SECTION("with many updates in flight") {
+    auto stats = run(path, 2);
+    REQUIRE(stats.tls_handshake_full > 0);
+    auto before = collector.stats();
+    stats = run(path, 2);
+    REQUIRE(stats.tls_handshake_full == 0);
+    REQUIRE(stats.tls_handshake_resumed > 0);
+    auto after = collector.stats();
+    REQUIRE(after.tls_handshakes - before.tls_handshakes ==
+            after.tls_resumed_handshakes - before.tls_resumed_handshakes);
+  }
+}
+
+TEST_CASE("probe_collectors works as expected") {
+  using namespace mk::collector;
+  LoopbackCollector first, second;
+  REQUIRE(first.good());
+  REQUIRE(second.good());
+  Settings settings;
+  settings.timeout = 5;
+  auto probes = probe_collectors(
+      {closed_port_base_url, first.base_url(), second.base_url()}, settings);
+  REQUIRE(probes.size() == 3);
+  REQUIRE(probes[0].good);
+  REQUIRE(probes[0].reason == "");
+  REQUIRE(probes[0].ttfb >= probes[0].connect_time);
+  REQUIRE(probes[1].good);
+  REQUIRE(probes[0].ttfb <= probes[1].ttfb);
+  REQUIRE(!probes[2].good);
+  REQUIRE(probes[2].base_url == closed_port_base_url);
+  REQUIRE(probes[2].reason != "");
+  REQUIRE(first.stats().probes == 1);
+  REQUIRE(second.stats().probes == 1);
+  REQUIRE(first.stats().bad_requests == 0);
+}
+
+TEST_CASE("Reporter fails over to the next fastest collector") {
+  using namespace mk::collector;
+  std::unique_ptr<LoopbackCollector> first{new LoopbackCollector};
+  std::unique_ptr<LoopbackCollector> second{new LoopbackCollector};
+  std::vector<mk::bouncer::Record> records(3);
+  records[0].address = closed_port_base_url;
+  records[1].address = first->base_url();
+  records[2].address = second->base_url();
+  for (auto &record : records) {
+    record.type = "https";
+  }
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  REQUIRE(reporter.collector_probing());
+  REQUIRE(reporter.collectors().empty());
+  reporter.set_collector_max_failures(2);
+  Reporter::Stats stats;
+  std::vector<std::string> logs;
+  std::string reason;
+  auto submit = [&]() {
+    std::string measurement = dummy_measurement("");
+    return reporter.maybe_discover_and_submit_with_stats_and_reason(
+        measurement, logs, 0, stats, reason);
+  };
+  MKMOCK_WITH_ENABLED_HOOK(bouncer_response_good, true, {
+    MKMOCK_WITH_ENABLED_HOOK(bouncer_response_collectors, records, {
+      REQUIRE(submit());
+    });
+  });
+  REQUIRE(stats.collector_probe_okay == 2);
+  REQUIRE(stats.collector_probe_error == 1);
+  auto collectors = reporter.collectors();
+  REQUIRE(collectors.size() == 3);
+  REQUIRE(collectors[2].probe.base_url == closed_port_base_url);
+  REQUIRE(collectors[0].successes == 2);  // open and update
+  REQUIRE(reporter.base_url() == collectors[0].probe.base_url);
+  // Stop the fastest collector and make sure we use the other one.
+  if (first->base_url() != reporter.base_url()) {
+    std::swap(first, second);
+  }
+  first.reset();
+  REQUIRE(!submit());
+  REQUIRE(!submit());
+  REQUIRE(submit());
+  REQUIRE(stats.collector_failover == 1);
+  REQUIRE(reporter.base_url() == second->base_url());
+  REQUIRE(reporter.collectors()[0].failures == 2);
+  REQUIRE(reporter.collectors()[1].successes == 2);
+  REQUIRE(second->stats().updates == 1);
+  REQUIRE(stats.bouncer_okay == 1);
+}
+#endif
+
+TEST_CASE("is_retryable_failure works as expected") {
+  using namespace mk::collector;
+  REQUIRE(is_retryable_failure(CURLE_COULDNT_CONNECT, 0));
+  REQUIRE(is_retryable_failure(CURLE_OPERATION_TIMEDOUT, 0));
+  REQUIRE(!is_retryable_failure(CURLE_SSL_CACERT_BADFILE, 0));
+  REQUIRE(!is_retryable_failure(CURLE_URL_MALFORMAT, 0));
+  REQUIRE(is_retryable_failure(0, 500));
+  REQUIRE(is_retryable_failure(0, 503));
+  REQUIRE(is_retryable_failure(0, 429));
+  REQUIRE(!is_retryable_failure(0, 400));
+  REQUIRE(!is_retryable_failure(0, 404));
+}
+
+TEST_CASE("retry_delay_ works as expected") {
+  using namespace mk::collector;
+  RetryPolicy policy;
+  policy.initial_backoff = 100;
+  policy.max_backoff = 1000;
+  policy.jitter = 0.0;
+  REQUIRE(retry_delay_(policy, 1).count() == 100);
+  REQUIRE(retry_delay_(policy, 2).count() == 200);
+  REQUIRE(retry_delay_(policy, 4).count() == 800);
+  REQUIRE(retry_delay_(policy, 5).count() == 1000);
+  REQUIRE(retry_delay_(policy, 100).count() == 1000);
+  policy.jitter = 1.0;
+  for (size_t i = 0; i < 100; ++i) {
+    auto delay = retry_delay_(policy, 3).count();
+    REQUIRE(delay >= 0);
+    REQUIRE(delay <= 400);
+  }
+}
+
+TEST_CASE("We retry transient failures") {
+  using namespace mk::collector;
+  Settings settings;
+  settings.base_url = closed_port_base_url;
+  settings.retry_policy.max_attempts = 3;
+  settings.retry_policy.initial_backoff = 1;
+  UpdateRequest request;
+  request.report_id = "20180208T095233Z_AS0_x";
+  request.content = dummy_measurement(request.report_id);
+  auto count_retries = [](const std::vector<LogLine> &logs) {
+    size_t count = 0;
+    for (auto &line : logs) {
+      count += (line.message.find("Retrying in ") == 0);
+    }
+    return count;
+  };
+
+  SECTION("until we run out of attempts") {
+    auto re = update(request, settings);
+    REQUIRE(!re.good);
+    REQUIRE(re.retryable);
+    REQUIRE(count_retries(re.logs) == 2);
+  }
+
+  SECTION("but not when the failure is not transient") {
+    MKMOCK_WITH_ENABLED_HOOK(update_response_error, 0, {
+      MKMOCK_WITH_ENABLED_HOOK(update_response_status_code, 404, {
+        auto re = update(request, settings);
+        REQUIRE(!re.good);
+        REQUIRE(!re.retryable);
+        REQUIRE(count_retries(re.logs) == 0);
+      });
+    });
+  }
+}
+
+TEST_CASE("Reporter honours the retry policy") {
+  using namespace mk::collector;
+  Reporter reporter{"mkcollector-unit-tests", "0.0.1"};
+  reporter.set_base_url(closed_port_base_url);
+  RetryPolicy policy;
+  policy.max_attempts = 2;
+  policy.initial_backoff = 1;
+  REQUIRE(reporter.retry_policy().max_attempts == 1);
+
+  SECTION("and the circuit breaker fails fast") {
+    policy.breaker_threshold = 2;
+    policy.breaker_cooldown = 3600;
+    reporter.set_retry_policy(policy);
+    REQUIRE(reporter.retry_policy().breaker_threshold == 2);
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    std::string reason;
+    for (size_t i = 0; i < 3; ++i) {
+      std::string measurement = dummy_measurement("");
+      REQUIRE(!reporter.maybe_discover_and_submit_with_stats_and_reason(
+          measurement, logs, 0, stats, reason));
+    }
+    REQUIRE(stats.retry_attempt == 2);
+    REQUIRE(stats.circuit_breaker_trip == 1);
+    REQUIRE(stats.circuit_breaker_fail_fast == 1);
+    REQUIRE(stats.open_report_error == 3);
+    REQUIRE(reason == "collector: circuit breaker is open");
+  }
+
+  SECTION("and the circuit breaker lets a single call through") {
+    policy.max_attempts = 1;
+    policy.breaker_threshold = 1;
+    policy.breaker_cooldown = 0;
+    reporter.set_retry_policy(policy);
+    reporter.set_max_updates_in_flight(4);
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    MKMOCK_WITH_ENABLED_HOOK(open_response_error, 0, {
+      MKMOCK_WITH_ENABLED_HOOK(open_response_status_code, 200, {
+        MKMOCK_WITH_ENABLED_HOOK(open_response_body,
+                                 R"({"report_id": "20180208T095233Z_AS0_x"})",
+                                 {
+          for (size_t count : {1, 4}) {
+            std::vector<std::string> measurements(count,
+                                                  dummy_measurement(""));
+            for (auto &result :
+                 reporter.submit_batch(measurements, logs, 0, stats)) {
+              REQUIRE(!result.good);
+            }
+          }
+        });
+      });
+    });
+    // The second batch sends a single update after the cooldown, which
+    // opens again the circuit breaker, and fails fast the other ones.
+    REQUIRE(stats.circuit_breaker_trip == 2);
+    REQUIRE(stats.circuit_breaker_fail_fast == 3);
+    REQUIRE(stats.update_report_error == 5);
+  }
+
+  SECTION("when updates are in flight") {
+    reporter.set_retry_policy(policy);
+    reporter.set_max_updates_in_flight(4);
+    std::vector<std::string> measurements(4, dummy_measurement(""));
+    Reporter::Stats stats;
+    std::vector<std::string> logs;
+    MKMOCK_WITH_ENABLED_HOOK(open_response_error, 0, {
+      MKMOCK_WITH_ENABLED_HOOK(open_response_status_code, 200, {
+        MKMOCK_WITH_ENABLED_HOOK(open_response_body,
+                                 R"({"report_id": "20180208T095233Z_AS0_x"})",
+                                 {
+          for (auto &result :
+               reporter.submit_batch(measurements, logs, 0, stats)) {
+            REQUIRE(!result.good);
+          }
+        });
+      });
+    });
+    REQUIRE(stats.retry_attempt == 4);
+    REQUIRE(stats.update_report_error == 4);
+  }
+}